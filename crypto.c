@@ -1,3 +1,4 @@
+#include <string.h>
 #include "secudp/crypto.h"
  
 /*
@@ -17,32 +18,52 @@ void secudp_sign_keypair(void *pubKey, void *privKey)
 }
 
 /*
- *  Encrypt message. This always succeeds.
- *  Note that nonce is an in parameter.
+ *  Generate signature. This always succeeds.
  */
-void secudp_peer_encrypt(void *ciphertext, void *mac, const void *message, size_t len, void *nonce, const void *key) {
-  crypto_secretbox_detached(ciphertext, mac, message, len, nonce, key);
+void secudp_host_generate_signature(void *signature, const void *message, size_t len, const void *privKey) {
+  crypto_sign_detached(signature, NULL, message, len, privKey);
 }
 
 /*
- *  Decrypt message. This  returns < 0 if mac is bad and 0 otherwise.
+ *  Verify signature. This returns < 0 if signature is bad and 0 otherwise.
  */
-int secudp_peer_decrypt(void *message, const void *ciphertext, const void *mac, size_t len, const void *nonce, const void * key) {
-  return crypto_secretbox_open_detached(message, ciphertext, mac, len, nonce, key);    
+int secudp_host_verify_signature(const void *signature, const void *message, size_t len, const void *pubKey) {
+  return crypto_sign_verify_detached(signature, message, len, pubKey);
 }
 
 /*
- *  Generate signature. This always succeeds.
+ *  Lay out the message signed for a semi-static key exchange key,
+ *  the key followed by notAfter in network byte order.
  */
-void secudp_host_generate_signature(void *signature, const void *message, size_t len, const void *privKey) {
-  crypto_sign_detached(signature, NULL, message, len, privKey);
+static void secudp_kx_signed_message(unsigned char *message, const void *publicKx, secudp_uint32 notAfter) {
+  memcpy(message, publicKx, SECUDP_KX_PUBLICBYTES);
+  message[SECUDP_KX_PUBLICBYTES] = (unsigned char) (notAfter >> 24);
+  message[SECUDP_KX_PUBLICBYTES + 1] = (unsigned char) (notAfter >> 16);
+  message[SECUDP_KX_PUBLICBYTES + 2] = (unsigned char) (notAfter >> 8);
+  message[SECUDP_KX_PUBLICBYTES + 3] = (unsigned char) notAfter;
 }
 
 /*
- *  Verify signature. This returns < 0 if signature is bad and 0 otherwise.
+ *  Sign a key exchange key together with the time, in seconds
+ *  since the epoch, after which it must be refused. This always
+ *  succeeds.
  */
-int secudp_host_verify_signature(const void *signature, const void *message, size_t len, const void *pubKey) {
-  return crypto_sign_verify_detached(signature, message, len, pubKey);
+void secudp_host_sign_kx(void *signature, const void *publicKx, secudp_uint32 notAfter, const void *privKey) {
+  unsigned char message[SECUDP_KX_PUBLICBYTES + 4];
+
+  secudp_kx_signed_message(message, publicKx, notAfter);
+  secudp_host_generate_signature(signature, message, sizeof(message), privKey);
+}
+
+/*
+ *  Verify the signature of a key exchange key. This returns < 0 if
+ *  signature is bad and 0 otherwise. Expiry is left to the caller.
+ */
+int secudp_host_verify_kx(const void *signature, const void *publicKx, secudp_uint32 notAfter, const void *pubKey) {
+  unsigned char message[SECUDP_KX_PUBLICBYTES + 4];
+
+  secudp_kx_signed_message(message, publicKx, notAfter);
+  return secudp_host_verify_signature(signature, message, sizeof(message), pubKey);
 }
 
 /*
@@ -53,6 +74,14 @@ void secudp_peer_gen_key_exchange_pair(void *pubKey, void *secKey) {
   crypto_kx_keypair(pubKey, secKey);
 }
 
+/*
+ *  Compute the public key for a secret key drawn from the random
+ *  source, as crypto_kx_keypair does. This always succeeds.
+ */
+void secudp_peer_gen_key_exchange_public(void *pubKey, const void *secKey) {
+  crypto_scalarmult_base(pubKey, secKey);
+}
+
 /*
  *  Generate session keys. Use peer function in PEER_HELLO, host function in
  *  HOST_HELLO. These return < 0 if keys are bad and 0 otherwise.
@@ -64,3 +93,254 @@ int secudp_peer_gen_session_keys(void *selfSendKey, void *otherSendKey, const vo
 int secudp_host_gen_session_keys(void *selfSendKey, void *otherSendKey, const void *selfPubKey, const void *selfSecKey, const void *otherPubKey) {
   return crypto_kx_server_session_keys(selfSendKey, otherSendKey, selfPubKey, selfSecKey, otherPubKey);
 }
+
+/*
+ *  Derive the key used to seal whole datagrams from a session key,
+ *  so the session key itself is never used with two ciphers.
+ */
+void secudp_peer_gen_datagram_key(void *datagramKey, const void *sessionKey) {
+  crypto_kdf_derive_from_key(datagramKey, SECUDP_SESSIONKEYBYTES, 1, "SecUdpDG", sessionKey);
+}
+
+/*
+ *  Derive the prefix of the nonces used with a key. The rest of
+ *  each nonce is a counter, so nonces never repeat for a key.
+ */
+void secudp_gen_nonce_prefix(void *prefix, const void *key) {
+  crypto_kdf_derive_from_key(prefix, SECUDP_NONCE_PREFIXBYTES, 2, "SecUdpDG", key);
+}
+
+/*
+ *  Compute the mac over a handshake transcript with a key derived
+ *  from the session key the verifying side sends with, so only the
+ *  holder of the signed key exchange key can produce it. This
+ *  always succeeds.
+ */
+void secudp_gen_handshake_mac(void *mac, const void *transcript, size_t len, const void *sessionKey) {
+  unsigned char macKey[crypto_generichash_KEYBYTES];
+
+  crypto_kdf_derive_from_key(macKey, sizeof(macKey), 3, "SecUdpDG", sessionKey);
+  crypto_generichash(mac, SECUDP_MACBYTES, transcript, len, macKey, sizeof(macKey));
+  sodium_memzero(macKey, sizeof(macKey));
+}
+
+/*
+ *  Verify a handshake mac in constant time. This returns < 0 if
+ *  mac is bad and 0 otherwise.
+ */
+int secudp_verify_handshake_mac(const void *mac, const void *transcript, size_t len, const void *sessionKey) {
+  unsigned char expected[SECUDP_MACBYTES];
+
+  secudp_gen_handshake_mac(expected, transcript, len, sessionKey);
+  return sodium_memcmp(expected, mac, SECUDP_MACBYTES);
+}
+
+/*
+ *  Compute a connect cookie, a keyed hash of message. This
+ *  always succeeds.
+ */
+void secudp_host_gen_cookie(void *cookie, const void *message, size_t len, const void *cookieKey) {
+  crypto_generichash(cookie, SECUDP_COOKIEBYTES, message, len, cookieKey, SECUDP_COOKIE_KEYBYTES);
+}
+
+/*
+ *  Verify a connect cookie in constant time. This returns < 0
+ *  if cookie is bad and 0 otherwise.
+ */
+int secudp_host_verify_cookie(const void *cookie, const void *message, size_t len, const void *cookieKey) {
+  unsigned char expected[SECUDP_COOKIEBYTES];
+
+  secudp_host_gen_cookie(expected, message, len, cookieKey);
+  return sodium_memcmp(expected, cookie, SECUDP_COOKIEBYTES);
+}
+
+/*
+ *  Hash an address for the host's peer tables. The hash is
+ *  keyed so remote hosts cannot choose addresses that collide.
+ */
+size_t secudp_host_hash_address(const void *message, size_t len, const void *hashKey) {
+  unsigned char hash[crypto_shorthash_BYTES];
+  size_t result;
+
+  crypto_shorthash(hash, message, len, hashKey);
+  memcpy(&result, hash, sizeof(result));
+  return result;
+}
+
+/*
+ *  Table of cipher suites. Only XSalsa20-Poly1305 cannot
+ *  authenticate additional data, so ad must be empty there.
+ */
+typedef struct _SecUdpCipher
+{
+  size_t nonceBytes;
+  void (*encrypt)(void *ciphertext, void *mac, const void *message, size_t len, const void *ad, size_t adLen, const void *nonce, const void *key);
+  int (*decrypt)(void *message, const void *ciphertext, const void *mac, size_t len, const void *ad, size_t adLen, const void *nonce, const void *key);
+} SecUdpCipher;
+
+/*
+ *  The ad is left out of the mac here, so decrypting
+ *  refuses any ad rather than leave it unauthenticated.
+ */
+static void secudp_xsalsa20_encrypt(void *ciphertext, void *mac, const void *message, size_t len, const void *ad, size_t adLen, const void *nonce, const void *key) {
+  (void) ad;
+  (void) adLen;
+
+  crypto_secretbox_detached(ciphertext, mac, message, len, nonce, key);
+}
+
+static int secudp_xsalsa20_decrypt(void *message, const void *ciphertext, const void *mac, size_t len, const void *ad, size_t adLen, const void *nonce, const void *key) {
+  (void) ad;
+
+  if (message == NULL || adLen != 0)
+    return -1;
+  return crypto_secretbox_open_detached(message, ciphertext, mac, len, nonce, key);
+}
+
+static void secudp_chacha20_encrypt(void *ciphertext, void *mac, const void *message, size_t len, const void *ad, size_t adLen, const void *nonce, const void *key) {
+  crypto_aead_chacha20poly1305_ietf_encrypt_detached(ciphertext, mac, NULL, message, len, ad, adLen, NULL, nonce, key);
+}
+
+static int secudp_chacha20_decrypt(void *message, const void *ciphertext, const void *mac, size_t len, const void *ad, size_t adLen, const void *nonce, const void *key) {
+  return crypto_aead_chacha20poly1305_ietf_decrypt_detached(message, NULL, ciphertext, len, mac, ad, adLen, nonce, key);
+}
+
+static void secudp_aes256gcm_encrypt(void *ciphertext, void *mac, const void *message, size_t len, const void *ad, size_t adLen, const void *nonce, const void *key) {
+  crypto_aead_aes256gcm_encrypt_detached(ciphertext, mac, NULL, message, len, ad, adLen, NULL, nonce, key);
+}
+
+static int secudp_aes256gcm_decrypt(void *message, const void *ciphertext, const void *mac, size_t len, const void *ad, size_t adLen, const void *nonce, const void *key) {
+  return crypto_aead_aes256gcm_decrypt_detached(message, NULL, ciphertext, len, mac, ad, adLen, nonce, key);
+}
+
+static const SecUdpCipher ciphers[SECUDP_CIPHER_SUITE_COUNT] = {
+  { crypto_secretbox_NONCEBYTES, secudp_xsalsa20_encrypt, secudp_xsalsa20_decrypt },
+  { crypto_aead_chacha20poly1305_ietf_NPUBBYTES, secudp_chacha20_encrypt, secudp_chacha20_decrypt },
+  { crypto_aead_aes256gcm_NPUBBYTES, secudp_aes256gcm_encrypt, secudp_aes256gcm_decrypt }
+};
+
+/*
+ *  Bitmask of the cipher suites usable on this machine.
+ *  AES-256-GCM needs AES-NI and CLMUL, which libsodium
+ *  probes for in sodium_init.
+ */
+secudp_uint32 secudp_cipher_suites_available(void) {
+  secudp_uint32 suites = (1 << SECUDP_CIPHER_SUITE_XSALSA20_POLY1305) | (1 << SECUDP_CIPHER_SUITE_CHACHA20_POLY1305_IETF);
+
+  if (crypto_aead_aes256gcm_is_available())
+    suites |= 1 << SECUDP_CIPHER_SUITE_AES256_GCM;
+
+  return suites;
+}
+
+/*
+ *  Pick the preferred suite from a bitmask. This returns < 0
+ *  if the bitmask holds no known suite.
+ */
+int secudp_cipher_suite_select(secudp_uint32 suites) {
+  int suite;
+
+  for (suite = SECUDP_CIPHER_SUITE_COUNT - 1; suite >= 0; -- suite)
+    if (suites & (1 << suite))
+      return suite;
+
+  return -1;
+}
+
+/*
+ *  Build the nonce for a suite from a prefix, or zeros if prefix
+ *  is NULL, followed by the counter.
+ */
+void secudp_cipher_nonce(SecUdpCipherSuite suite, void *nonce, const void *prefix, const void *counter) {
+  size_t prefixBytes = ciphers[suite].nonceBytes - SECUDP_NONCE_COUNTERBYTES;
+
+  if (prefix != NULL)
+    memcpy(nonce, prefix, prefixBytes);
+  else
+    memset(nonce, 0, prefixBytes);
+  memcpy((unsigned char *) nonce + prefixBytes, counter, SECUDP_NONCE_COUNTERBYTES);
+}
+
+/*
+ *  Encrypt message. This always succeeds.
+ *  Message and ciphertext may be the same buffer.
+ */
+void secudp_cipher_encrypt(SecUdpCipherSuite suite, void *ciphertext, void *mac, const void *message, size_t len, const void *ad, size_t adLen, const void *nonce, const void *key) {
+  ciphers[suite].encrypt(ciphertext, mac, message, len, ad, adLen, nonce, key);
+}
+
+/*
+ *  Decrypt message. This returns < 0 if mac is bad and 0 otherwise.
+ *  Message and ciphertext may be the same buffer. If message is NULL
+ *  the ciphertext is only verified, and if ad is given it must be
+ *  authenticated, which only AEAD suites support.
+ */
+int secudp_cipher_decrypt(SecUdpCipherSuite suite, void *message, const void *ciphertext, const void *mac, size_t len, const void *ad, size_t adLen, const void *nonce, const void *key) {
+  return ciphers[suite].decrypt(message, ciphertext, mac, len, ad, adLen, nonce, key);
+}
+
+/*
+ *  XSalsa20-Poly1305 as in crypto_secretbox_detached, except the
+ *  HSalsa20 subkey is derived once. The first 16 nonce bytes are
+ *  the shared prefix, so the subkey is the same for every message.
+ */
+static void secudp_xsalsa20_encrypt_batch(void * const *messages, void * const *macs, const size_t *lengths, const void * const *counters, size_t count, const void *prefix, const void *key) {
+  unsigned char subkey[crypto_stream_salsa20_KEYBYTES];
+  unsigned char block0[64];
+  size_t i;
+
+  crypto_core_hsalsa20(subkey, prefix, key, NULL);
+
+  for (i = 0; i < count; ++ i) {
+    unsigned char *message = messages[i];
+    size_t len = lengths[i], len0 = len > sizeof(block0) - 32 ? sizeof(block0) - 32 : len;
+
+    memset(block0, 0, 32);
+    memcpy(block0 + 32, message, len0);
+    crypto_stream_salsa20_xor(block0, block0, len0 + 32, counters[i], subkey);
+    memcpy(message, block0 + 32, len0);
+    if (len > len0)
+      crypto_stream_salsa20_xor_ic(message + len0, message + len0, len - len0, counters[i], 1, subkey);
+    crypto_onetimeauth_poly1305(macs[i], message, len, block0);
+  }
+
+  sodium_memzero(block0, sizeof(block0));
+  sodium_memzero(subkey, sizeof(subkey));
+}
+
+/*
+ *  Encrypt several messages in place under one key, each with the
+ *  nonce built from prefix and its counter. Per-key setup is done
+ *  once for the whole batch: the HSalsa20 subkey for XSalsa20 and
+ *  the expanded key schedule for AES-256-GCM.
+ */
+void secudp_cipher_encrypt_batch(SecUdpCipherSuite suite, void * const *messages, void * const *macs, const size_t *lengths, const void * const *counters, size_t count, const void *prefix, const void *key) {
+  unsigned char nonce[SECUDP_NONCEBYTES];
+  size_t i;
+
+  switch (suite) {
+  case SECUDP_CIPHER_SUITE_XSALSA20_POLY1305:
+    secudp_xsalsa20_encrypt_batch(messages, macs, lengths, counters, count, prefix, key);
+    break;
+
+  case SECUDP_CIPHER_SUITE_AES256_GCM:
+  {
+    crypto_aead_aes256gcm_state state;
+
+    crypto_aead_aes256gcm_beforenm(&state, key);
+    for (i = 0; i < count; ++ i) {
+      secudp_cipher_nonce(suite, nonce, prefix, counters[i]);
+      crypto_aead_aes256gcm_encrypt_detached_afternm(messages[i], macs[i], NULL, messages[i], lengths[i], NULL, 0, NULL, nonce, &state);
+    }
+    sodium_memzero(&state, sizeof(state));
+    break;
+  }
+
+  default:
+    for (i = 0; i < count; ++ i) {
+      secudp_cipher_nonce(suite, nonce, prefix, counters[i]);
+      secudp_cipher_encrypt(suite, messages[i], macs[i], messages[i], lengths[i], NULL, 0, nonce, key);
+    }
+    break;
+  }
+}
@@ -4,8 +4,11 @@
 */
 #define SECUDP_BUILDING_LIB 1
 #include <string.h>
+#include <stddef.h>
+#include <time.h>
 #include "secudp/secudp.h"
 #include "secudp/crypto.h"
+#include "secudp/time.h"
 
 /** @defgroup host SecUdp host functions
     @{
@@ -31,6 +34,7 @@ secudp_host_create (const SecUdpAddress * address, const SecUdpHostSecret * secr
 {
     SecUdpHost * host;
     SecUdpPeer * currentPeer;
+    size_t fragmentPool;
 
     if (peerCount > SECUDP_PROTOCOL_MAXIMUM_PEER_ID)
       return NULL;
@@ -51,18 +55,107 @@ secudp_host_create (const SecUdpAddress * address, const SecUdpHostSecret * secr
     host -> peers = (SecUdpPeer *) secudp_malloc (peerCount * sizeof (SecUdpPeer));
     if (host -> peers == NULL)
     {
-       secudp_free (host);
        secudp_free (host -> secret);
+       secudp_free (host);
        return NULL;
     }
     memset (host -> peers, 0, peerCount * sizeof (SecUdpPeer));
 
+    host -> peerTimers = (SecUdpPeer **) secudp_malloc (peerCount * sizeof (SecUdpPeer *));
+    if (host -> peerTimers == NULL)
+    {
+       secudp_free (host -> peers);
+       secudp_free (host -> secret);
+       secudp_free (host);
+       return NULL;
+    }
+    host -> peerTimerCount = 0;
+
+    host -> freePeers = (SecUdpPeer **) secudp_malloc (peerCount * sizeof (SecUdpPeer *));
+    if (host -> freePeers == NULL)
+    {
+       secudp_free (host -> peerTimers);
+       secudp_free (host -> peers);
+       secudp_free (host -> secret);
+       secudp_free (host);
+       return NULL;
+    }
+
+    /* Keep the address tables at most half full. */
+    for (host -> peerAddressMask = 2; host -> peerAddressMask < peerCount * 2; host -> peerAddressMask <<= 1) ;
+    host -> peerAddresses = (SecUdpPeer **) secudp_malloc (host -> peerAddressMask * sizeof (SecUdpPeer *));
+    if (host -> peerAddresses == NULL)
+    {
+       secudp_free (host -> freePeers);
+       secudp_free (host -> peerTimers);
+       secudp_free (host -> peers);
+       secudp_free (host -> secret);
+       secudp_free (host);
+       return NULL;
+    }
+    memset (host -> peerAddresses, 0, host -> peerAddressMask * sizeof (SecUdpPeer *));
+
+    host -> peerHostCounts = (SecUdpHostAddressCount *) secudp_malloc (host -> peerAddressMask * sizeof (SecUdpHostAddressCount));
+    if (host -> peerHostCounts == NULL)
+    {
+       secudp_free (host -> peerAddresses);
+       secudp_free (host -> freePeers);
+       secudp_free (host -> peerTimers);
+       secudp_free (host -> peers);
+       secudp_free (host -> secret);
+       secudp_free (host);
+       return NULL;
+    }
+    memset (host -> peerHostCounts, 0, host -> peerAddressMask * sizeof (SecUdpHostAddressCount));
+    host -> peerAddressMask -= 1;
+
+    host -> receiveBatch = (SecUdpReceiveBatch *) secudp_malloc (sizeof (SecUdpReceiveBatch));
+    if (host -> receiveBatch == NULL)
+    {
+       secudp_free (host -> peerHostCounts);
+       secudp_free (host -> peerAddresses);
+       secudp_free (host -> freePeers);
+       secudp_free (host -> peerTimers);
+       secudp_free (host -> peers);
+       secudp_free (host -> secret);
+       secudp_free (host);
+       return NULL;
+    }
+    host -> receiveBatch -> count = 0;
+    host -> receiveBatch -> index = 0;
+    host -> receiveBatch -> segmentData = NULL;
+
+    host -> sendBatch = (SecUdpSendBatch *) secudp_malloc (sizeof (SecUdpSendBatch));
+    if (host -> sendBatch == NULL)
+    {
+       secudp_free (host -> receiveBatch);
+       secudp_free (host -> peerHostCounts);
+       secudp_free (host -> peerAddresses);
+       secudp_free (host -> freePeers);
+       secudp_free (host -> peerTimers);
+       secudp_free (host -> peers);
+       secudp_free (host -> secret);
+       secudp_free (host);
+       return NULL;
+    }
+    host -> sendBatch -> count = 0;
+    host -> segmentOffload = 0;
+    host -> uring = NULL;
+    host -> cryptoPool = NULL;
+    host -> packetPool = NULL;
+
     host -> socket = secudp_socket_create (SECUDP_SOCKET_TYPE_DATAGRAM);
     if (host -> socket == SECUDP_SOCKET_NULL || (address != NULL && secudp_socket_bind (host -> socket, address) < 0))
     {
        if (host -> socket != SECUDP_SOCKET_NULL)
          secudp_socket_destroy (host -> socket);
 
+       secudp_free (host -> sendBatch);
+       secudp_free (host -> receiveBatch);
+       secudp_free (host -> peerHostCounts);
+       secudp_free (host -> peerAddresses);
+       secudp_free (host -> freePeers);
+       secudp_free (host -> peerTimers);
        secudp_free (host -> peers);
        secudp_free (host -> secret);
        secudp_free (host);
@@ -112,6 +205,13 @@ secudp_host_create (const SecUdpAddress * address, const SecUdpHostSecret * secr
     host -> duplicatePeers = SECUDP_PROTOCOL_MAXIMUM_PEER_ID;
     host -> maximumPacketSize = SECUDP_HOST_DEFAULT_MAXIMUM_PACKET_SIZE;
     host -> maximumWaitingData = SECUDP_HOST_DEFAULT_MAXIMUM_WAITING_DATA;
+    host -> cipherSuites = secudp_cipher_suites_available ();
+    host -> connectCookies = 0;
+    host -> kxInterval = 0;
+    host -> kx = NULL;
+    host -> kxPool = NULL;
+    secudp_random (host -> cookieKey, SECUDP_COOKIE_KEYBYTES);
+    secudp_random (host -> addressHashKey, SECUDP_ADDRESS_HASH_KEYBYTES);
 
     host -> compressor.context = NULL;
     host -> compressor.compress = NULL;
@@ -121,6 +221,14 @@ secudp_host_create (const SecUdpAddress * address, const SecUdpHostSecret * secr
     host -> intercept = NULL;
 
     secudp_list_clear (& host -> dispatchQueue);
+    secudp_list_clear (& host -> sendQueue);
+    secudp_list_clear (& host -> connectedPeerList);
+
+    secudp_pool_init (& host -> outgoingCommandPool, sizeof (SecUdpOutgoingCommand), SECUDP_HOST_POOL_SLAB_OBJECTS);
+    secudp_pool_init (& host -> incomingCommandPool, sizeof (SecUdpIncomingCommand), SECUDP_HOST_POOL_SLAB_OBJECTS);
+
+    for (fragmentPool = 0; fragmentPool < SECUDP_HOST_FRAGMENT_POOLS; ++ fragmentPool)
+      secudp_pool_init (& host -> fragmentPools [fragmentPool], ((size_t) 1 << fragmentPool) * sizeof (secudp_uint32), SECUDP_HOST_POOL_SLAB_OBJECTS);
 
     for (currentPeer = host -> peers;
          currentPeer < & host -> peers [host -> peerCount];
@@ -130,8 +238,16 @@ secudp_host_create (const SecUdpAddress * address, const SecUdpHostSecret * secr
        currentPeer -> incomingPeerID = currentPeer - host -> peers;
        currentPeer -> outgoingSessionID = currentPeer -> incomingSessionID = 0xFF;
        currentPeer -> data = NULL;
+       currentPeer -> pendingSeals = 0;
+
+       currentPeer -> acknowledgements = NULL;
+       currentPeer -> acknowledgementCapacity = 0;
+       currentPeer -> acknowledgementHead = 0;
+       currentPeer -> acknowledgementCount = 0;
+       currentPeer -> reliableCommands = NULL;
+       currentPeer -> reliableCommandMask = 0;
+       currentPeer -> reliableCommandCount = 0;
 
-       secudp_list_clear (& currentPeer -> acknowledgements);
        secudp_list_clear (& currentPeer -> sentReliableCommands);
        secudp_list_clear (& currentPeer -> sentUnreliableCommands);
        secudp_list_clear (& currentPeer -> outgoingCommands);
@@ -140,6 +256,10 @@ secudp_host_create (const SecUdpAddress * address, const SecUdpHostSecret * secr
        secudp_peer_reset (currentPeer);
     }
 
+    /* Stack the free peers so the lowest peer IDs are handed out first. */
+    for (host -> freePeerCount = 0; host -> freePeerCount < peerCount; ++ host -> freePeerCount)
+      host -> freePeers [host -> freePeerCount] = & host -> peers [peerCount - 1 - host -> freePeerCount];
+
     return host;
 }
 
@@ -150,22 +270,60 @@ void
 secudp_host_destroy (SecUdpHost * host)
 {
     SecUdpPeer * currentPeer;
+    size_t fragmentPool;
 
     if (host == NULL)
       return;
 
+    secudp_uring_destroy (host -> uring);
+
     secudp_socket_destroy (host -> socket);
 
+    /* Destroyed first so resetting its members does not rekey it. */
+    secudp_host_group_destroy (host);
+
     for (currentPeer = host -> peers;
          currentPeer < & host -> peers [host -> peerCount];
          ++ currentPeer)
     {
        secudp_peer_reset (currentPeer);
+
+       if (currentPeer -> acknowledgements != NULL)
+         secudp_free (currentPeer -> acknowledgements);
+
+       if (currentPeer -> reliableCommands != NULL)
+         secudp_free (currentPeer -> reliableCommands);
+    }
+
+    if (host -> kx != NULL)
+    {
+       sodium_memzero (host -> kx, sizeof (SecUdpHostKx));
+
+       secudp_free (host -> kx);
     }
 
+    secudp_host_kx_pool_destroy (host);
+
+    secudp_host_crypto_pool_destroy (host);
+
+    secudp_host_packet_pool_destroy (host);
+
     if (host -> compressor.context != NULL && host -> compressor.destroy)
       (* host -> compressor.destroy) (host -> compressor.context);
 
+    secudp_pool_clear (& host -> outgoingCommandPool);
+    secudp_pool_clear (& host -> incomingCommandPool);
+
+    for (fragmentPool = 0; fragmentPool < SECUDP_HOST_FRAGMENT_POOLS; ++ fragmentPool)
+      secudp_pool_clear (& host -> fragmentPools [fragmentPool]);
+
+    secudp_free (host -> sendBatch);
+    secudp_free (host -> receiveBatch -> segmentData);
+    secudp_free (host -> receiveBatch);
+    secudp_free (host -> peerHostCounts);
+    secudp_free (host -> peerAddresses);
+    secudp_free (host -> freePeers);
+    secudp_free (host -> peerTimers);
     secudp_free (host -> peers);
     secudp_free (host -> secret);
     secudp_free (host);
@@ -193,17 +351,11 @@ secudp_host_connect (SecUdpHost * host, const SecUdpAddress * address, size_t ch
     if (channelCount > SECUDP_PROTOCOL_MAXIMUM_CHANNEL_COUNT)
       channelCount = SECUDP_PROTOCOL_MAXIMUM_CHANNEL_COUNT;
 
-    for (currentPeer = host -> peers;
-         currentPeer < & host -> peers [host -> peerCount];
-         ++ currentPeer)
-    {
-       if (currentPeer -> state == SECUDP_PEER_STATE_DISCONNECTED)
-         break;
-    }
-
-    if (currentPeer >= & host -> peers [host -> peerCount])
+    if (host -> freePeerCount == 0)
       return NULL;
 
+    currentPeer = host -> freePeers [host -> freePeerCount - 1];
+
     currentPeer -> channels = (SecUdpChannel *) secudp_malloc (channelCount * sizeof (SecUdpChannel));
     if (currentPeer -> channels == NULL)
       return NULL;
@@ -213,9 +365,11 @@ secudp_host_connect (SecUdpHost * host, const SecUdpAddress * address, size_t ch
         secudp_free(currentPeer -> channels);
         return NULL;
     }
+    -- host -> freePeerCount;
     currentPeer -> channelCount = channelCount;
     currentPeer -> state = SECUDP_PEER_STATE_CONNECTING;
     currentPeer -> address = * address;
+    secudp_host_index_peer (host, currentPeer);
     currentPeer -> connectID = ++ host -> randomSeed;
 
     if (host -> outgoingBandwidth == 0)
@@ -247,7 +401,7 @@ secudp_host_connect (SecUdpHost * host, const SecUdpAddress * address, size_t ch
         memset (channel -> reliableWindows, 0, sizeof (channel -> reliableWindows));
     }
     
-    secudp_peer_gen_key_exchange_pair(currentPeer -> secret -> kxPair.publicKx, currentPeer -> secret -> kxPair.privateKx);
+    secudp_host_gen_key_exchange_pair (host, currentPeer -> secret -> kxPair.publicKx, currentPeer -> secret -> kxPair.privateKx);
     
     command.header.command = SECUDP_PROTOCOL_COMMAND_CONNECT | SECUDP_PROTOCOL_COMMAND_FLAG_ACKNOWLEDGE;
     command.header.channelID = 0xFF;
@@ -264,6 +418,11 @@ secudp_host_connect (SecUdpHost * host, const SecUdpAddress * address, size_t ch
     command.connect.packetThrottleDeceleration = SECUDP_HOST_TO_NET_32 (currentPeer -> packetThrottleDeceleration);
     command.connect.connectID = currentPeer -> connectID;
     command.connect.data = SECUDP_HOST_TO_NET_32 (data);
+    currentPeer -> secret -> kxPair.options = SECUDP_PROTOCOL_OPTION_SELECTIVE_ACKNOWLEDGE | (host -> sealDatagrams ? SECUDP_PROTOCOL_OPTION_SEAL_DATAGRAMS : 0);
+    command.connect.options = SECUDP_HOST_TO_NET_32 (currentPeer -> secret -> kxPair.options);
+    currentPeer -> secret -> kxPair.cipherSuites = host -> cipherSuites & secudp_cipher_suites_available ();
+    command.connect.cipherSuites = SECUDP_HOST_TO_NET_32 (currentPeer -> secret -> kxPair.cipherSuites);
+    memset (command.connect.cookie, 0, SECUDP_COOKIEBYTES);
     memcpy(command.connect.publicKx, currentPeer -> secret -> kxPair.publicKx, SECUDP_KX_PUBLICBYTES);
  
     secudp_peer_queue_outgoing_command (currentPeer, & command, NULL, 0, 0);
@@ -275,11 +434,26 @@ secudp_host_connect (SecUdpHost * host, const SecUdpAddress * address, size_t ch
     @param host host on which to broadcast the packet
     @param channelID channel on which to broadcast
     @param packet packet to broadcast
+    @retval 0 on success
+    @retval < 0 if the packet is larger than the host's maximumPacketSize or already sealed,
+    in which case it is left to the caller
+    @remarks Peers that seal whole datagrams share the packet as is. If the host has a broadcast
+    group, the packet is sealed once with the group key and shared by every other member. The
+    remaining peers each get a copy sealed with their session key. Every member holds the group
+    key, so a member only knows that a group broadcast was sealed by the host or another member.
 */
-void
+int
 secudp_host_broadcast (SecUdpHost * host, secudp_uint8 channelID, SecUdpPacket * packet)
 {
-    SecUdpPeer * currentPeer;
+    SecUdpPeer * currentPeer,
+               * lastPeer = NULL;
+    SecUdpPacket * groupPacket;
+    size_t datagramPeers = 0,
+           groupPeers = 0;
+
+    if (packet -> dataLength > host -> maximumPacketSize ||
+        (packet -> flags & SECUDP_PACKET_FLAG_SEALED))
+      return -1;
 
     for (currentPeer = host -> peers;
          currentPeer < & host -> peers [host -> peerCount];
@@ -288,211 +462,1407 @@ secudp_host_broadcast (SecUdpHost * host, secudp_uint8 channelID, SecUdpPacket *
        if (currentPeer -> state != SECUDP_PEER_STATE_CONNECTED)
          continue;
 
-       secudp_peer_send (currentPeer, channelID, packet);
+       if (currentPeer -> flags & SECUDP_PEER_FLAG_SEAL_DATAGRAMS)
+         ++ datagramPeers;
+       else
+       if (currentPeer -> flags & SECUDP_PEER_FLAG_GROUP_MEMBER)
+         ++ groupPeers;
+       else
+         lastPeer = currentPeer;
+    }
+
+    /*
+     *  Packets are sealed in place, so every other peer gets its
+     *  own copy of the data, except for the last one when nothing
+     *  else needs the original.
+     */
+    if (datagramPeers > 0 || groupPeers > 0)
+      lastPeer = NULL;
+
+    for (currentPeer = host -> peers;
+         currentPeer < & host -> peers [host -> peerCount];
+         ++ currentPeer)
+    {
+       SecUdpPacket * copy;
+
+       if (currentPeer -> state != SECUDP_PEER_STATE_CONNECTED ||
+           (currentPeer -> flags & (SECUDP_PEER_FLAG_SEAL_DATAGRAMS | SECUDP_PEER_FLAG_GROUP_MEMBER)))
+         continue;
+
+       if (currentPeer == lastPeer)
+       {
+          /* A crypto pool owns the packet until it comes back sealed. */
+          if (secudp_peer_send (currentPeer, channelID, packet) == 0 && host -> cryptoPool != NULL)
+            return 0;
+
+          continue;
+       }
+
+       copy = secudp_host_packet_create (host, packet -> data, packet -> dataLength, packet -> flags & ~ SECUDP_PACKET_FLAG_NO_ALLOCATE);
+       if (copy == NULL)
+         continue;
+
+       if (secudp_peer_send (currentPeer, channelID, copy) < 0)
+         secudp_packet_destroy (copy);
+    }
+
+    if (groupPeers > 0)
+    {
+       groupPacket = datagramPeers > 0 ? secudp_host_packet_create (host, packet -> data, packet -> dataLength, packet -> flags & ~ SECUDP_PACKET_FLAG_NO_ALLOCATE) : packet;
+       if (groupPacket != NULL)
+       {
+          secudp_packet_seal (groupPacket, SECUDP_CIPHER_SUITE_XSALSA20_POLY1305, host -> group -> key, host -> group -> noncePrefix, host -> group -> nonceCounter ++);
+
+          for (currentPeer = host -> peers;
+               currentPeer < & host -> peers [host -> peerCount];
+               ++ currentPeer)
+          {
+             if (currentPeer -> state != SECUDP_PEER_STATE_CONNECTED ||
+                 (currentPeer -> flags & (SECUDP_PEER_FLAG_SEAL_DATAGRAMS | SECUDP_PEER_FLAG_GROUP_MEMBER)) != SECUDP_PEER_FLAG_GROUP_MEMBER ||
+                 channelID >= currentPeer -> channelCount)
+               continue;
+
+             secudp_peer_send_sealed (currentPeer, channelID, groupPacket, SECUDP_PROTOCOL_COMMAND_FLAG_GROUP);
+          }
+
+          if (groupPacket != packet && groupPacket -> referenceCount == 0)
+            secudp_packet_destroy (groupPacket);
+       }
+    }
+
+    if (datagramPeers > 0)
+    {
+       secudp_packet_seal (packet, SECUDP_CIPHER_SUITE_XSALSA20_POLY1305, NULL, NULL, 0);
+
+       for (currentPeer = host -> peers;
+            currentPeer < & host -> peers [host -> peerCount];
+            ++ currentPeer)
+       {
+          if (currentPeer -> state != SECUDP_PEER_STATE_CONNECTED ||
+              ! (currentPeer -> flags & SECUDP_PEER_FLAG_SEAL_DATAGRAMS) ||
+              channelID >= currentPeer -> channelCount)
+            continue;
+
+          secudp_peer_send_sealed (currentPeer, channelID, packet, 0);
+       }
     }
 
     if (packet -> referenceCount == 0)
       secudp_packet_destroy (packet);
-}
-
-/** Sets the packet compressor the host should use to compress and decompress packets.
-    @param host host to enable or disable compression for
-    @param compressor callbacks for for the packet compressor; if NULL, then compression is disabled
-*/
-void
-secudp_host_compress (SecUdpHost * host, const SecUdpCompressor * compressor)
-{
-    if (host -> compressor.context != NULL && host -> compressor.destroy)
-      (* host -> compressor.destroy) (host -> compressor.context);
 
-    if (compressor)
-      host -> compressor = * compressor;
-    else
-      host -> compressor.context = NULL;
+    return 0;
 }
 
-/** Limits the maximum allowed channels of future incoming connections.
-    @param host host to limit
-    @param channelLimit the maximum number of channels allowed; if 0, then this is equivalent to SECUDP_PROTOCOL_MAXIMUM_CHANNEL_COUNT
+/** Returns the signed semi-static key exchange pair of a host, generating
+    a new one if none exists yet or the current one is older than kxInterval.
+    @param host host accepting a connect
+    @returns the key exchange pair, or NULL if kxInterval is 0 or memory ran out,
+    in which case a fresh pair must be generated and signed for the connect
+    @remarks Signing is only done here, once per interval, instead of once per connect. The
+    signature covers the public key and the wall clock time after which connecting peers refuse
+    it, so a leaked pair is only good until then.
 */
-void
-secudp_host_channel_limit (SecUdpHost * host, size_t channelLimit)
+SecUdpHostKx *
+secudp_host_kx (SecUdpHost * host)
 {
-    if (! channelLimit || channelLimit > SECUDP_PROTOCOL_MAXIMUM_CHANNEL_COUNT)
-      channelLimit = SECUDP_PROTOCOL_MAXIMUM_CHANNEL_COUNT;
+    if (host -> kxInterval == 0)
+      return NULL;
+
+    if (host -> kx == NULL)
+    {
+       host -> kx = (SecUdpHostKx *) secudp_malloc (sizeof (SecUdpHostKx));
+       if (host -> kx == NULL)
+         return NULL;
+    }
     else
-    if (channelLimit < SECUDP_PROTOCOL_MINIMUM_CHANNEL_COUNT)
-      channelLimit = SECUDP_PROTOCOL_MINIMUM_CHANNEL_COUNT;
+    if (SECUDP_TIME_DIFFERENCE (host -> serviceTime, host -> kx -> generatedTime) < host -> kxInterval)
+      return host -> kx;
 
-    host -> channelLimit = channelLimit;
-}
+    sodium_memzero (host -> kx, sizeof (SecUdpHostKx));
 
+    secudp_peer_gen_key_exchange_pair (host -> kx -> publicKx, host -> kx -> privateKx);
+    host -> kx -> generatedTime = host -> serviceTime;
+    host -> kx -> notAfter = (secudp_uint32) time (NULL) + host -> kxInterval / 1000 + SECUDP_HOST_KX_EXPIRY_MARGIN;
+    secudp_host_sign_kx (host -> kx -> signature, host -> kx -> publicKx, host -> kx -> notAfter, host -> secret -> privateKey);
 
-/** Adjusts the bandwidth limits of a host.
-    @param host host to adjust
-    @param incomingBandwidth new incoming bandwidth
-    @param outgoingBandwidth new outgoing bandwidth
-    @remarks the incoming and outgoing bandwidth parameters are identical in function to those
-    specified in secudp_host_create().
-*/
-void
-secudp_host_bandwidth_limit (SecUdpHost * host, secudp_uint32 incomingBandwidth, secudp_uint32 outgoingBandwidth)
-{
-    host -> incomingBandwidth = incomingBandwidth;
-    host -> outgoingBandwidth = outgoingBandwidth;
-    host -> recalculateBandwidthLimits = 1;
+    return host -> kx;
 }
 
-void
-secudp_host_bandwidth_throttle (SecUdpHost * host)
+/*
+ *  Generates a pair for a key exchange pool from the next private
+ *  key drawn ahead, first drawing one for each of the freeSlots in
+ *  a single call to the random source if none are left.
+ */
+static void
+secudp_host_kx_pool_generate (SecUdpKxPool * pool, SecUdpKxPair * pair, size_t freeSlots)
 {
-    secudp_uint32 timeCurrent = secudp_time_get (),
-           elapsedTime = timeCurrent - host -> bandwidthThrottleEpoch,
-           peersRemaining = (secudp_uint32) host -> connectedPeers,
-           dataTotal = ~0,
-           bandwidth = ~0,
-           throttle = 0,
-           bandwidthLimit = 0;
-    int needsAdjustment = host -> bandwidthLimitedPeers > 0 ? 1 : 0;
-    SecUdpPeer * peer;
-    SecUdpProtocol command;
+    secudp_uint8 * seed;
 
-    if (elapsedTime < SECUDP_HOST_BANDWIDTH_THROTTLE_INTERVAL)
-      return;
+    if (pool -> seedCount == 0)
+    {
+       secudp_random (pool -> seeds, freeSlots * SECUDP_KX_PRIVATEBYTES);
+       pool -> seedCount = freeSlots;
+    }
 
-    host -> bandwidthThrottleEpoch = timeCurrent;
+    seed = & pool -> seeds [-- pool -> seedCount * SECUDP_KX_PRIVATEBYTES];
 
-    if (peersRemaining == 0)
-      return;
+    memcpy (pair -> privateKx, seed, SECUDP_KX_PRIVATEBYTES);
+    sodium_memzero (seed, SECUDP_KX_PRIVATEBYTES);
 
-    if (host -> outgoingBandwidth != 0)
-    {
-        dataTotal = 0;
-        bandwidth = (host -> outgoingBandwidth * elapsedTime) / 1000;
+    secudp_peer_gen_key_exchange_public (pair -> publicKx, pair -> privateKx);
+}
 
-        for (peer = host -> peers;
-             peer < & host -> peers [host -> peerCount];
-            ++ peer)
-        {
-            if (peer -> state != SECUDP_PEER_STATE_CONNECTED && peer -> state != SECUDP_PEER_STATE_DISCONNECT_LATER)
-              continue;
+static void SECUDP_CALLBACK
+secudp_host_kx_pool_thread (void * data)
+{
+    SecUdpKxPool * pool = (SecUdpKxPool *) data;
+    SecUdpKxPair pair;
+    size_t freeSlots;
 
-            dataTotal += peer -> outgoingDataTotal;
-        }
-    }
+    secudp_mutex_lock (& pool -> mutex);
 
-    while (peersRemaining > 0 && needsAdjustment != 0)
+    while (pool -> running)
     {
-        needsAdjustment = 0;
-        
-        if (dataTotal <= bandwidth)
-          throttle = SECUDP_PEER_PACKET_THROTTLE_SCALE;
-        else
-          throttle = (bandwidth * SECUDP_PEER_PACKET_THROTTLE_SCALE) / dataTotal;
+       if (pool -> count >= pool -> capacity)
+       {
+          secudp_condition_wait (& pool -> condition, & pool -> mutex);
 
-        for (peer = host -> peers;
-             peer < & host -> peers [host -> peerCount];
-             ++ peer)
-        {
-            secudp_uint32 peerBandwidth;
-            
-            if ((peer -> state != SECUDP_PEER_STATE_CONNECTED && peer -> state != SECUDP_PEER_STATE_DISCONNECT_LATER) ||
-                peer -> incomingBandwidth == 0 ||
-                peer -> outgoingBandwidthThrottleEpoch == timeCurrent)
-              continue;
+          continue;
+       }
 
-            peerBandwidth = (peer -> incomingBandwidth * elapsedTime) / 1000;
-            if ((throttle * peer -> outgoingDataTotal) / SECUDP_PEER_PACKET_THROTTLE_SCALE <= peerBandwidth)
-              continue;
+       freeSlots = pool -> capacity - pool -> count;
 
-            peer -> packetThrottleLimit = (peerBandwidth * 
-                                            SECUDP_PEER_PACKET_THROTTLE_SCALE) / peer -> outgoingDataTotal;
-            
-            if (peer -> packetThrottleLimit == 0)
-              peer -> packetThrottleLimit = 1;
-            
-            if (peer -> packetThrottle > peer -> packetThrottleLimit)
-              peer -> packetThrottle = peer -> packetThrottleLimit;
+       secudp_mutex_unlock (& pool -> mutex);
 
-            peer -> outgoingBandwidthThrottleEpoch = timeCurrent;
+       secudp_host_kx_pool_generate (pool, & pair, freeSlots);
 
-            peer -> incomingDataTotal = 0;
-            peer -> outgoingDataTotal = 0;
+       secudp_mutex_lock (& pool -> mutex);
 
-            needsAdjustment = 1;
-            -- peersRemaining;
-            bandwidth -= peerBandwidth;
-            dataTotal -= peerBandwidth;
-        }
+       pool -> pairs [(pool -> head + pool -> count) % pool -> capacity] = pair;
+       ++ pool -> count;
     }
 
-    if (peersRemaining > 0)
-    {
-        if (dataTotal <= bandwidth)
-          throttle = SECUDP_PEER_PACKET_THROTTLE_SCALE;
-        else
-          throttle = (bandwidth * SECUDP_PEER_PACKET_THROTTLE_SCALE) / dataTotal;
+    secudp_mutex_unlock (& pool -> mutex);
 
-        for (peer = host -> peers;
-             peer < & host -> peers [host -> peerCount];
-             ++ peer)
-        {
-            if ((peer -> state != SECUDP_PEER_STATE_CONNECTED && peer -> state != SECUDP_PEER_STATE_DISCONNECT_LATER) ||
-                peer -> outgoingBandwidthThrottleEpoch == timeCurrent)
-              continue;
+    sodium_memzero (& pair, sizeof (pair));
+}
 
-            peer -> packetThrottleLimit = throttle;
+/** Creates a pool of key exchange pairs generated ahead of handshakes.
+    @param host host to create the pool for
+    @param capacity maximum number of pairs kept in the pool
+    @param threaded if nonzero, the pool is refilled on a helper thread; otherwise it is
+    refilled while secudp_host_service() would otherwise wait for packets
+    @retval 0 on success
+    @retval < 0 on failure
+    @remarks When the pool runs dry, handshakes fall back to generating a pair on the spot.
+*/
+int
+secudp_host_kx_pool_create (SecUdpHost * host, size_t capacity, int threaded)
+{
+    SecUdpKxPool * pool;
 
-            if (peer -> packetThrottle > peer -> packetThrottleLimit)
-              peer -> packetThrottle = peer -> packetThrottleLimit;
+    if (host -> kxPool != NULL || capacity == 0)
+      return -1;
 
-            peer -> incomingDataTotal = 0;
-            peer -> outgoingDataTotal = 0;
-        }
+    pool = (SecUdpKxPool *) secudp_malloc (sizeof (SecUdpKxPool));
+    if (pool == NULL)
+      return -1;
+
+    pool -> pairs = (SecUdpKxPair *) secudp_malloc (capacity * sizeof (SecUdpKxPair));
+    if (pool -> pairs == NULL)
+    {
+       secudp_free (pool);
+
+       return -1;
     }
 
-    if (host -> recalculateBandwidthLimits)
+    pool -> seeds = (secudp_uint8 *) secudp_malloc (capacity * SECUDP_KX_PRIVATEBYTES);
+    if (pool -> seeds == NULL)
     {
-       host -> recalculateBandwidthLimits = 0;
+       secudp_free (pool -> pairs);
+       secudp_free (pool);
 
-       peersRemaining = (secudp_uint32) host -> connectedPeers;
-       bandwidth = host -> incomingBandwidth;
-       needsAdjustment = 1;
+       return -1;
+    }
 
-       if (bandwidth == 0)
-         bandwidthLimit = 0;
-       else
-       while (peersRemaining > 0 && needsAdjustment != 0)
-       {
-           needsAdjustment = 0;
-           bandwidthLimit = bandwidth / peersRemaining;
+    pool -> capacity = capacity;
+    pool -> head = 0;
+    pool -> count = 0;
+    pool -> seedCount = 0;
+    pool -> threaded = 0;
+    pool -> running = 0;
 
-           for (peer = host -> peers;
-                peer < & host -> peers [host -> peerCount];
-                ++ peer)
-           {
-               if ((peer -> state != SECUDP_PEER_STATE_CONNECTED && peer -> state != SECUDP_PEER_STATE_DISCONNECT_LATER) ||
-                   peer -> incomingBandwidthThrottleEpoch == timeCurrent)
-                 continue;
+    if (threaded)
+    {
+       if (secudp_mutex_create (& pool -> mutex) < 0)
+         goto createError;
 
-               if (peer -> outgoingBandwidth > 0 &&
-                   peer -> outgoingBandwidth >= bandwidthLimit)
-                 continue;
+       if (secudp_condition_create (& pool -> condition) < 0)
+       {
+          secudp_mutex_destroy (& pool -> mutex);
 
-               peer -> incomingBandwidthThrottleEpoch = timeCurrent;
- 
-               needsAdjustment = 1;
-               -- peersRemaining;
-               bandwidth -= peer -> outgoingBandwidth;
-           }
+          goto createError;
        }
 
-       for (peer = host -> peers;
-            peer < & host -> peers [host -> peerCount];
-            ++ peer)
+       pool -> threaded = 1;
+       pool -> running = 1;
+
+       if (secudp_thread_create (& pool -> thread, secudp_host_kx_pool_thread, pool) < 0)
        {
-           if (peer -> state != SECUDP_PEER_STATE_CONNECTED && peer -> state != SECUDP_PEER_STATE_DISCONNECT_LATER)
+          secudp_condition_destroy (& pool -> condition);
+          secudp_mutex_destroy (& pool -> mutex);
+
+          goto createError;
+       }
+    }
+
+    host -> kxPool = pool;
+
+    return 0;
+
+createError:
+    secudp_free (pool -> seeds);
+    secudp_free (pool -> pairs);
+    secudp_free (pool);
+
+    return -1;
+}
+
+/** Destroys the key exchange pair pool of a host, stopping its helper thread if any.
+    @param host host to destroy the pool of
+*/
+void
+secudp_host_kx_pool_destroy (SecUdpHost * host)
+{
+    SecUdpKxPool * pool = host -> kxPool;
+
+    if (pool == NULL)
+      return;
+
+    if (pool -> threaded)
+    {
+       secudp_mutex_lock (& pool -> mutex);
+       pool -> running = 0;
+       secudp_condition_signal (& pool -> condition);
+       secudp_mutex_unlock (& pool -> mutex);
+
+       secudp_thread_join (pool -> thread);
+
+       secudp_condition_destroy (& pool -> condition);
+       secudp_mutex_destroy (& pool -> mutex);
+    }
+
+    sodium_memzero (pool -> pairs, pool -> capacity * sizeof (SecUdpKxPair));
+    sodium_memzero (pool -> seeds, pool -> capacity * SECUDP_KX_PRIVATEBYTES);
+
+    secudp_free (pool -> seeds);
+    secudp_free (pool -> pairs);
+    secudp_free (pool);
+
+    host -> kxPool = NULL;
+}
+
+/** Refills the key exchange pair pool of a host until it is full, the
+    service time reaches timeout or a packet is waiting to be received.
+    Does nothing for a threaded pool.
+    @param host host to refill the pool of
+    @param timeout service time to stop refilling at
+*/
+void
+secudp_host_kx_pool_refill (SecUdpHost * host, secudp_uint32 timeout)
+{
+    SecUdpKxPool * pool = host -> kxPool;
+
+    if (pool == NULL || pool -> threaded)
+      return;
+
+    while (pool -> count < pool -> capacity)
+    {
+       SecUdpKxPair * pair = & pool -> pairs [(pool -> head + pool -> count) % pool -> capacity];
+       secudp_uint32 waitCondition = SECUDP_SOCKET_WAIT_RECEIVE;
+
+       secudp_host_kx_pool_generate (pool, pair, pool -> capacity - pool -> count);
+       ++ pool -> count;
+
+       host -> serviceTime = secudp_time_get ();
+       if (SECUDP_TIME_GREATER_EQUAL (host -> serviceTime, timeout))
+         break;
+
+       if (secudp_socket_wait (host -> socket, & waitCondition, 0) != 0 ||
+           (waitCondition & SECUDP_SOCKET_WAIT_RECEIVE))
+         break;
+    }
+}
+
+/** Generates a key exchange pair for a handshake, taking it from the
+    host's pool when one is available.
+    @param host host performing the handshake
+    @param publicKx receives the public key
+    @param privateKx receives the private key
+*/
+void
+secudp_host_gen_key_exchange_pair (SecUdpHost * host, secudp_uint8 * publicKx, secudp_uint8 * privateKx)
+{
+    SecUdpKxPool * pool = host -> kxPool;
+
+    if (pool != NULL)
+    {
+       int popped = 0;
+
+       if (pool -> threaded)
+         secudp_mutex_lock (& pool -> mutex);
+
+       if (pool -> count > 0)
+       {
+          SecUdpKxPair * pair = & pool -> pairs [pool -> head];
+
+          memcpy (publicKx, pair -> publicKx, SECUDP_KX_PUBLICBYTES);
+          memcpy (privateKx, pair -> privateKx, SECUDP_KX_PRIVATEBYTES);
+          sodium_memzero (pair, sizeof (SecUdpKxPair));
+
+          pool -> head = (pool -> head + 1) % pool -> capacity;
+          -- pool -> count;
+          popped = 1;
+       }
+
+       if (pool -> threaded)
+       {
+          secudp_condition_signal (& pool -> condition);
+          secudp_mutex_unlock (& pool -> mutex);
+       }
+
+       if (popped)
+         return;
+    }
+
+    secudp_peer_gen_key_exchange_pair (publicKx, privateKx);
+}
+
+static SecUdpCryptoJob *
+secudp_crypto_queue_front (SecUdpCryptoQueue * queue)
+{
+    if (queue -> head == SECUDP_ATOMIC_LOAD (& queue -> tail))
+      return NULL;
+
+    return & queue -> jobs [queue -> head % SECUDP_HOST_CRYPTO_QUEUE_SIZE];
+}
+
+static void
+secudp_crypto_queue_pop (SecUdpCryptoQueue * queue)
+{
+    SECUDP_ATOMIC_STORE (& queue -> head, queue -> head + 1);
+}
+
+static SecUdpCryptoJob *
+secudp_crypto_queue_back (SecUdpCryptoQueue * queue)
+{
+    return & queue -> jobs [queue -> tail % SECUDP_HOST_CRYPTO_QUEUE_SIZE];
+}
+
+static void
+secudp_crypto_queue_push (SecUdpCryptoQueue * queue)
+{
+    SECUDP_ATOMIC_STORE (& queue -> tail, queue -> tail + 1);
+}
+
+static void
+secudp_crypto_queue_destroy_packets (SecUdpCryptoQueue * queue)
+{
+    SecUdpCryptoJob * job;
+
+    while ((job = secudp_crypto_queue_front (queue)) != NULL)
+    {
+       secudp_packet_destroy (job -> packet);
+
+       secudp_crypto_queue_pop (queue);
+    }
+}
+
+static void SECUDP_CALLBACK
+secudp_host_crypto_worker_thread (void * data)
+{
+    SecUdpCryptoWorker * worker = (SecUdpCryptoWorker *) data;
+    SecUdpCryptoJob * job;
+
+    secudp_mutex_lock (& worker -> mutex);
+
+    while (worker -> running)
+    {
+       job = secudp_crypto_queue_front (& worker -> requests);
+       if (job == NULL)
+       {
+          secudp_condition_wait (& worker -> condition, & worker -> mutex);
+
+          continue;
+       }
+
+       secudp_mutex_unlock (& worker -> mutex);
+
+       do
+       {
+          SecUdpCryptoQueue * completions;
+
+          if (job -> type == SECUDP_CRYPTO_JOB_SEAL)
+          {
+             secudp_packet_seal (job -> packet, job -> suite, job -> key, job -> noncePrefix, job -> nonceCounter);
+
+             completions = & worker -> sealed;
+          }
+          else
+          {
+             job -> result = secudp_packet_open (job -> packet, job -> suite, job -> key, job -> noncePrefix);
+
+             completions = & worker -> opened;
+          }
+
+          /* Wipe the key before the job is copied so neither queue keeps it. */
+          sodium_memzero (job -> key, sizeof (job -> key));
+
+          * secudp_crypto_queue_back (completions) = * job;
+          secudp_crypto_queue_push (completions);
+
+          secudp_crypto_queue_pop (& worker -> requests);
+       }
+       while ((job = secudp_crypto_queue_front (& worker -> requests)) != NULL);
+
+       secudp_mutex_lock (& worker -> mutex);
+    }
+
+    secudp_mutex_unlock (& worker -> mutex);
+}
+
+static void
+secudp_host_crypto_worker_wake (SecUdpCryptoWorker * worker)
+{
+    secudp_mutex_lock (& worker -> mutex);
+    secudp_condition_signal (& worker -> condition);
+    secudp_mutex_unlock (& worker -> mutex);
+}
+
+static SecUdpCryptoWorker *
+secudp_host_crypto_pool_worker (SecUdpCryptoPool * pool, SecUdpPeer * peer, secudp_uint8 channelID)
+{
+    return & pool -> workers [(peer -> incomingPeerID + channelID) % pool -> workerCount];
+}
+
+/** Creates a pool of worker threads that seal sent packets and open received ones.
+    @param host host to create the pool for
+    @param workerCount number of worker threads
+    @retval 0 on success
+    @retval < 0 on failure
+    @remarks Packets sent with secudp_peer_send() are queued once a worker has sealed them,
+    and packets are handed out by secudp_host_service() once a worker has opened them. Packets
+    of one channel of a peer keep their order. Peers sealing whole datagrams are not offloaded.
+*/
+int
+secudp_host_crypto_pool_create (SecUdpHost * host, size_t workerCount)
+{
+    SecUdpCryptoPool * pool;
+    size_t workerIndex;
+
+    if (host -> cryptoPool != NULL || workerCount == 0)
+      return -1;
+
+    pool = (SecUdpCryptoPool *) secudp_malloc (sizeof (SecUdpCryptoPool));
+    if (pool == NULL)
+      return -1;
+
+    pool -> workers = (SecUdpCryptoWorker *) secudp_malloc (workerCount * sizeof (SecUdpCryptoWorker));
+    if (pool -> workers == NULL)
+    {
+       secudp_free (pool);
+
+       return -1;
+    }
+
+    pool -> workerCount = 0;
+    pool -> pending = 0;
+
+    host -> cryptoPool = pool;
+
+    for (workerIndex = 0; workerIndex < workerCount; ++ workerIndex)
+    {
+       SecUdpCryptoWorker * worker = & pool -> workers [workerIndex];
+
+       worker -> requests.head = worker -> requests.tail = 0;
+       worker -> sealed.head = worker -> sealed.tail = 0;
+       worker -> opened.head = worker -> opened.tail = 0;
+       worker -> pending = 0;
+       worker -> running = 1;
+
+       if (secudp_mutex_create (& worker -> mutex) < 0)
+         goto createError;
+
+       if (secudp_condition_create (& worker -> condition) < 0)
+       {
+          secudp_mutex_destroy (& worker -> mutex);
+
+          goto createError;
+       }
+
+       if (secudp_thread_create (& worker -> thread, secudp_host_crypto_worker_thread, worker) < 0)
+       {
+          secudp_condition_destroy (& worker -> condition);
+          secudp_mutex_destroy (& worker -> mutex);
+
+          goto createError;
+       }
+
+       ++ pool -> workerCount;
+    }
+
+    return 0;
+
+createError:
+    secudp_host_crypto_pool_destroy (host);
+
+    return -1;
+}
+
+/** Destroys the crypto pool of a host, stopping its worker threads.
+    @param host host to destroy the pool of
+    @remarks Packets still being sealed or opened are destroyed.
+*/
+void
+secudp_host_crypto_pool_destroy (SecUdpHost * host)
+{
+    SecUdpCryptoPool * pool = host -> cryptoPool;
+    SecUdpCryptoWorker * worker;
+
+    if (pool == NULL)
+      return;
+
+    for (worker = pool -> workers;
+         worker < & pool -> workers [pool -> workerCount];
+         ++ worker)
+    {
+       secudp_mutex_lock (& worker -> mutex);
+       worker -> running = 0;
+       secudp_condition_signal (& worker -> condition);
+       secudp_mutex_unlock (& worker -> mutex);
+
+       secudp_thread_join (worker -> thread);
+
+       secudp_condition_destroy (& worker -> condition);
+       secudp_mutex_destroy (& worker -> mutex);
+
+       secudp_crypto_queue_destroy_packets (& worker -> requests);
+       secudp_crypto_queue_destroy_packets (& worker -> sealed);
+       secudp_crypto_queue_destroy_packets (& worker -> opened);
+    }
+
+    /* Jobs that were never taken by a worker still hold keys. */
+    sodium_memzero (pool -> workers, pool -> workerCount * sizeof (SecUdpCryptoWorker));
+
+    secudp_free (pool -> workers);
+    secudp_free (pool);
+
+    host -> cryptoPool = NULL;
+}
+
+/** Creates a pool that recycles packets together with their data, for the packets
+    the host receives and those created with secudp_host_packet_create().
+    @param host host to create the pool for
+    @param maximumBytes most memory kept in free packets, or 0 for SECUDP_HOST_DEFAULT_PACKET_POOL_SIZE
+    @retval 0 on success
+    @retval < 0 on failure
+    @remarks Pooled packets are still destroyed with secudp_packet_destroy(), which may happen on any
+    thread and even after the host is destroyed.
+*/
+int
+secudp_host_packet_pool_create (SecUdpHost * host, size_t maximumBytes)
+{
+    SecUdpPacketPool * pool;
+
+    if (host -> packetPool != NULL)
+      return -1;
+
+    pool = (SecUdpPacketPool *) secudp_malloc (sizeof (SecUdpPacketPool));
+    if (pool == NULL)
+      return -1;
+
+    memset (pool, 0, sizeof (SecUdpPacketPool));
+
+    if (secudp_mutex_create (& pool -> mutex) < 0)
+    {
+       secudp_free (pool);
+
+       return -1;
+    }
+
+    pool -> referenceCount = 1;
+    pool -> maximumBytes = maximumBytes > 0 ? maximumBytes : SECUDP_HOST_DEFAULT_PACKET_POOL_SIZE;
+
+    host -> packetPool = pool;
+
+    return 0;
+}
+
+/** Destroys the packet pool of a host.
+    @param host host to destroy the pool of
+    @remarks Packets handed out by the pool remain valid and are freed when destroyed.
+*/
+void
+secudp_host_packet_pool_destroy (SecUdpHost * host)
+{
+    SecUdpPacketPool * pool = host -> packetPool;
+    size_t poolClass;
+
+    if (pool == NULL)
+      return;
+
+    secudp_mutex_lock (& pool -> mutex);
+
+    for (poolClass = 0; poolClass < SECUDP_PACKET_POOL_CLASSES; ++ poolClass)
+    {
+       while (pool -> freePackets [poolClass] != NULL)
+       {
+          SecUdpPacket * packet = pool -> freePackets [poolClass];
+
+          pool -> freePackets [poolClass] = (SecUdpPacket *) packet -> userData;
+
+          secudp_free (packet);
+       }
+    }
+
+    pool -> cachedBytes = 0;
+    pool -> maximumBytes = 0;
+
+    secudp_mutex_unlock (& pool -> mutex);
+
+    secudp_packet_pool_release (pool);
+
+    host -> packetPool = NULL;
+}
+
+/** Creates a packet like secudp_packet_create(), but from the host's packet pool if
+    it has one, so steady traffic does not allocate.
+    @param host host whose pool to take the packet from
+    @param data initial contents of the packet's data, or NULL to leave it uninitialized
+    @param dataLength size of the data allocated for this packet
+    @param flags flags for this packet as described for the SecUdpPacket structure
+    @returns the packet on success, NULL on failure
+    @sa secudp_host_packet_pool_create()
+*/
+SecUdpPacket *
+secudp_host_packet_create (SecUdpHost * host, const void * data, size_t dataLength, secudp_uint32 flags)
+{
+    if (host -> packetPool == NULL)
+      return secudp_packet_create (data, dataLength, flags);
+
+    return secudp_packet_create_pooled (host -> packetPool, data, dataLength, flags);
+}
+
+/*
+ *  Hands a packet to the worker of its channel to be sealed
+ *  with the next nonce counter of the peer.
+ */
+int
+secudp_host_crypto_pool_seal (SecUdpHost * host, SecUdpPeer * peer, secudp_uint8 channelID, SecUdpPacket * packet)
+{
+    SecUdpCryptoWorker * worker = secudp_host_crypto_pool_worker (host -> cryptoPool, peer, channelID);
+    SecUdpCryptoJob * job;
+
+    if (worker -> pending >= SECUDP_HOST_CRYPTO_QUEUE_SIZE)
+      return -1;
+
+    job = secudp_crypto_queue_back (& worker -> requests);
+    job -> type = SECUDP_CRYPTO_JOB_SEAL;
+    job -> peer = peer;
+    job -> packet = packet;
+    job -> connectID = peer -> connectID;
+    job -> channelID = channelID;
+    job -> suite = peer -> cipherSuite;
+    job -> nonceCounter = peer -> outgoingNonceCounter ++;
+    memcpy (job -> key, peer -> secret -> sessionPair.sendKey, SECUDP_SESSIONKEYBYTES);
+    memcpy (job -> noncePrefix, peer -> secret -> sessionPair.sendNoncePrefix, SECUDP_NONCE_PREFIXBYTES);
+
+    secudp_crypto_queue_push (& worker -> requests);
+
+    ++ worker -> pending;
+    ++ host -> cryptoPool -> pending;
+    ++ peer -> pendingSeals;
+
+    secudp_host_crypto_worker_wake (worker);
+
+    return 0;
+}
+
+/*
+ *  Hands the packets dispatched to a peer to the workers of
+ *  their channels to be opened. Returns 1 if a worker was too
+ *  far behind to take them all, or 0 once none are left.
+ */
+int
+secudp_host_crypto_pool_open (SecUdpHost * host, SecUdpPeer * peer)
+{
+    SecUdpCryptoPool * pool = host -> cryptoPool;
+    SecUdpCryptoWorker * worker;
+    int result = 0;
+
+    while (! secudp_list_empty (& peer -> dispatchedCommands))
+    {
+       SecUdpIncomingCommand * incomingCommand = (SecUdpIncomingCommand *) secudp_list_front (& peer -> dispatchedCommands);
+       SecUdpCryptoJob * job;
+       SecUdpPacket * packet;
+       const secudp_uint8 * key,
+                          * noncePrefix;
+       SecUdpCipherSuite suite;
+       secudp_uint8 channelID;
+
+       worker = secudp_host_crypto_pool_worker (pool, peer, incomingCommand -> command.header.channelID);
+       if (worker -> pending >= SECUDP_HOST_CRYPTO_QUEUE_SIZE)
+       {
+          result = 1;
+
+          break;
+       }
+
+       packet = secudp_peer_receive_sealed (peer, & channelID, & suite, & key, & noncePrefix);
+       if (key == NULL)
+       {
+          secudp_packet_destroy (packet);
+
+          continue;
+       }
+
+       job = secudp_crypto_queue_back (& worker -> requests);
+       job -> type = SECUDP_CRYPTO_JOB_OPEN;
+       job -> peer = peer;
+       job -> packet = packet;
+       job -> connectID = peer -> connectID;
+       job -> channelID = channelID;
+       job -> suite = suite;
+       memcpy (job -> key, key, SECUDP_SESSIONKEYBYTES);
+       memcpy (job -> noncePrefix, noncePrefix, SECUDP_NONCE_PREFIXBYTES);
+
+       secudp_crypto_queue_push (& worker -> requests);
+
+       ++ worker -> pending;
+       ++ pool -> pending;
+    }
+
+    for (worker = pool -> workers;
+         worker < & pool -> workers [pool -> workerCount];
+         ++ worker)
+    {
+       if (secudp_crypto_queue_front (& worker -> requests) != NULL)
+         secudp_host_crypto_worker_wake (worker);
+    }
+
+    return result;
+}
+
+/*
+ *  Queues every packet the workers have finished sealing,
+ *  dropping those whose peer has since disconnected. Peers
+ *  disconnecting later still get theirs, and are disconnected
+ *  here if the last one could not be queued.
+ */
+void
+secudp_host_crypto_pool_complete_seals (SecUdpHost * host)
+{
+    SecUdpCryptoPool * pool = host -> cryptoPool;
+    SecUdpCryptoWorker * worker;
+    SecUdpCryptoJob * job;
+
+    for (worker = pool -> workers;
+         worker < & pool -> workers [pool -> workerCount];
+         ++ worker)
+    {
+       while ((job = secudp_crypto_queue_front (& worker -> sealed)) != NULL)
+       {
+          SecUdpPeer * peer = job -> peer;
+
+          /* The peer keeps counting jobs across a reset, so it never undercounts those still in flight. */
+          -- peer -> pendingSeals;
+
+          if ((peer -> state != SECUDP_PEER_STATE_CONNECTED && peer -> state != SECUDP_PEER_STATE_DISCONNECT_LATER) ||
+              peer -> connectID != job -> connectID ||
+              secudp_peer_send_sealed (peer, job -> channelID, job -> packet, 0) < 0)
+          {
+             secudp_packet_destroy (job -> packet);
+
+             if (peer -> state == SECUDP_PEER_STATE_DISCONNECT_LATER &&
+                 peer -> connectID == job -> connectID &&
+                 peer -> pendingSeals == 0 &&
+                 secudp_list_empty (& peer -> outgoingCommands) &&
+                 secudp_list_empty (& peer -> sentReliableCommands))
+               secudp_peer_disconnect (peer, peer -> eventData);
+          }
+
+          secudp_crypto_queue_pop (& worker -> sealed);
+
+          -- worker -> pending;
+          -- pool -> pending;
+       }
+    }
+}
+
+/*
+ *  Produces a receive event for the next packet the workers
+ *  have finished opening, dropping those that failed to open
+ *  or whose peer has since disconnected.
+ */
+int
+secudp_host_crypto_pool_complete_open (SecUdpHost * host, SecUdpEvent * event)
+{
+    SecUdpCryptoPool * pool = host -> cryptoPool;
+    SecUdpCryptoWorker * worker;
+    SecUdpCryptoJob * job;
+
+    for (worker = pool -> workers;
+         worker < & pool -> workers [pool -> workerCount];
+         ++ worker)
+    {
+       while ((job = secudp_crypto_queue_front (& worker -> opened)) != NULL)
+       {
+          SecUdpPeer * peer = job -> peer;
+          SecUdpPacket * packet = job -> packet;
+          secudp_uint8 channelID = job -> channelID;
+          int valid = job -> result == 0 &&
+                      peer -> state == SECUDP_PEER_STATE_CONNECTED &&
+                      peer -> connectID == job -> connectID;
+
+          secudp_crypto_queue_pop (& worker -> opened);
+
+          -- worker -> pending;
+          -- pool -> pending;
+
+          if (! valid)
+          {
+             secudp_packet_destroy (packet);
+
              continue;
+          }
+
+          event -> type = SECUDP_EVENT_TYPE_RECEIVE;
+          event -> peer = peer;
+          event -> channelID = channelID;
+          event -> packet = packet;
+
+          return 1;
+       }
+    }
+
+    return 0;
+}
+
+/** Creates the broadcast group of a host with a fresh random group key.
+    @param host host to create the group for
+    @retval 0 on success
+    @retval < 0 on failure
+    @remarks Peers are added to the group with secudp_peer_group_join().
+*/
+int
+secudp_host_group_create (SecUdpHost * host)
+{
+    if (host -> group != NULL)
+      return 0;
+
+    host -> group = (SecUdpHostGroup *) secudp_malloc (sizeof (SecUdpHostGroup));
+    if (host -> group == NULL)
+      return -1;
+
+    secudp_random (host -> group -> key, SECUDP_SESSIONKEYBYTES);
+    secudp_gen_nonce_prefix (host -> group -> noncePrefix, host -> group -> key);
+    host -> group -> nonceCounter = 0;
+    host -> group -> firstNonceCounter = 0;
+
+    return 0;
+}
+
+/** Destroys the broadcast group of a host, removing all of its members.
+    @param host host whose group to destroy
+*/
+void
+secudp_host_group_destroy (SecUdpHost * host)
+{
+    SecUdpPeer * currentPeer;
+
+    if (host -> group == NULL)
+      return;
+
+    for (currentPeer = host -> peers;
+         currentPeer < & host -> peers [host -> peerCount];
+         ++ currentPeer)
+    {
+       currentPeer -> flags &= ~ (SECUDP_PEER_FLAG_GROUP_PENDING | SECUDP_PEER_FLAG_GROUP_MEMBER);
+    }
+
+    sodium_memzero (host -> group, sizeof (SecUdpHostGroup));
+
+    secudp_free (host -> group);
+
+    host -> group = NULL;
+}
+
+/** Replaces the group key of a host and sends the new one to every member.
+    @param host host whose group to rekey
+    @remarks This is done whenever a peer leaves the group, so that it cannot open later
+    broadcasts. Until a member acknowledges the new key, it receives its own copy of
+    broadcasts as when it joined. Members keep the previous key for broadcasts sealed
+    before the change, but not the one before that.
+*/
+void
+secudp_host_group_rekey (SecUdpHost * host)
+{
+    SecUdpPeer * currentPeer;
+
+    if (host -> group == NULL)
+      return;
+
+    secudp_random (host -> group -> key, SECUDP_SESSIONKEYBYTES);
+    secudp_gen_nonce_prefix (host -> group -> noncePrefix, host -> group -> key);
+    host -> group -> firstNonceCounter = host -> group -> nonceCounter;
+
+    for (currentPeer = host -> peers;
+         currentPeer < & host -> peers [host -> peerCount];
+         ++ currentPeer)
+    {
+       if (! (currentPeer -> flags & (SECUDP_PEER_FLAG_GROUP_PENDING | SECUDP_PEER_FLAG_GROUP_MEMBER)))
+         continue;
+
+       currentPeer -> flags &= ~ (SECUDP_PEER_FLAG_GROUP_PENDING | SECUDP_PEER_FLAG_GROUP_MEMBER);
+
+       secudp_peer_group_join (currentPeer);
+    }
+}
+
+/** Sets the packet compressor the host should use to compress and decompress packets.
+    @param host host to enable or disable compression for
+    @param compressor callbacks for for the packet compressor; if NULL, then compression is disabled
+*/
+void
+secudp_host_compress (SecUdpHost * host, const SecUdpCompressor * compressor)
+{
+    if (host -> compressor.context != NULL && host -> compressor.destroy)
+      (* host -> compressor.destroy) (host -> compressor.context);
+
+    if (compressor)
+      host -> compressor = * compressor;
+    else
+      host -> compressor.context = NULL;
+}
+
+/** Enables or disables UDP segmentation offload for a host.
+    @param host host to configure
+    @param enable if nonzero, consecutive datagrams of the same size to one peer are handed to the
+    kernel as one coalesced send, and coalesced receives are accepted and split up
+    @retval 0 on success
+    @retval < 0 if the platform supports neither direction of offload
+    @remarks Each direction is enabled only where the platform supports it, as recorded in host -> segmentOffload.
+*/
+int
+secudp_host_segment_offload (SecUdpHost * host, int enable)
+{
+    SecUdpReceiveBatch * batch = host -> receiveBatch;
+
+    if (! enable)
+    {
+       if (host -> segmentOffload & SECUDP_SEGMENT_OFFLOAD_RECEIVE)
+       {
+          secudp_socket_set_option (host -> socket, SECUDP_SOCKOPT_GRO, 0);
+
+          /* Coalesced reads not yet handled are dropped with the buffer they were read into. */
+          if (host -> uring == NULL)
+          {
+             batch -> count = 0;
+             batch -> index = 0;
+          }
+       }
+
+       secudp_free (batch -> segmentData);
+       batch -> segmentData = NULL;
+
+       host -> segmentOffload = 0;
+
+       return 0;
+    }
+
+    if (secudp_socket_set_option (host -> socket, SECUDP_SOCKOPT_SEGMENT, 0) == 0)
+      host -> segmentOffload |= SECUDP_SEGMENT_OFFLOAD_SEND;
+
+    if (batch -> segmentData == NULL)
+      batch -> segmentData = (secudp_uint8 *) secudp_malloc (SECUDP_HOST_RECEIVE_BATCH_SIZE * SECUDP_SOCKET_SEGMENT_BUFFER_SIZE);
+
+    if (batch -> segmentData != NULL && secudp_socket_set_option (host -> socket, SECUDP_SOCKOPT_GRO, 1) == 0)
+      host -> segmentOffload |= SECUDP_SEGMENT_OFFLOAD_RECEIVE;
+    else
+    if (! (host -> segmentOffload & SECUDP_SEGMENT_OFFLOAD_RECEIVE))
+    {
+       secudp_free (batch -> segmentData);
+       batch -> segmentData = NULL;
+    }
+
+    /* Coalesced receives need larger buffers than the io_uring was created with. */
+    if (host -> uring != NULL && (host -> segmentOffload & SECUDP_SEGMENT_OFFLOAD_RECEIVE))
+      secudp_host_uring (host, 1);
+
+    return host -> segmentOffload != 0 ? 0 : -1;
+}
+
+/** Switches a host between making socket calls itself and sending and receiving through io_uring.
+    @param host host to configure
+    @param enable if nonzero, datagrams are received by one multishot receive into buffers handed to the
+    kernel and each batch of sends is submitted in one system call, which also collects their results
+    @retval 0 on success
+    @retval < 0 if io_uring or its multishot receives are unavailable, in which case the host keeps using its socket directly
+    @remarks Call this right after secudp_host_create(), before servicing the host or adding it to a reactor;
+    datagrams received but not yet handled when switching are dropped. While enabled, an event loop
+    should wait on secudp_uring_socket (host -> uring) rather than host -> socket.
+*/
+int
+secudp_host_uring (SecUdpHost * host, int enable)
+{
+    if (host -> uring != NULL)
+    {
+       secudp_uring_destroy (host -> uring);
+       host -> uring = NULL;
+
+       host -> receiveBatch -> count = 0;
+       host -> receiveBatch -> index = 0;
+    }
+
+    if (! enable)
+      return 0;
+
+    if (host -> segmentOffload & SECUDP_SEGMENT_OFFLOAD_RECEIVE)
+      host -> uring = secudp_uring_create (host -> socket, SECUDP_SOCKET_SEGMENT_BUFFER_SIZE, SECUDP_SOCKET_URING_SEGMENT_BUFFER_COUNT);
+    else
+      host -> uring = secudp_uring_create (host -> socket, SECUDP_PROTOCOL_MAXIMUM_MTU, SECUDP_SOCKET_URING_BUFFER_COUNT);
+
+    return host -> uring != NULL ? 0 : -1;
+}
+
+/** Limits the maximum allowed channels of future incoming connections.
+    @param host host to limit
+    @param channelLimit the maximum number of channels allowed; if 0, then this is equivalent to SECUDP_PROTOCOL_MAXIMUM_CHANNEL_COUNT
+*/
+void
+secudp_host_channel_limit (SecUdpHost * host, size_t channelLimit)
+{
+    if (! channelLimit || channelLimit > SECUDP_PROTOCOL_MAXIMUM_CHANNEL_COUNT)
+      channelLimit = SECUDP_PROTOCOL_MAXIMUM_CHANNEL_COUNT;
+    else
+    if (channelLimit < SECUDP_PROTOCOL_MINIMUM_CHANNEL_COUNT)
+      channelLimit = SECUDP_PROTOCOL_MINIMUM_CHANNEL_COUNT;
+
+    host -> channelLimit = channelLimit;
+}
+
+
+/** Adjusts the bandwidth limits of a host.
+    @param host host to adjust
+    @param incomingBandwidth new incoming bandwidth
+    @param outgoingBandwidth new outgoing bandwidth
+    @remarks the incoming and outgoing bandwidth parameters are identical in function to those
+    specified in secudp_host_create().
+*/
+void
+secudp_host_bandwidth_limit (SecUdpHost * host, secudp_uint32 incomingBandwidth, secudp_uint32 outgoingBandwidth)
+{
+    host -> incomingBandwidth = incomingBandwidth;
+    host -> outgoingBandwidth = outgoingBandwidth;
+    host -> recalculateBandwidthLimits = 1;
+}
+
+static size_t
+secudp_host_hash_peer_address (SecUdpHost * host, const SecUdpAddress * address)
+{
+    secudp_uint8 data [sizeof (secudp_uint32) + sizeof (secudp_uint16)];
+
+    memcpy (data, & address -> host, sizeof (secudp_uint32));
+    memcpy (data + sizeof (secudp_uint32), & address -> port, sizeof (secudp_uint16));
+
+    return secudp_host_hash_address (data, sizeof (data), host -> addressHashKey) & host -> peerAddressMask;
+}
+
+static size_t
+secudp_host_hash_peer_host (SecUdpHost * host, secudp_uint32 address)
+{
+    return secudp_host_hash_address (& address, sizeof (address), host -> addressHashKey) & host -> peerAddressMask;
+}
+
+/*
+ *  Adds a peer that is leaving the disconnected state to the
+ *  host's address tables, counting it towards duplicatePeers
+ *  unless it is still connecting. Addition to ENet.
+ */
+void
+secudp_host_index_peer (SecUdpHost * host, SecUdpPeer * peer)
+{
+    size_t index = secudp_host_hash_peer_address (host, & peer -> address);
+
+    while (host -> peerAddresses [index] != NULL)
+      index = (index + 1) & host -> peerAddressMask;
+
+    host -> peerAddresses [index] = peer;
+
+    if (peer -> state == SECUDP_PEER_STATE_CONNECTING)
+      return;
+
+    index = secudp_host_hash_peer_host (host, peer -> address.host);
+
+    while (host -> peerHostCounts [index].peerCount > 0 &&
+           host -> peerHostCounts [index].host != peer -> address.host)
+      index = (index + 1) & host -> peerAddressMask;
+
+    host -> peerHostCounts [index].host = peer -> address.host;
+    ++ host -> peerHostCounts [index].peerCount;
+}
+
+/*
+ *  Removes a peer from the host's address tables, before its
+ *  state or address changes. Emptied slots are filled from later
+ *  in their cluster so probing never stops short. Addition to ENet.
+ */
+void
+secudp_host_unindex_peer (SecUdpHost * host, SecUdpPeer * peer)
+{
+    size_t index = secudp_host_hash_peer_address (host, & peer -> address), next;
+
+    while (host -> peerAddresses [index] != peer)
+      index = (index + 1) & host -> peerAddressMask;
+
+    for (next = (index + 1) & host -> peerAddressMask;
+         host -> peerAddresses [next] != NULL;
+         next = (next + 1) & host -> peerAddressMask)
+    {
+       size_t home = secudp_host_hash_peer_address (host, & host -> peerAddresses [next] -> address);
+
+       if (((next - home) & host -> peerAddressMask) >= ((next - index) & host -> peerAddressMask))
+       {
+          host -> peerAddresses [index] = host -> peerAddresses [next];
+          index = next;
+       }
+    }
+
+    host -> peerAddresses [index] = NULL;
+
+    if (peer -> state == SECUDP_PEER_STATE_CONNECTING)
+      return;
+
+    index = secudp_host_hash_peer_host (host, peer -> address.host);
+
+    while (host -> peerHostCounts [index].host != peer -> address.host)
+      index = (index + 1) & host -> peerAddressMask;
+
+    if (-- host -> peerHostCounts [index].peerCount > 0)
+      return;
+
+    for (next = (index + 1) & host -> peerAddressMask;
+         host -> peerHostCounts [next].peerCount > 0;
+         next = (next + 1) & host -> peerAddressMask)
+    {
+       size_t home = secudp_host_hash_peer_host (host, host -> peerHostCounts [next].host);
+
+       if (((next - home) & host -> peerAddressMask) >= ((next - index) & host -> peerAddressMask))
+       {
+          host -> peerHostCounts [index] = host -> peerHostCounts [next];
+          index = next;
+       }
+    }
+
+    host -> peerHostCounts [index].peerCount = 0;
+}
+
+/*
+ *  Finds a peer that is not disconnected by its address and
+ *  connect ID, or returns NULL. Addition to ENet.
+ */
+SecUdpPeer *
+secudp_host_find_peer (SecUdpHost * host, const SecUdpAddress * address, secudp_uint32 connectID)
+{
+    size_t index;
+
+    for (index = secudp_host_hash_peer_address (host, address);
+         host -> peerAddresses [index] != NULL;
+         index = (index + 1) & host -> peerAddressMask)
+    {
+       SecUdpPeer * peer = host -> peerAddresses [index];
+
+       if (peer -> address.host == address -> host &&
+           peer -> address.port == address -> port &&
+           peer -> connectID == connectID)
+         return peer;
+    }
+
+    return NULL;
+}
+
+/*
+ *  Returns the number of peers from an IP that are neither
+ *  disconnected nor connecting. Addition to ENet.
+ */
+size_t
+secudp_host_count_peers (SecUdpHost * host, secudp_uint32 address)
+{
+    size_t index;
+
+    for (index = secudp_host_hash_peer_host (host, address);
+         host -> peerHostCounts [index].peerCount > 0;
+         index = (index + 1) & host -> peerAddressMask)
+    {
+       if (host -> peerHostCounts [index].host == address)
+         return host -> peerHostCounts [index].peerCount;
+    }
+
+    return 0;
+}
+
+void
+secudp_host_bandwidth_throttle (SecUdpHost * host)
+{
+    secudp_uint32 timeCurrent = secudp_time_get (),
+           elapsedTime = timeCurrent - host -> bandwidthThrottleEpoch,
+           peersRemaining = (secudp_uint32) host -> connectedPeers,
+           dataTotal = ~0,
+           bandwidth = ~0,
+           throttle = 0,
+           bandwidthLimit = 0;
+    int needsAdjustment = host -> bandwidthLimitedPeers > 0 ? 1 : 0;
+    SecUdpPeer * peer;
+    SecUdpListIterator currentPeer;
+    SecUdpProtocol command;
+
+    if (elapsedTime < SECUDP_HOST_BANDWIDTH_THROTTLE_INTERVAL)
+      return;
+
+    host -> bandwidthThrottleEpoch = timeCurrent;
+
+    if (peersRemaining == 0)
+      return;
+
+    if (host -> outgoingBandwidth != 0)
+    {
+        dataTotal = 0;
+        bandwidth = (host -> outgoingBandwidth * elapsedTime) / 1000;
+
+        for (currentPeer = secudp_list_begin (& host -> connectedPeerList);
+             currentPeer != secudp_list_end (& host -> connectedPeerList);
+             currentPeer = secudp_list_next (currentPeer))
+        {
+            peer = (SecUdpPeer *) ((secudp_uint8 *) currentPeer - offsetof (SecUdpPeer, connectedList));
+
+            dataTotal += peer -> outgoingDataTotal;
+        }
+    }
+
+    while (peersRemaining > 0 && needsAdjustment != 0)
+    {
+        needsAdjustment = 0;
+        
+        if (dataTotal <= bandwidth)
+          throttle = SECUDP_PEER_PACKET_THROTTLE_SCALE;
+        else
+          throttle = (bandwidth * SECUDP_PEER_PACKET_THROTTLE_SCALE) / dataTotal;
+
+        for (currentPeer = secudp_list_begin (& host -> connectedPeerList);
+             currentPeer != secudp_list_end (& host -> connectedPeerList);
+             currentPeer = secudp_list_next (currentPeer))
+        {
+            secudp_uint32 peerBandwidth;
+
+            peer = (SecUdpPeer *) ((secudp_uint8 *) currentPeer - offsetof (SecUdpPeer, connectedList));
+
+            if (peer -> incomingBandwidth == 0 ||
+                peer -> outgoingBandwidthThrottleEpoch == timeCurrent)
+              continue;
+
+            peerBandwidth = (peer -> incomingBandwidth * elapsedTime) / 1000;
+            if ((throttle * peer -> outgoingDataTotal) / SECUDP_PEER_PACKET_THROTTLE_SCALE <= peerBandwidth)
+              continue;
+
+            peer -> packetThrottleLimit = (peerBandwidth * 
+                                            SECUDP_PEER_PACKET_THROTTLE_SCALE) / peer -> outgoingDataTotal;
+            
+            if (peer -> packetThrottleLimit == 0)
+              peer -> packetThrottleLimit = 1;
+            
+            if (peer -> packetThrottle > peer -> packetThrottleLimit)
+              peer -> packetThrottle = peer -> packetThrottleLimit;
+
+            peer -> outgoingBandwidthThrottleEpoch = timeCurrent;
+
+            peer -> incomingDataTotal = 0;
+            peer -> outgoingDataTotal = 0;
+
+            needsAdjustment = 1;
+            -- peersRemaining;
+            bandwidth -= peerBandwidth;
+            dataTotal -= peerBandwidth;
+        }
+    }
+
+    if (peersRemaining > 0)
+    {
+        if (dataTotal <= bandwidth)
+          throttle = SECUDP_PEER_PACKET_THROTTLE_SCALE;
+        else
+          throttle = (bandwidth * SECUDP_PEER_PACKET_THROTTLE_SCALE) / dataTotal;
+
+        for (currentPeer = secudp_list_begin (& host -> connectedPeerList);
+             currentPeer != secudp_list_end (& host -> connectedPeerList);
+             currentPeer = secudp_list_next (currentPeer))
+        {
+            peer = (SecUdpPeer *) ((secudp_uint8 *) currentPeer - offsetof (SecUdpPeer, connectedList));
+
+            if (peer -> outgoingBandwidthThrottleEpoch == timeCurrent)
+              continue;
+
+            peer -> packetThrottleLimit = throttle;
+
+            if (peer -> packetThrottle > peer -> packetThrottleLimit)
+              peer -> packetThrottle = peer -> packetThrottleLimit;
+
+            peer -> incomingDataTotal = 0;
+            peer -> outgoingDataTotal = 0;
+        }
+    }
+
+    if (host -> recalculateBandwidthLimits)
+    {
+       host -> recalculateBandwidthLimits = 0;
+
+       peersRemaining = (secudp_uint32) host -> connectedPeers;
+       bandwidth = host -> incomingBandwidth;
+       needsAdjustment = 1;
+
+       if (bandwidth == 0)
+         bandwidthLimit = 0;
+       else
+       while (peersRemaining > 0 && needsAdjustment != 0)
+       {
+           needsAdjustment = 0;
+           bandwidthLimit = bandwidth / peersRemaining;
+
+           for (currentPeer = secudp_list_begin (& host -> connectedPeerList);
+                currentPeer != secudp_list_end (& host -> connectedPeerList);
+                currentPeer = secudp_list_next (currentPeer))
+           {
+               peer = (SecUdpPeer *) ((secudp_uint8 *) currentPeer - offsetof (SecUdpPeer, connectedList));
+
+               if (peer -> incomingBandwidthThrottleEpoch == timeCurrent)
+                 continue;
+
+               if (peer -> outgoingBandwidth > 0 &&
+                   peer -> outgoingBandwidth >= bandwidthLimit)
+                 continue;
+
+               peer -> incomingBandwidthThrottleEpoch = timeCurrent;
+ 
+               needsAdjustment = 1;
+               -- peersRemaining;
+               bandwidth -= peer -> outgoingBandwidth;
+           }
+       }
+
+       for (currentPeer = secudp_list_begin (& host -> connectedPeerList);
+            currentPeer != secudp_list_end (& host -> connectedPeerList);
+            currentPeer = secudp_list_next (currentPeer))
+       {
+           peer = (SecUdpPeer *) ((secudp_uint8 *) currentPeer - offsetof (SecUdpPeer, connectedList));
 
            command.header.command = SECUDP_PROTOCOL_COMMAND_BANDWIDTH_LIMIT | SECUDP_PROTOCOL_COMMAND_FLAG_ACKNOWLEDGE;
            command.header.channelID = 0xFF;
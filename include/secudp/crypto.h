@@ -2,23 +2,69 @@
 #define __SECUDP_CRYPTO_H__
 
 #include <sodium.h>
+#include "secudp/types.h"
+
+/*
+ *  Nonce and mac sizes are the largest among the cipher
+ *  suites. Every suite uses a 16 byte mac, and nonces end
+ *  in a counter so only that goes on the wire.
+ */
 #define SECUDP_NONCEBYTES        crypto_secretbox_NONCEBYTES
 #define SECUDP_MACBYTES          crypto_secretbox_MACBYTES
+#define SECUDP_NONCE_COUNTERBYTES 8
+#define SECUDP_NONCE_PREFIXBYTES (SECUDP_NONCEBYTES - SECUDP_NONCE_COUNTERBYTES)
+#define SECUDP_SEALBYTES         (SECUDP_NONCE_COUNTERBYTES + SECUDP_MACBYTES)
+#define SECUDP_DATAGRAM_SEALBYTES SECUDP_SEALBYTES
 #define SECUDP_SESSIONKEYBYTES   crypto_kx_SESSIONKEYBYTES
 #define SECUDP_KX_PUBLICBYTES    crypto_kx_PUBLICKEYBYTES
 #define SECUDP_KX_PRIVATEBYTES   crypto_kx_SECRETKEYBYTES
 #define SECUDP_SIGN_PUBLICBYTES  crypto_sign_PUBLICKEYBYTES
 #define SECUDP_SIGN_PRIVATEBYTES crypto_sign_SECRETKEYBYTES
 #define SECUDP_SIGN_BYTES        crypto_sign_BYTES
+#define SECUDP_COOKIEBYTES       16
+#define SECUDP_COOKIE_KEYBYTES   crypto_generichash_KEYBYTES
+#define SECUDP_ADDRESS_HASH_KEYBYTES crypto_shorthash_KEYBYTES
 
 void secudp_random(void *buf, size_t len);
 void secudp_sign_keypair(void *privKey, void *pubKey);
-void secudp_peer_encrypt(void *ciphertext, void *mac, const void *message, size_t len, void *nonce, const void *key);
-int secudp_peer_decrypt(void *message, const void *ciphertext, const void *mac, size_t len, const void *nonce, const void * key);
 void secudp_host_generate_signature(void *signature, const void *message, size_t len, const void *privKey);
 int secudp_host_verify_signature(const void *signature, const void *message, size_t len, const void *pubKey);
+void secudp_host_sign_kx(void *signature, const void *publicKx, secudp_uint32 notAfter, const void *privKey);
+int secudp_host_verify_kx(const void *signature, const void *publicKx, secudp_uint32 notAfter, const void *pubKey);
 void secudp_peer_gen_key_exchange_pair(void *pubKey, void *secKey);
+void secudp_peer_gen_key_exchange_public(void *pubKey, const void *secKey);
 int secudp_peer_gen_session_keys(void *selfSendKey, void *otherSendKey, const void *selfPubKey, const void *selfSecKey, const void *otherPubKey);
 int secudp_host_gen_session_keys(void *selfSendKey, void *otherSendKey, const void *selfPubKey, const void *selfSecKey, const void *otherPubKey);
+void secudp_peer_gen_datagram_key(void *datagramKey, const void *sessionKey);
+void secudp_gen_nonce_prefix(void *prefix, const void *key);
+void secudp_gen_handshake_mac(void *mac, const void *transcript, size_t len, const void *sessionKey);
+int secudp_verify_handshake_mac(const void *mac, const void *transcript, size_t len, const void *sessionKey);
+void secudp_host_gen_cookie(void *cookie, const void *message, size_t len, const void *cookieKey);
+int secudp_host_verify_cookie(const void *cookie, const void *message, size_t len, const void *cookieKey);
+size_t secudp_host_hash_address(const void *message, size_t len, const void *hashKey);
+
+/*
+ *  Cipher suites, in increasing order of preference.
+ */
+typedef enum _SecUdpCipherSuite
+{
+   SECUDP_CIPHER_SUITE_XSALSA20_POLY1305      = 0,
+   SECUDP_CIPHER_SUITE_CHACHA20_POLY1305_IETF = 1,
+   SECUDP_CIPHER_SUITE_AES256_GCM             = 2,
+   SECUDP_CIPHER_SUITE_COUNT                  = 3
+} SecUdpCipherSuite;
+
+/*
+ *  Suites that authenticate additional data, as needed to
+ *  seal whole datagrams.
+ */
+#define SECUDP_CIPHER_SUITES_AEAD ((1 << SECUDP_CIPHER_SUITE_CHACHA20_POLY1305_IETF) | (1 << SECUDP_CIPHER_SUITE_AES256_GCM))
+
+secudp_uint32 secudp_cipher_suites_available(void);
+int secudp_cipher_suite_select(secudp_uint32 suites);
+void secudp_cipher_nonce(SecUdpCipherSuite suite, void *nonce, const void *prefix, const void *counter);
+void secudp_cipher_encrypt(SecUdpCipherSuite suite, void *ciphertext, void *mac, const void *message, size_t len, const void *ad, size_t adLen, const void *nonce, const void *key);
+int secudp_cipher_decrypt(SecUdpCipherSuite suite, void *message, const void *ciphertext, const void *mac, size_t len, const void *ad, size_t adLen, const void *nonce, const void *key);
+void secudp_cipher_encrypt_batch(SecUdpCipherSuite suite, void * const *messages, void * const *macs, const size_t *lengths, const void * const *counters, size_t count, const void *prefix, const void *key);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,30 @@
+/**
+ @file  pool.h
+ @brief SecUdp fixed-size object pools
+*/
+#ifndef __SECUDP_POOL_H__
+#define __SECUDP_POOL_H__
+
+#include <stdlib.h>
+
+/*
+ *  Hands out objects of one size carved from slabs allocated
+ *  with secudp_malloc(). Freed objects are kept on a free list
+ *  for reuse, and slabs are only returned by secudp_pool_clear().
+ */
+typedef struct _SecUdpPool
+{
+   size_t objectSize;     /* bytes per object, rounded up for alignment */
+   size_t slabObjects;    /* objects carved from each slab */
+   void * freeObjects;    /* free objects, linked through their first bytes */
+   void * slabs;          /* slabs, linked through their headers */
+} SecUdpPool;
+
+extern void secudp_pool_init (SecUdpPool *, size_t, size_t);
+extern void secudp_pool_clear (SecUdpPool *);
+
+extern void * secudp_pool_alloc (SecUdpPool *);
+extern void secudp_pool_free (SecUdpPool *, void *);
+
+#endif /* __SECUDP_POOL_H__ */
+
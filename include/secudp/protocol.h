@@ -36,7 +36,10 @@ typedef enum _SecUdpProtocolCommand
    SECUDP_PROTOCOL_COMMAND_BANDWIDTH_LIMIT    = 10,
    SECUDP_PROTOCOL_COMMAND_THROTTLE_CONFIGURE = 11,
    SECUDP_PROTOCOL_COMMAND_SEND_UNRELIABLE_FRAGMENT = 12,
-   SECUDP_PROTOCOL_COMMAND_COUNT              = 13,
+   SECUDP_PROTOCOL_COMMAND_GROUP_KEY          = 13,
+   SECUDP_PROTOCOL_COMMAND_RETRY_CONNECT      = 14,
+   SECUDP_PROTOCOL_COMMAND_SELECTIVE_ACKNOWLEDGE = 15,
+   SECUDP_PROTOCOL_COMMAND_COUNT              = 16,
    SECUDP_PROTOCOL_COMMAND_MASK               = 0x0F
 } SecUdpProtocolCommand;
 
@@ -44,6 +47,7 @@ typedef enum _SecUdpProtocolFlag
 {
    SECUDP_PROTOCOL_COMMAND_FLAG_ACKNOWLEDGE = (1 << 7),
    SECUDP_PROTOCOL_COMMAND_FLAG_UNSEQUENCED = (1 << 6),
+   SECUDP_PROTOCOL_COMMAND_FLAG_GROUP       = (1 << 5),
 
    SECUDP_PROTOCOL_HEADER_FLAG_COMPRESSED = (1 << 14),
    SECUDP_PROTOCOL_HEADER_FLAG_SENT_TIME  = (1 << 15),
@@ -53,6 +57,12 @@ typedef enum _SecUdpProtocolFlag
    SECUDP_PROTOCOL_HEADER_SESSION_SHIFT   = 12
 } SecUdpProtocolFlag;
 
+typedef enum _SecUdpProtocolOption
+{
+   SECUDP_PROTOCOL_OPTION_SEAL_DATAGRAMS = (1 << 0),
+   SECUDP_PROTOCOL_OPTION_SELECTIVE_ACKNOWLEDGE = (1 << 1)
+} SecUdpProtocolOption;
+
 #ifdef _MSC_VER
 #pragma pack(push, 1)
 #define SECUDP_PACKED
@@ -101,9 +111,15 @@ typedef struct _SecUdpProtocolConnect
    
    /*
     *  The one trying to connect will send over
-    *  a public key. Addition to ENet Connect
+    *  a public key, the protocol options, the
+    *  bitmask of cipher suites it supports and
+    *  the cookie from a retry, or zeros.
+    *  Addition to ENet Connect
     */
+   secudp_uint32 options;
+   secudp_uint32 cipherSuites;
    secudp_uint8 publicKx[SECUDP_KX_PUBLICBYTES];
+   secudp_uint8 cookie[SECUDP_COOKIEBYTES];
 } SECUDP_PACKED SecUdpProtocolConnect;
 
 typedef struct _SecUdpProtocolVerifyConnect
@@ -126,10 +142,20 @@ typedef struct _SecUdpProtocolVerifyConnect
     *  The one verifying the connect will store
     *  public key here. If generating session pair
     *  goes bad, don't send a verify connect.
-    *  Additionally, slap the signature on there.
+    *  Additionally, slap the signature on there
+    *  and the protocol options and cipher suite
+    *  both sides agree on. The signature covers
+    *  the public key and notAfter, the time in
+    *  seconds since the epoch after which the key
+    *  must be refused, and the mac ties the rest
+    *  of the handshake to that key.
     */
+   secudp_uint32 options;
+   secudp_uint32 cipherSuite;
+   secudp_uint32 notAfter;
    secudp_uint8 publicKx[SECUDP_KX_PUBLICBYTES]; 
    secudp_uint8 signature[SECUDP_SIGN_BYTES];
+   secudp_uint8 mac[SECUDP_MACBYTES];
 } SECUDP_PACKED SecUdpProtocolVerifyConnect;
 
 typedef struct _SecUdpProtocolBandwidthLimit
@@ -189,6 +215,48 @@ typedef struct _SecUdpProtocolSendFragment
    secudp_uint32 fragmentOffset;
 } SECUDP_PACKED SecUdpProtocolSendFragment;
 
+/*
+ *  Delivers the sender's broadcast group key and the
+ *  first nonce counter broadcasts are sealed with under
+ *  it, sealed together with the session key.
+ *  Addition to ENet.
+ */
+typedef struct _SecUdpProtocolGroupKey
+{
+   SecUdpProtocolCommandHeader header;
+   secudp_uint8 key[SECUDP_SESSIONKEYBYTES];
+   secudp_uint8 firstNonceCounter[SECUDP_NONCE_COUNTERBYTES];
+   secudp_uint8 nonceCounter[SECUDP_NONCE_COUNTERBYTES];
+   secudp_uint8 mac[SECUDP_MACBYTES];
+} SECUDP_PACKED SecUdpProtocolGroupKey;
+
+/*
+ *  Asks the one trying to connect to resend the connect
+ *  with a cookie proving it owns its address. Sent without
+ *  any state kept, so it is never acknowledged.
+ *  Addition to ENet.
+ */
+typedef struct _SecUdpProtocolRetryConnect
+{
+   SecUdpProtocolCommandHeader header;
+   secudp_uint32 connectID;
+   secudp_uint8 cookie[SECUDP_COOKIEBYTES];
+} SECUDP_PACKED SecUdpProtocolRetryConnect;
+
+/*
+ *  Acknowledges the reliable command with the sequence number
+ *  in the header, and the one n + 1 past it on the same channel
+ *  for each bit n set in receivedMask. Only sent to peers that
+ *  agreed to SECUDP_PROTOCOL_OPTION_SELECTIVE_ACKNOWLEDGE.
+ *  Addition to ENet.
+ */
+typedef struct _SecUdpProtocolSelectiveAcknowledge
+{
+   SecUdpProtocolCommandHeader header;
+   secudp_uint16 receivedSentTime;
+   secudp_uint32 receivedMask;
+} SECUDP_PACKED SecUdpProtocolSelectiveAcknowledge;
+
 typedef union _SecUdpProtocol
 {
    SecUdpProtocolCommandHeader header;
@@ -203,6 +271,9 @@ typedef union _SecUdpProtocol
    SecUdpProtocolSendFragment sendFragment;
    SecUdpProtocolBandwidthLimit bandwidthLimit;
    SecUdpProtocolThrottleConfigure throttleConfigure;
+   SecUdpProtocolGroupKey groupKey;
+   SecUdpProtocolRetryConnect retryConnect;
+   SecUdpProtocolSelectiveAcknowledge selectiveAcknowledge;
 } SECUDP_PACKED SecUdpProtocol;
 
 
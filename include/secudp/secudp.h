@@ -21,6 +21,7 @@ extern "C"
 #include "secudp/types.h"
 #include "secudp/protocol.h"
 #include "secudp/list.h"
+#include "secudp/pool.h"
 #include "secudp/callbacks.h"
 #include "secudp/crypto.h"
 
@@ -63,9 +64,49 @@ typedef enum _SecUdpSocketOption
    SECUDP_SOCKOPT_RCVTIMEO  = 6,
    SECUDP_SOCKOPT_SNDTIMEO  = 7,
    SECUDP_SOCKOPT_ERROR     = 8,
-   SECUDP_SOCKOPT_NODELAY   = 9
+   SECUDP_SOCKOPT_NODELAY   = 9,
+   SECUDP_SOCKOPT_SEGMENT   = 10,
+   SECUDP_SOCKOPT_GRO       = 11,
+   SECUDP_SOCKOPT_REUSEPORT = 12
 } SecUdpSocketOption;
 
+/*
+ *  Limits of UDP segmentation offload: a coalesced send or
+ *  receive holds at most this many datagrams and bytes.
+ *  Addition to ENet.
+ */
+enum
+{
+   SECUDP_SOCKET_SEGMENT_MAXIMUM      = 64,
+   SECUDP_SOCKET_SEGMENT_BUFFER_SIZE  = 65536,
+   SECUDP_SOCKET_SEGMENT_MAXIMUM_SIZE = 65507
+};
+
+/*
+ *  Sizes of the io_uring backend: submission queue entries, and
+ *  receive buffers handed to the kernel, with fewer when each is
+ *  large enough for a coalesced receive. Addition to ENet.
+ */
+enum
+{
+   SECUDP_SOCKET_URING_ENTRIES              = 128,
+   SECUDP_SOCKET_URING_BUFFER_COUNT         = 64,
+   SECUDP_SOCKET_URING_SEGMENT_BUFFER_COUNT = 8
+};
+
+/*
+ *  An io_uring a host sends and receives through instead of
+ *  making socket calls itself. Its layout is platform specific.
+ *  Addition to ENet.
+ */
+typedef struct _SecUdpUring SecUdpUring;
+
+typedef enum _SecUdpSegmentOffload
+{
+   SECUDP_SEGMENT_OFFLOAD_SEND    = (1 << 0),
+   SECUDP_SEGMENT_OFFLOAD_RECEIVE = (1 << 1)
+} SecUdpSegmentOffload;
+
 typedef enum _SecUdpSocketShutdown
 {
     SECUDP_SOCKET_SHUTDOWN_READ       = 0,
@@ -118,7 +159,9 @@ typedef enum _SecUdpPacketFlag
    SECUDP_PACKET_FLAG_UNRELIABLE_FRAGMENT = (1 << 3),
 
    /** whether the packet has been sent from all queues it has been entered into */
-   SECUDP_PACKET_FLAG_SENT = (1<<8)
+   SECUDP_PACKET_FLAG_SENT = (1<<8),
+   /** whether the packet data has been encrypted in place for sending */
+   SECUDP_PACKET_FLAG_SEALED = (1<<9)
 } SecUdpPacketFlag;
 
 typedef void (SECUDP_CALLBACK * SecUdpPacketFreeCallback) (struct _SecUdpPacket *);
@@ -139,12 +182,18 @@ typedef void (SECUDP_CALLBACK * SecUdpPacketFreeCallback) (struct _SecUdpPacket
  *    (not supported for reliable packets)
  *
  *    SECUDP_PACKET_FLAG_NO_ALLOCATE - packet will not allocate data, and user must supply it instead
- *    (yes, that includes space for the nonce and the mac).
+ *    (yes, that includes space for the nonce counter and the mac, i.e. SECUDP_SEALBYTES past dataLength).
  *
  *    SECUDP_PACKET_FLAG_UNRELIABLE_FRAGMENT - packet will be fragmented using unreliable
  *    (instead of reliable) sends if it exceeds the MTU
  *
  *    SECUDP_PACKET_FLAG_SENT - whether the packet has been sent from all queues it has been entered into
+ *
+ *    SECUDP_PACKET_FLAG_SEALED - whether the packet data has been encrypted in place for sending
+ *
+ * Allocated packet data always carries SECUDP_SEALBYTES of tailroom past dataLength so the
+ * payload can be encrypted in place with the nonce counter and mac appended. Once sealed, the data
+ * field holds ciphertext and the packet may not be queued to another peer.
    @sa SecUdpPacketFlag
  */
 typedef struct _SecUdpPacket
@@ -157,18 +206,32 @@ typedef struct _SecUdpPacket
    void *                   userData;        /**< application private data, may be freely modified */
    
    /*
-    *  Ciphertext contains encrypted data.
-    *  Addition to ENet.
+    *  Ciphertext contains encrypted data. For sealed
+    *  and received packets this is a view of data, not
+    *  a separate allocation. Addition to ENet.
     */
    secudp_uint8 *ciphertext;
    size_t cipherLength;
+
+   /*
+    *  Pool the packet returns to once destroyed, and its size
+    *  class there, or NULL if it was allocated on its own.
+    *  Addition to ENet.
+    */
+   struct _SecUdpPacketPool *pool;
+   size_t poolClass;
 } SecUdpPacket;
 
+/*
+ *  Acknowledgement owed to a peer, kept by value in the
+ *  peer's acknowledgement ring. Addition to ENet.
+ */
 typedef struct _SecUdpAcknowledgement
 {
-   SecUdpListNode acknowledgementList;
-   secudp_uint32  sentTime;
-   SecUdpProtocol command;
+   secudp_uint16  reliableSequenceNumber;
+   secudp_uint16  sentTime;
+   secudp_uint8   channelID;
+   secudp_uint8   command;
 } SecUdpAcknowledgement;
 
 typedef struct _SecUdpOutgoingCommand
@@ -182,6 +245,7 @@ typedef struct _SecUdpOutgoingCommand
    secudp_uint32  fragmentOffset;
    secudp_uint16  fragmentLength;
    secudp_uint16  sendAttempts;
+   secudp_uint16  inTransit;
    SecUdpProtocol command;
    SecUdpPacket * packet;
 } SecUdpOutgoingCommand;
@@ -224,6 +288,20 @@ enum
    SECUDP_HOST_DEFAULT_MTU                  = 1400,
    SECUDP_HOST_DEFAULT_MAXIMUM_PACKET_SIZE  = 32 * 1024 * 1024,
    SECUDP_HOST_DEFAULT_MAXIMUM_WAITING_DATA = 32 * 1024 * 1024,
+   SECUDP_PACKET_SEAL_BATCH_SIZE            = 32,
+   SECUDP_PACKET_POOL_MINIMUM_SIZE          = 256,
+   SECUDP_PACKET_POOL_CLASSES               = 10,
+   SECUDP_HOST_DEFAULT_PACKET_POOL_SIZE     = 4 * 1024 * 1024,
+   SECUDP_HOST_COOKIE_INTERVAL              = 10000,
+   SECUDP_HOST_KX_EXPIRY_MARGIN             = 60,
+   SECUDP_HOST_RECEIVE_BATCH_SIZE           = 32,
+   SECUDP_HOST_SEND_BATCH_SIZE              = 64,
+   SECUDP_HOST_SHARD_EVENT_QUEUE_SIZE       = 256,
+   SECUDP_HOST_CRYPTO_QUEUE_SIZE            = 256,
+   SECUDP_HOST_CRYPTO_POLL_INTERVAL         = 1,
+   SECUDP_REACTOR_WAIT_EVENTS               = 64,
+   SECUDP_HOST_POOL_SLAB_OBJECTS            = 64,
+   SECUDP_HOST_FRAGMENT_POOLS               = 8,
 
    SECUDP_PEER_DEFAULT_ROUND_TRIP_TIME      = 500,
    SECUDP_PEER_DEFAULT_PACKET_THROTTLE      = 32,
@@ -244,7 +322,12 @@ enum
    SECUDP_PEER_FREE_UNSEQUENCED_WINDOWS     = 32,
    SECUDP_PEER_RELIABLE_WINDOWS             = 16,
    SECUDP_PEER_RELIABLE_WINDOW_SIZE         = 0x1000,
-   SECUDP_PEER_FREE_RELIABLE_WINDOWS        = 8
+   SECUDP_PEER_FREE_RELIABLE_WINDOWS        = 8,
+   SECUDP_PEER_ACKNOWLEDGEMENT_RING_MINIMUM = 64,
+   SECUDP_PEER_ACKNOWLEDGEMENT_RING_MAXIMUM = SECUDP_PEER_RELIABLE_WINDOW_SIZE,
+   SECUDP_PEER_RELIABLE_COMMANDS_MINIMUM    = 64,
+   SECUDP_PEER_PATH_CHALLENGE_TIMEOUT       = 3000,
+   SECUDP_PEER_PATH_AMPLIFICATION_FACTOR    = 3
 };
 
 typedef struct _SecUdpChannel
@@ -261,7 +344,16 @@ typedef struct _SecUdpChannel
 
 typedef enum _SecUdpPeerFlag
 {
-   SECUDP_PEER_FLAG_NEEDS_DISPATCH = (1 << 0)
+   SECUDP_PEER_FLAG_NEEDS_DISPATCH = (1 << 0),
+   SECUDP_PEER_FLAG_GROUP_PENDING  = (1 << 1),
+   SECUDP_PEER_FLAG_GROUP_MEMBER   = (1 << 2),
+   SECUDP_PEER_FLAG_GROUP_KEY      = (1 << 3),
+   SECUDP_PEER_FLAG_SEAL_DATAGRAMS = (1 << 4),
+   SECUDP_PEER_FLAG_SEAL_INCOMING  = (1 << 5),
+   SECUDP_PEER_FLAG_SEAL_OUTGOING  = (1 << 6),
+   SECUDP_PEER_FLAG_NEEDS_SEND     = (1 << 7),
+   SECUDP_PEER_FLAG_SELECTIVE_ACKNOWLEDGE = (1 << 8),
+   SECUDP_PEER_FLAG_PATH_PENDING   = (1 << 9)
 } SecUdpPeerFlag;
 
 typedef union _SecUdpPeerSecret {
@@ -269,11 +361,48 @@ typedef union _SecUdpPeerSecret {
   {
     secudp_uint8 sendKey[SECUDP_SESSIONKEYBYTES];
     secudp_uint8 recvKey[SECUDP_SESSIONKEYBYTES];
+    
+    /*
+     *  Broadcast group key received from the peer,
+     *  valid once SECUDP_PEER_FLAG_GROUP_KEY is set,
+     *  and the one it replaced, which still opens
+     *  broadcasts with a nonce counter below
+     *  groupNonceCounter.
+     */
+    secudp_uint8 groupKey[SECUDP_SESSIONKEYBYTES];
+    secudp_uint8 previousGroupKey[SECUDP_SESSIONKEYBYTES];
+    secudp_uint64 groupNonceCounter;
+
+    /*
+     *  Keys derived from the session keys for sealing
+     *  whole datagrams, if SECUDP_PEER_FLAG_SEAL_DATAGRAMS
+     *  is set.
+     */
+    secudp_uint8 sendDatagramKey[SECUDP_SESSIONKEYBYTES];
+    secudp_uint8 recvDatagramKey[SECUDP_SESSIONKEYBYTES];
+
+    /*
+     *  Nonce prefixes derived from the keys above. Each
+     *  sealed message carries only the counter completing
+     *  its nonce.
+     */
+    secudp_uint8 sendNoncePrefix[SECUDP_NONCE_PREFIXBYTES];
+    secudp_uint8 recvNoncePrefix[SECUDP_NONCE_PREFIXBYTES];
+    secudp_uint8 groupNoncePrefix[SECUDP_NONCE_PREFIXBYTES];
+    secudp_uint8 previousGroupNoncePrefix[SECUDP_NONCE_PREFIXBYTES];
   } sessionPair;
   struct
   {
     secudp_uint8 privateKx[SECUDP_KX_PRIVATEBYTES];
     secudp_uint8 publicKx[SECUDP_KX_PUBLICBYTES];
+
+    /*
+     *  Protocol options and cipher suites offered in the
+     *  connect, kept until the verify connect is checked
+     *  against them.
+     */
+    secudp_uint32 options;
+    secudp_uint32 cipherSuites;
   } kxPair;
 } SecUdpPeerSecret;
 
@@ -332,7 +461,13 @@ typedef struct _SecUdpPeer
    secudp_uint32   windowSize;
    secudp_uint32   reliableDataInTransit;
    secudp_uint16   outgoingReliableSequenceNumber;
-   SecUdpList      acknowledgements;
+   SecUdpAcknowledgement * acknowledgements; /**< ring of acknowledgements to send, NULL until the first one is queued */
+   size_t          acknowledgementCapacity;  /**< entries in acknowledgements, a power of two */
+   size_t          acknowledgementHead;      /**< index of the oldest acknowledgement in the ring */
+   size_t          acknowledgementCount;     /**< number of acknowledgements in the ring */
+   SecUdpOutgoingCommand ** reliableCommands; /**< open addressing hash table of sent reliable commands awaiting acknowledgement, by channel and sequence number */
+   size_t          reliableCommandMask;      /**< size of reliableCommands minus one, a power of two minus one */
+   size_t          reliableCommandCount;     /**< number of commands in reliableCommands */
    SecUdpList      sentReliableCommands;
    SecUdpList      sentUnreliableCommands;
    SecUdpList      outgoingCommands;
@@ -350,6 +485,51 @@ typedef struct _SecUdpPeer
     *  such as private key exchange variable and session keys.
     */
    SecUdpPeerSecret *secret;
+
+   /*
+    *  Datagram counters used as nonces when sealing
+    *  whole datagrams, and a window of recently seen
+    *  incoming counters to reject replays.
+    */
+   secudp_uint64   outgoingDatagramCounter;
+   secudp_uint64   incomingDatagramCounter;
+   secudp_uint64   incomingDatagramWindow;
+   secudp_uint64   outgoingNonceCounter;
+   SecUdpCipherSuite cipherSuite;      /**< cipher suite negotiated with the peer */
+   size_t          pendingSeals;       /**< packets sent to the peer that a crypto pool worker has yet to seal */
+
+   /*
+    *  Links the peer into the host's send queue while it has
+    *  something new to send, and its position in the host's
+    *  timer heap, plus one, or 0 if it has no timer, with the
+    *  time by which the host next has to visit it to resend or
+    *  ping. Addition to ENet.
+    */
+   SecUdpListNode  sendList;
+   size_t          timerIndex;
+   secudp_uint32   timerDeadline;
+
+   /*
+    *  Links the peer into the host's list of connected
+    *  peers while connected. Addition to ENet.
+    */
+   SecUdpListNode  connectedList;
+
+   /*
+    *  While SECUDP_PEER_FLAG_PATH_PENDING is set, the peer has
+    *  moved to an address that has yet to acknowledge the ping
+    *  with reliable sequence number pathChallenge sent to it.
+    *  Until then the host sends it at most
+    *  SECUDP_PEER_PATH_AMPLIFICATION_FACTOR times the data
+    *  received from it, and goes back to validatedAddress if
+    *  no acknowledgement comes within
+    *  SECUDP_PEER_PATH_CHALLENGE_TIMEOUT. Addition to ENet.
+    */
+   SecUdpAddress   validatedAddress;
+   secudp_uint32   pathChallengeTime;
+   secudp_uint32   pathDataSent;
+   secudp_uint32   pathDataReceived;
+   secudp_uint16   pathChallenge;
 } SecUdpPeer;
 
 /** An SecUdp packet compressor for compressing UDP packets before socket sends or receives.
@@ -377,6 +557,198 @@ typedef struct _SecUdpHostSecret {
   secudp_uint8 publicKey[SECUDP_SIGN_PUBLICBYTES];
 } SecUdpHostSecret;
 
+/*
+ *  Broadcast group of a host. Broadcasts to joined peers
+ *  are sealed once with the group key and the ciphertext
+ *  is shared by every peer. Members may have negotiated
+ *  different cipher suites, so the group always uses
+ *  XSalsa20-Poly1305, which every host supports. The key
+ *  is replaced whenever a peer leaves, and firstNonceCounter
+ *  is the counter the current key started at.
+ *  Addition to ENet.
+ */
+typedef struct _SecUdpHostGroup {
+  secudp_uint8 key[SECUDP_SESSIONKEYBYTES];
+  secudp_uint8 noncePrefix[SECUDP_NONCE_PREFIXBYTES];
+  secudp_uint64 nonceCounter;
+  secudp_uint64 firstNonceCounter;
+} SecUdpHostGroup;
+
+/*
+ *  Semi-static key exchange pair of a host, signed once
+ *  when generated so accepting a connect needs only the
+ *  key exchange and no signature. The signature expires
+ *  at notAfter, in seconds since the epoch. Addition to
+ *  ENet.
+ */
+typedef struct _SecUdpHostKx {
+  secudp_uint8 privateKx[SECUDP_KX_PRIVATEBYTES];
+  secudp_uint8 publicKx[SECUDP_KX_PUBLICBYTES];
+  secudp_uint8 signature[SECUDP_SIGN_BYTES];
+  secudp_uint32 generatedTime;
+  secudp_uint32 notAfter;
+} SecUdpHostKx;
+
+/*
+ *  Key exchange pair generated ahead of a handshake.
+ *  Addition to ENet.
+ */
+typedef struct _SecUdpKxPair {
+  secudp_uint8 privateKx[SECUDP_KX_PRIVATEBYTES];
+  secudp_uint8 publicKx[SECUDP_KX_PUBLICBYTES];
+} SecUdpKxPair;
+
+/*
+ *  Ring of key exchange pairs refilled off the hot path,
+ *  either while the host waits in secudp_host_service()
+ *  or on a helper thread, so a handshake only pops one.
+ *  The mutex guards head and count if threaded is set.
+ *  Private keys are drawn from the random source for all
+ *  free slots at once into seeds, of which seedCount are
+ *  left, and only touched by whoever refills the pool.
+ *  Addition to ENet.
+ */
+typedef struct _SecUdpKxPool {
+  SecUdpKxPair *pairs;
+  size_t capacity;
+  size_t head;
+  size_t count;
+  secudp_uint8 *seeds;
+  size_t seedCount;
+  int threaded;
+  int running;
+  SecUdpThread thread;
+  SecUdpMutex mutex;
+  SecUdpCondition condition;
+} SecUdpKxPool;
+
+/*
+ *  Recycles packets allocated together with their data, in size
+ *  classes of a power of two bytes from SECUDP_PACKET_POOL_MINIMUM_SIZE.
+ *  Packets may be destroyed on any thread and after the host, so the
+ *  pool is locked, and freed once neither the host nor any packet it
+ *  handed out refers to it. Free packets are linked through userData.
+ *  Addition to ENet.
+ */
+typedef struct _SecUdpPacketPool {
+  SecUdpMutex mutex;
+  size_t referenceCount;
+  size_t cachedBytes;
+  size_t maximumBytes;
+  SecUdpPacket *freePackets[SECUDP_PACKET_POOL_CLASSES];
+} SecUdpPacketPool;
+
+typedef enum _SecUdpCryptoJobType
+{
+   SECUDP_CRYPTO_JOB_SEAL = 0,
+   SECUDP_CRYPTO_JOB_OPEN = 1
+} SecUdpCryptoJobType;
+
+/*
+ *  A packet to seal for sending or open after receiving,
+ *  carrying copies of the key material so a worker never
+ *  touches the peer. connectID tells whether the peer is
+ *  still the same connection when the job completes.
+ *  Addition to ENet.
+ */
+typedef struct _SecUdpCryptoJob {
+  SecUdpPeer *peer;
+  SecUdpPacket *packet;
+  secudp_uint32 connectID;
+  secudp_uint8 type;
+  secudp_uint8 channelID;
+  int result;
+  SecUdpCipherSuite suite;
+  secudp_uint64 nonceCounter;
+  secudp_uint8 key[SECUDP_SESSIONKEYBYTES];
+  secudp_uint8 noncePrefix[SECUDP_NONCE_PREFIXBYTES];
+} SecUdpCryptoJob;
+
+/*
+ *  Lock-free ring with a single producer advancing tail
+ *  and a single consumer advancing head.
+ *  Addition to ENet.
+ */
+typedef struct _SecUdpCryptoQueue {
+  SecUdpCryptoJob jobs[SECUDP_HOST_CRYPTO_QUEUE_SIZE];
+  secudp_uint32 head;
+  secudp_uint32 tail;
+} SecUdpCryptoQueue;
+
+/*
+ *  Worker thread of a crypto pool. The service thread
+ *  produces requests and consumes sealed and opened jobs,
+ *  and pending counts the jobs it has yet to consume, so
+ *  no queue can overflow. The mutex and condition are only
+ *  used to sleep while there are no requests.
+ *  Addition to ENet.
+ */
+typedef struct _SecUdpCryptoWorker {
+  SecUdpCryptoQueue requests;
+  SecUdpCryptoQueue sealed;
+  SecUdpCryptoQueue opened;
+  size_t pending;
+  int running;
+  SecUdpThread thread;
+  SecUdpMutex mutex;
+  SecUdpCondition condition;
+} SecUdpCryptoWorker;
+
+/*
+ *  Workers sealing and opening packets off the service
+ *  thread. Every job of one channel of a peer goes to the
+ *  same worker, so packets complete in channel order.
+ *  Addition to ENet.
+ */
+typedef struct _SecUdpCryptoPool {
+  SecUdpCryptoWorker *workers;
+  size_t workerCount;
+  size_t pending;
+} SecUdpCryptoPool;
+
+/*
+ *  Datagrams received by one call to secudp_socket_receive_batch()
+ *  that the host has not handled yet. With receive offload, each
+ *  read may hold several datagrams of segmentSizes bytes back to
+ *  back, and offset is how far the current read has been handled.
+ *  Such reads go to segmentData, which has room for a whole batch
+ *  of them and is only allocated while receive offload is on.
+ *  Addition to ENet.
+ */
+typedef struct _SecUdpReceiveBatch {
+  secudp_uint8 data[SECUDP_HOST_RECEIVE_BATCH_SIZE * SECUDP_PROTOCOL_MAXIMUM_MTU];
+  secudp_uint8 *segmentData;
+  SecUdpBuffer buffers[SECUDP_HOST_RECEIVE_BATCH_SIZE];
+  SecUdpAddress addresses[SECUDP_HOST_RECEIVE_BATCH_SIZE];
+  size_t lengths[SECUDP_HOST_RECEIVE_BATCH_SIZE];
+  size_t segmentSizes[SECUDP_HOST_RECEIVE_BATCH_SIZE];
+  size_t count;
+  size_t index;
+  size_t offset;
+} SecUdpReceiveBatch;
+
+/*
+ *  Datagrams built by the host but not yet handed to
+ *  secudp_socket_send_batch(). Each is flattened into its
+ *  own slot, which leaves room for the checksum since the
+ *  mtu does not account for it. Addition to ENet.
+ */
+typedef struct _SecUdpSendBatch {
+  secudp_uint8 data[SECUDP_HOST_SEND_BATCH_SIZE][SECUDP_PROTOCOL_MAXIMUM_MTU + sizeof (secudp_uint32)];
+  SecUdpBuffer buffers[SECUDP_HOST_SEND_BATCH_SIZE];
+  SecUdpAddress addresses[SECUDP_HOST_SEND_BATCH_SIZE];
+  size_t count;
+} SecUdpSendBatch;
+
+/*
+ *  Number of peers from one IP, an entry of the host's
+ *  table for enforcing duplicatePeers. Addition to ENet.
+ */
+typedef struct _SecUdpHostAddressCount {
+  secudp_uint32 host;
+  size_t peerCount;
+} SecUdpHostAddressCount;
+
 /** An SecUdp host for communicating with peers.
   *
   * No fields should be modified unless otherwise stated.
@@ -437,8 +809,62 @@ typedef struct _SecUdpHost
     *  public key and private key.
     */
    SecUdpHostSecret *secret;
+   SecUdpHostGroup *group;                             /**< broadcast group, NULL unless created with secudp_host_group_create() */
+   int sealDatagrams;                                  /**< nonzero to seal whole datagrams with peers that support it, may be set by the user before connecting */
+   secudp_uint32 cipherSuites;                         /**< bitmask of cipher suites the host may negotiate, defaults to secudp_cipher_suites_available() and may be narrowed by the user */
+   int connectCookies;                                 /**< nonzero to make connecting peers prove their address with a cookie before any state is allocated, may be set by the user */
+   secudp_uint8 cookieKey [SECUDP_COOKIE_KEYBYTES];    /**< random key the host computes connect cookies with */
+   secudp_uint32 kxInterval;                           /**< if nonzero, milliseconds a signed semi-static key exchange pair is used for when accepting connects before it is rotated, after which its signature stays valid for SECUDP_HOST_KX_EXPIRY_MARGIN more seconds, may be set by the user */
+   SecUdpHostKx *kx;                                   /**< current semi-static key exchange pair, NULL until first needed */
+   SecUdpKxPool *kxPool;                               /**< pool of pregenerated key exchange pairs, NULL unless created with secudp_host_kx_pool_create() */
+   SecUdpReceiveBatch *receiveBatch;                   /**< datagrams received in one batch and not yet handled */
+   SecUdpSendBatch *sendBatch;                         /**< datagrams built in one service pass and not yet sent */
+   secudp_uint32 segmentOffload;                       /**< SecUdpSegmentOffload flags enabled with secudp_host_segment_offload() */
+   SecUdpList sendQueue;                               /**< peers with something new to send, linked by sendList */
+   SecUdpPeer **peerTimers;                            /**< min-heap of peers ordered by timerDeadline, so only peers that are due get visited */
+   size_t peerTimerCount;                              /**< number of peers in peerTimers */
+   SecUdpList connectedPeerList;                       /**< peers counted in connectedPeers, linked by connectedList */
+   SecUdpPeer **freePeers;                             /**< stack of disconnected peers, the next one to use on top */
+   size_t freePeerCount;                               /**< number of peers in freePeers */
+   SecUdpPeer **peerAddresses;                         /**< open addressing hash table of peers that are not disconnected, by IP and port */
+   SecUdpHostAddressCount *peerHostCounts;             /**< open addressing hash table counting peers that are neither disconnected nor connecting, by IP */
+   size_t peerAddressMask;                             /**< size of peerAddresses and peerHostCounts minus one, a power of two minus one */
+   secudp_uint8 addressHashKey [SECUDP_ADDRESS_HASH_KEYBYTES]; /**< random key the host hashes addresses with */
+   SecUdpUring *uring;                                 /**< io_uring the host sends and receives through, or NULL, set with secudp_host_uring() */
+   SecUdpCryptoPool *cryptoPool;                       /**< workers sealing and opening packets, NULL unless created with secudp_host_crypto_pool_create() */
+   SecUdpPool outgoingCommandPool;                     /**< pool of SecUdpOutgoingCommand for all peers */
+   SecUdpPool incomingCommandPool;                     /**< pool of SecUdpIncomingCommand for all peers */
+   SecUdpPool fragmentPools [SECUDP_HOST_FRAGMENT_POOLS]; /**< pools of incoming fragment bitmaps, the nth holding 2^n words */
+   SecUdpPacketPool *packetPool;                       /**< pool received and broadcast packets come from, NULL unless created with secudp_host_packet_pool_create() */
 } SecUdpHost;
 
+/*
+ *  Host driven by a reactor, flagged ready while its socket
+ *  is readable or its deadline has passed, until servicing
+ *  it produces no more events. Addition to ENet.
+ */
+typedef struct _SecUdpReactorHost
+{
+   SecUdpHost * host;
+   int ready;
+} SecUdpReactorHost;
+
+/**
+ * Services many hosts from one thread, waiting on all of their sockets at once with
+ * epoll where available and servicing only the hosts that have something to do.
+
+   @sa secudp_reactor_create()
+   @sa secudp_reactor_service()
+ */
+typedef struct _SecUdpReactor
+{
+   SecUdpReactorHost * hosts;         /**< hosts added with secudp_reactor_add() */
+   size_t              hostCount;     /**< number of hosts added */
+   size_t              maximumHosts;  /**< maximum number of hosts that may be added */
+   size_t              nextHost;      /**< host to service first next time, so every host gets its turn */
+   int                 pollSocket;    /**< epoll descriptor, or -1 if the sockets are selected instead */
+} SecUdpReactor;
+
 /**
  * An SecUdp event type, as specified in @ref SecUdpEvent.
  */
@@ -484,6 +910,59 @@ typedef struct _SecUdpEvent
    SecUdpPacket *         packet;    /**< packet associated with the event, if appropriate */
 } SecUdpEvent;
 
+/*
+ *  Event produced by a shard thread and queued until
+ *  secudp_sharded_host_service() hands it out, with the
+ *  connectID of the connection it belongs to, since the
+ *  peer's slot may be reused by then. Addition to ENet.
+ */
+typedef struct _SecUdpShardEvent
+{
+   SecUdpEvent event;
+   secudp_uint32 connectID;
+} SecUdpShardEvent;
+
+/*
+ *  One socket of a sharded host, bound to the shared port with
+ *  SO_REUSEPORT, and the thread servicing it. The mutex guards
+ *  the host, running and wakePending; the host owns the shard's
+ *  slice of peers. Addition to ENet.
+ */
+typedef struct _SecUdpHostShard
+{
+   SecUdpHost * host;
+   struct _SecUdpShardedHost * shardedHost;
+   int running;
+   SecUdpThread thread;
+   SecUdpMutex mutex;
+   secudp_uint32 * connectIDs;   /* connectID of each peer's connection, recorded at its connect event */
+   SecUdpSocket wakeSocket;      /* loopback socket the thread waits on alongside the host's socket */
+   SecUdpAddress wakeAddress;    /* address of wakeSocket, to which a datagram wakes the thread */
+   int wakePending;              /* nonzero while a wake datagram is unread */
+   int stalled;                  /* nonzero while the event queue is too full to service the host, guarded by the event mutex */
+} SecUdpHostShard;
+
+/**
+ * A host split into shards that each service their own socket and peers
+ * on their own thread, presented as a single host.
+
+   @sa secudp_sharded_host_create()
+   @sa secudp_sharded_host_service()
+ */
+typedef struct _SecUdpShardedHost
+{
+   SecUdpHostShard * shards;          /**< array of shards; their hosts may be configured before the first secudp_sharded_host_service() */
+   size_t            shardCount;      /**< number of shards */
+   int               started;         /**< nonzero once the shard threads are running */
+   SecUdpShardEvent * events;         /**< ring of events merged from every shard, allocated up front */
+   size_t            eventCapacity;   /**< number of slots in events */
+   size_t            eventHead;       /**< index of the oldest queued event */
+   size_t            eventCount;      /**< number of queued events */
+   size_t            eventsReserved;  /**< slots held by shard threads for the event they may produce next */
+   SecUdpMutex       eventMutex;      /**< guards the event ring and each shard's stalled flag */
+   SecUdpCondition   eventCondition;  /**< signalled when an event is queued */
+} SecUdpShardedHost;
+
 /** @defgroup global SecUdp global functions
     @{ 
 */
@@ -540,7 +1019,15 @@ SECUDP_API int        secudp_socket_listen (SecUdpSocket, int);
 SECUDP_API SecUdpSocket secudp_socket_accept (SecUdpSocket, SecUdpAddress *);
 SECUDP_API int        secudp_socket_connect (SecUdpSocket, const SecUdpAddress *);
 SECUDP_API int        secudp_socket_send (SecUdpSocket, const SecUdpAddress *, const SecUdpBuffer *, size_t);
+SECUDP_API int        secudp_socket_send_batch (SecUdpSocket, const SecUdpAddress *, const SecUdpBuffer *, size_t, int);
 SECUDP_API int        secudp_socket_receive (SecUdpSocket, SecUdpAddress *, SecUdpBuffer *, size_t);
+SECUDP_API int        secudp_socket_receive_batch (SecUdpSocket, SecUdpAddress *, SecUdpBuffer *, size_t *, size_t *, size_t);
+SECUDP_API SecUdpUring * secudp_uring_create (SecUdpSocket, size_t, size_t);
+SECUDP_API void       secudp_uring_destroy (SecUdpUring *);
+SECUDP_API SecUdpSocket secudp_uring_socket (SecUdpUring *);
+SECUDP_API int        secudp_uring_ready (SecUdpUring *);
+SECUDP_API int        secudp_uring_send_batch (SecUdpUring *, const SecUdpAddress *, const SecUdpBuffer *, size_t, int);
+SECUDP_API int        secudp_uring_receive_batch (SecUdpUring *, SecUdpAddress *, SecUdpBuffer *, size_t *, size_t *, size_t);
 SECUDP_API int        secudp_socket_wait (SecUdpSocket, secudp_uint32 *, secudp_uint32);
 SECUDP_API int        secudp_socket_set_option (SecUdpSocket, SecUdpSocketOption, int);
 SECUDP_API int        secudp_socket_get_option (SecUdpSocket, SecUdpSocketOption, int *);
@@ -550,6 +1037,26 @@ SECUDP_API int        secudp_socketset_select (SecUdpSocket, SecUdpSocketSet *,
 
 /** @} */
 
+/** @defgroup thread SecUdp thread functions
+    @{
+*/
+typedef void (SECUDP_CALLBACK * SecUdpThreadCallback) (void * data);
+
+extern int        secudp_thread_create (SecUdpThread *, SecUdpThreadCallback, void *);
+extern void       secudp_thread_join (SecUdpThread);
+extern int        secudp_mutex_create (SecUdpMutex *);
+extern void       secudp_mutex_destroy (SecUdpMutex *);
+extern void       secudp_mutex_lock (SecUdpMutex *);
+extern void       secudp_mutex_unlock (SecUdpMutex *);
+extern int        secudp_condition_create (SecUdpCondition *);
+extern void       secudp_condition_destroy (SecUdpCondition *);
+extern void       secudp_condition_wait (SecUdpCondition *, SecUdpMutex *);
+extern int        secudp_condition_timed_wait (SecUdpCondition *, SecUdpMutex *, secudp_uint32);
+extern void       secudp_condition_signal (SecUdpCondition *);
+extern void       secudp_condition_broadcast (SecUdpCondition *);
+
+/** @} */
+
 /** @defgroup Address SecUdp address functions
     @{
 */
@@ -600,22 +1107,68 @@ SECUDP_API SecUdpPacket * secudp_packet_create (const void *, size_t, secudp_uin
 SECUDP_API void         secudp_packet_destroy (SecUdpPacket *);
 SECUDP_API int          secudp_packet_resize  (SecUdpPacket *, size_t);
 SECUDP_API secudp_uint32  secudp_crc32 (const SecUdpBuffer *, size_t);
+extern   void         secudp_packet_seal (SecUdpPacket *, SecUdpCipherSuite, const secudp_uint8 *, const secudp_uint8 *, secudp_uint64);
+extern   int          secudp_packet_open (SecUdpPacket *, SecUdpCipherSuite, const secudp_uint8 *, const secudp_uint8 *);
+extern   void         secudp_packet_unseal (SecUdpPacket *, SecUdpCipherSuite, const secudp_uint8 *, const secudp_uint8 *);
+extern   void         secudp_packet_seal_batch (SecUdpPacket **, size_t, SecUdpCipherSuite, const secudp_uint8 *, const secudp_uint8 *, secudp_uint64);
+extern   SecUdpPacket * secudp_packet_create_pooled (SecUdpPacketPool *, const void *, size_t, secudp_uint32);
+extern   void         secudp_packet_pool_release (SecUdpPacketPool *);
                 
 SECUDP_API SecUdpHost * secudp_host_create (const SecUdpAddress *, const SecUdpHostSecret *secret, size_t, size_t, secudp_uint32, secudp_uint32);
 SECUDP_API void       secudp_host_destroy (SecUdpHost *);
 SECUDP_API SecUdpPeer * secudp_host_connect (SecUdpHost *, const SecUdpAddress *, size_t, secudp_uint32);
 SECUDP_API int        secudp_host_check_events (SecUdpHost *, SecUdpEvent *);
+SECUDP_API secudp_uint32 secudp_host_next_timeout (SecUdpHost *);
 SECUDP_API int        secudp_host_service (SecUdpHost *, SecUdpEvent *, secudp_uint32);
 SECUDP_API void       secudp_host_flush (SecUdpHost *);
-SECUDP_API void       secudp_host_broadcast (SecUdpHost *, secudp_uint8, SecUdpPacket *);
+SECUDP_API int        secudp_host_broadcast (SecUdpHost *, secudp_uint8, SecUdpPacket *);
 SECUDP_API void       secudp_host_compress (SecUdpHost *, const SecUdpCompressor *);
 SECUDP_API int        secudp_host_compress_with_range_coder (SecUdpHost * host);
 SECUDP_API void       secudp_host_channel_limit (SecUdpHost *, size_t);
 SECUDP_API void       secudp_host_bandwidth_limit (SecUdpHost *, secudp_uint32, secudp_uint32);
+SECUDP_API int        secudp_host_group_create (SecUdpHost *);
+SECUDP_API void       secudp_host_group_destroy (SecUdpHost *);
+SECUDP_API void       secudp_host_group_rekey (SecUdpHost *);
+SECUDP_API int        secudp_host_segment_offload (SecUdpHost *, int);
+SECUDP_API int        secudp_host_uring (SecUdpHost *, int);
+SECUDP_API int        secudp_host_kx_pool_create (SecUdpHost *, size_t, int);
+SECUDP_API void       secudp_host_kx_pool_destroy (SecUdpHost *);
+SECUDP_API int        secudp_host_crypto_pool_create (SecUdpHost *, size_t);
+SECUDP_API void       secudp_host_crypto_pool_destroy (SecUdpHost *);
+SECUDP_API int        secudp_host_packet_pool_create (SecUdpHost *, size_t);
+SECUDP_API void       secudp_host_packet_pool_destroy (SecUdpHost *);
+SECUDP_API SecUdpPacket * secudp_host_packet_create (SecUdpHost *, const void *, size_t, secudp_uint32);
+
 extern   void       secudp_host_bandwidth_throttle (SecUdpHost *);
+extern  secudp_uint32 secudp_host_next_timeout_at (SecUdpHost *, secudp_uint32);
+extern   SecUdpHostKx * secudp_host_kx (SecUdpHost *);
+extern   void       secudp_host_kx_pool_refill (SecUdpHost *, secudp_uint32);
+extern   void       secudp_host_gen_key_exchange_pair (SecUdpHost *, secudp_uint8 *, secudp_uint8 *);
+extern   int        secudp_host_crypto_pool_seal (SecUdpHost *, SecUdpPeer *, secudp_uint8, SecUdpPacket *);
+extern   int        secudp_host_crypto_pool_open (SecUdpHost *, SecUdpPeer *);
+extern   void       secudp_host_crypto_pool_complete_seals (SecUdpHost *);
+extern   int        secudp_host_crypto_pool_complete_open (SecUdpHost *, SecUdpEvent *);
 extern  secudp_uint32 secudp_host_random_seed (void);
+extern   void       secudp_host_index_peer (SecUdpHost *, SecUdpPeer *);
+extern   void       secudp_host_unindex_peer (SecUdpHost *, SecUdpPeer *);
+extern   SecUdpPeer * secudp_host_find_peer (SecUdpHost *, const SecUdpAddress *, secudp_uint32);
+extern   size_t     secudp_host_count_peers (SecUdpHost *, secudp_uint32);
+
+SECUDP_API SecUdpShardedHost * secudp_sharded_host_create (const SecUdpAddress *, const SecUdpHostSecret *, size_t, size_t, size_t, secudp_uint32, secudp_uint32);
+SECUDP_API void       secudp_sharded_host_destroy (SecUdpShardedHost *);
+SECUDP_API int        secudp_sharded_host_service (SecUdpShardedHost *, SecUdpEvent *, secudp_uint32 *, secudp_uint32);
+SECUDP_API int        secudp_sharded_host_broadcast (SecUdpShardedHost *, secudp_uint8, SecUdpPacket *);
+SECUDP_API int        secudp_sharded_host_peer_send (SecUdpShardedHost *, SecUdpPeer *, secudp_uint32, secudp_uint8, SecUdpPacket *);
+SECUDP_API void       secudp_sharded_host_peer_disconnect (SecUdpShardedHost *, SecUdpPeer *, secudp_uint32, secudp_uint32);
+
+SECUDP_API SecUdpReactor * secudp_reactor_create (size_t);
+SECUDP_API void       secudp_reactor_destroy (SecUdpReactor *);
+SECUDP_API int        secudp_reactor_add (SecUdpReactor *, SecUdpHost *);
+SECUDP_API void       secudp_reactor_remove (SecUdpReactor *, SecUdpHost *);
+SECUDP_API int        secudp_reactor_service (SecUdpReactor *, SecUdpEvent *, SecUdpHost **, secudp_uint32);
 
 SECUDP_API int                 secudp_peer_send (SecUdpPeer *, secudp_uint8, SecUdpPacket *);
+SECUDP_API int                 secudp_peer_send_batch (SecUdpPeer *, secudp_uint8, SecUdpPacket **, size_t);
 SECUDP_API SecUdpPacket *        secudp_peer_receive (SecUdpPeer *, secudp_uint8 * channelID);
 SECUDP_API void                secudp_peer_ping (SecUdpPeer *);
 SECUDP_API void                secudp_peer_ping_interval (SecUdpPeer *, secudp_uint32);
@@ -625,9 +1178,16 @@ SECUDP_API void                secudp_peer_disconnect (SecUdpPeer *, secudp_uint
 SECUDP_API void                secudp_peer_disconnect_now (SecUdpPeer *, secudp_uint32);
 SECUDP_API void                secudp_peer_disconnect_later (SecUdpPeer *, secudp_uint32);
 SECUDP_API void                secudp_peer_throttle_configure (SecUdpPeer *, secudp_uint32, secudp_uint32, secudp_uint32);
+SECUDP_API int                 secudp_peer_group_join (SecUdpPeer *);
+SECUDP_API void                secudp_peer_group_leave (SecUdpPeer *);
 extern int                   secudp_peer_throttle (SecUdpPeer *, secudp_uint32);
 extern void                  secudp_peer_reset_queues (SecUdpPeer *);
+extern int                   secudp_peer_send_sealed (SecUdpPeer *, secudp_uint8, SecUdpPacket *, secudp_uint8);
+extern SecUdpPacket *          secudp_peer_receive_sealed (SecUdpPeer *, secudp_uint8 *, SecUdpCipherSuite *, const secudp_uint8 **, const secudp_uint8 **);
 extern void                  secudp_peer_setup_outgoing_command (SecUdpPeer *, SecUdpOutgoingCommand *);
+extern void                  secudp_peer_schedule (SecUdpPeer *, secudp_uint32);
+extern void                  secudp_peer_unschedule (SecUdpPeer *);
+extern void                  secudp_peer_queue_send (SecUdpPeer *);
 extern SecUdpOutgoingCommand * secudp_peer_queue_outgoing_command (SecUdpPeer *, const SecUdpProtocol *, SecUdpPacket *, secudp_uint32, secudp_uint16);
 extern SecUdpIncomingCommand * secudp_peer_queue_incoming_command (SecUdpPeer *, const SecUdpProtocol *, const void *, size_t, secudp_uint32, secudp_uint32);
 extern SecUdpAcknowledgement * secudp_peer_queue_acknowledgement (SecUdpPeer *, const SecUdpProtocol *, secudp_uint16);
@@ -635,6 +1195,10 @@ extern void                  secudp_peer_dispatch_incoming_unreliable_commands (
 extern void                  secudp_peer_dispatch_incoming_reliable_commands (SecUdpPeer *, SecUdpChannel *, SecUdpIncomingCommand *);
 extern void                  secudp_peer_on_connect (SecUdpPeer *);
 extern void                  secudp_peer_on_disconnect (SecUdpPeer *);
+extern void                  secudp_peer_set_address (SecUdpPeer *, const SecUdpAddress *);
+extern int                   secudp_peer_index_reliable_command (SecUdpPeer *, SecUdpOutgoingCommand *);
+extern void                  secudp_peer_unindex_reliable_command (SecUdpPeer *, SecUdpOutgoingCommand *);
+extern SecUdpOutgoingCommand * secudp_peer_find_reliable_command (SecUdpPeer *, secudp_uint8, secudp_uint16);
 
 SECUDP_API void * secudp_range_coder_create (void);
 SECUDP_API void   secudp_range_coder_destroy (void *);
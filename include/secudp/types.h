@@ -8,6 +8,7 @@
 typedef unsigned char secudp_uint8;       /**< unsigned 8-bit type  */
 typedef unsigned short secudp_uint16;     /**< unsigned 16-bit type */
 typedef unsigned int secudp_uint32;      /**< unsigned 32-bit type */
+typedef unsigned long long secudp_uint64; /**< unsigned 64-bit type */
 
 #endif /* __SECUDP_TYPES_H__ */
 
@@ -12,6 +12,7 @@
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <unistd.h>
+#include <pthread.h>
 
 #ifdef MSG_MAXIOVLEN
 #define SECUDP_BUFFER_MAXIMUM MSG_MAXIOVLEN
@@ -21,6 +22,13 @@ typedef int SecUdpSocket;
 
 #define SECUDP_SOCKET_NULL -1
 
+typedef pthread_t SecUdpThread;
+typedef pthread_mutex_t SecUdpMutex;
+typedef pthread_cond_t SecUdpCondition;
+
+#define SECUDP_ATOMIC_LOAD(pointer) __atomic_load_n ((pointer), __ATOMIC_ACQUIRE)
+#define SECUDP_ATOMIC_STORE(pointer, value) __atomic_store_n ((pointer), (value), __ATOMIC_RELEASE)
+
 #define SECUDP_HOST_TO_NET_16(value) (htons (value)) /**< macro that converts host to net byte-order of a 16-bit value */
 #define SECUDP_HOST_TO_NET_32(value) (htonl (value)) /**< macro that converts host to net byte-order of a 32-bit value */
 
@@ -21,6 +21,13 @@ typedef SOCKET SecUdpSocket;
 
 #define SECUDP_SOCKET_NULL INVALID_SOCKET
 
+typedef HANDLE SecUdpThread;
+typedef CRITICAL_SECTION SecUdpMutex;
+typedef CONDITION_VARIABLE SecUdpCondition;
+
+#define SECUDP_ATOMIC_LOAD(pointer) ((secudp_uint32) InterlockedCompareExchange ((LONG volatile *) (pointer), 0, 0))
+#define SECUDP_ATOMIC_STORE(pointer, value) InterlockedExchange ((LONG volatile *) (pointer), (LONG) (value))
+
 #define SECUDP_HOST_TO_NET_16(value) (htons (value))
 #define SECUDP_HOST_TO_NET_32(value) (htonl (value))
 
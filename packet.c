@@ -29,11 +29,12 @@ secudp_packet_create (const void * data, size_t dataLength, secudp_uint32 flags)
     if (flags & SECUDP_PACKET_FLAG_NO_ALLOCATE)
       packet -> data = (secudp_uint8 *) data;
     else
-    if (dataLength <= 0)
-      packet -> data = NULL;
-    else
     {
-       packet -> data = (secudp_uint8 *) secudp_malloc (dataLength);
+       /*
+        *  Reserve room for the nonce and mac so the data
+        *  can be sealed in place when sent.
+        */
+       packet -> data = (secudp_uint8 *) secudp_malloc (dataLength + SECUDP_SEALBYTES);
        if (packet -> data == NULL)
        {
           secudp_free (packet);
@@ -45,15 +46,160 @@ secudp_packet_create (const void * data, size_t dataLength, secudp_uint32 flags)
     }
 
     packet -> referenceCount = 0;
-    packet -> flags = flags;
+    packet -> flags = flags & ~ SECUDP_PACKET_FLAG_SEALED;
     packet -> dataLength = dataLength;
     packet -> ciphertext = NULL;
+    packet -> cipherLength = 0;
     packet -> freeCallback = NULL;
     packet -> userData = NULL;
+    packet -> pool = NULL;
+    packet -> poolClass = 0;
 
     return packet;
 }
 
+static size_t
+secudp_packet_pool_class_size (size_t poolClass)
+{
+    return (size_t) SECUDP_PACKET_POOL_MINIMUM_SIZE << poolClass;
+}
+
+/*
+ *  Whether the packet data is the buffer allocated
+ *  along with a pooled packet. Addition to ENet.
+ */
+static int
+secudp_packet_pool_data (SecUdpPacket * packet)
+{
+    return packet -> pool != NULL && packet -> data == (secudp_uint8 *) (packet + 1);
+}
+
+/*
+ *  Creates a packet like secudp_packet_create(), taking it from
+ *  the pool's smallest class that fits the data and the seal,
+ *  or allocating it on its own if none does. Addition to ENet.
+ */
+SecUdpPacket *
+secudp_packet_create_pooled (SecUdpPacketPool * pool, const void * data, size_t dataLength, secudp_uint32 flags)
+{
+    SecUdpPacket * packet;
+    size_t poolClass = 0;
+
+    if (flags & SECUDP_PACKET_FLAG_NO_ALLOCATE)
+      return secudp_packet_create (data, dataLength, flags);
+
+    while (poolClass < SECUDP_PACKET_POOL_CLASSES &&
+           secudp_packet_pool_class_size (poolClass) < dataLength + SECUDP_SEALBYTES)
+      ++ poolClass;
+
+    if (poolClass >= SECUDP_PACKET_POOL_CLASSES)
+      return secudp_packet_create (data, dataLength, flags);
+
+    secudp_mutex_lock (& pool -> mutex);
+
+    packet = pool -> freePackets [poolClass];
+    if (packet != NULL)
+    {
+       pool -> freePackets [poolClass] = (SecUdpPacket *) packet -> userData;
+       pool -> cachedBytes -= sizeof (SecUdpPacket) + secudp_packet_pool_class_size (poolClass);
+    }
+
+    ++ pool -> referenceCount;
+
+    secudp_mutex_unlock (& pool -> mutex);
+
+    if (packet == NULL)
+    {
+       packet = (SecUdpPacket *) secudp_malloc (sizeof (SecUdpPacket) + secudp_packet_pool_class_size (poolClass));
+       if (packet == NULL)
+       {
+          secudp_packet_pool_release (pool);
+
+          return NULL;
+       }
+    }
+
+    packet -> data = (secudp_uint8 *) (packet + 1);
+
+    if (data != NULL)
+      memcpy (packet -> data, data, dataLength);
+
+    packet -> referenceCount = 0;
+    packet -> flags = flags & ~ SECUDP_PACKET_FLAG_SEALED;
+    packet -> dataLength = dataLength;
+    packet -> ciphertext = NULL;
+    packet -> cipherLength = 0;
+    packet -> freeCallback = NULL;
+    packet -> userData = NULL;
+    packet -> pool = pool;
+    packet -> poolClass = poolClass;
+
+    return packet;
+}
+
+/*
+ *  Drops a reference to a packet pool, freeing the pool and
+ *  the packets it keeps along with the last one. Addition
+ *  to ENet.
+ */
+void
+secudp_packet_pool_release (SecUdpPacketPool * pool)
+{
+    size_t poolClass, referenceCount;
+
+    secudp_mutex_lock (& pool -> mutex);
+    referenceCount = -- pool -> referenceCount;
+    secudp_mutex_unlock (& pool -> mutex);
+
+    if (referenceCount > 0)
+      return;
+
+    for (poolClass = 0; poolClass < SECUDP_PACKET_POOL_CLASSES; ++ poolClass)
+    {
+       while (pool -> freePackets [poolClass] != NULL)
+       {
+          SecUdpPacket * packet = pool -> freePackets [poolClass];
+
+          pool -> freePackets [poolClass] = (SecUdpPacket *) packet -> userData;
+
+          secudp_free (packet);
+       }
+    }
+
+    secudp_mutex_destroy (& pool -> mutex);
+
+    secudp_free (pool);
+}
+
+/*
+ *  Returns a destroyed packet to its pool, unless the pool
+ *  already keeps as many bytes as it may. Addition to ENet.
+ */
+static void
+secudp_packet_pool_recycle (SecUdpPacket * packet)
+{
+    SecUdpPacketPool * pool = packet -> pool;
+    size_t packetSize = sizeof (SecUdpPacket) + secudp_packet_pool_class_size (packet -> poolClass);
+
+    secudp_mutex_lock (& pool -> mutex);
+
+    if (pool -> cachedBytes + packetSize <= pool -> maximumBytes)
+    {
+       packet -> userData = pool -> freePackets [packet -> poolClass];
+       pool -> freePackets [packet -> poolClass] = packet;
+       pool -> cachedBytes += packetSize;
+
+       packet = NULL;
+    }
+
+    secudp_mutex_unlock (& pool -> mutex);
+
+    if (packet != NULL)
+      secudp_free (packet);
+
+    secudp_packet_pool_release (pool);
+}
+
 /** Destroys the packet and deallocates its data.
     @param packet packet to be destroyed
 */
@@ -66,11 +212,15 @@ secudp_packet_destroy (SecUdpPacket * packet)
     if (packet -> freeCallback != NULL)
       (* packet -> freeCallback) (packet);
     if (! (packet -> flags & SECUDP_PACKET_FLAG_NO_ALLOCATE) &&
-        packet -> data != NULL)
+        packet -> data != NULL &&
+        ! secudp_packet_pool_data (packet))
       secudp_free (packet -> data);
-    if(packet -> ciphertext != NULL)
+    if(packet -> ciphertext != NULL && packet -> ciphertext != packet -> data)
       secudp_free(packet -> ciphertext);
-    secudp_free (packet);
+    if (packet -> pool != NULL)
+      secudp_packet_pool_recycle (packet);
+    else
+      secudp_free (packet);
 }
 
 /** Attempts to resize the data in the packet to length specified in the 
@@ -84,6 +234,9 @@ secudp_packet_resize (SecUdpPacket * packet, size_t dataLength)
 {
     secudp_uint8 * newData;
    
+    if (packet -> flags & SECUDP_PACKET_FLAG_SEALED)
+      return -1;
+
     if (dataLength <= packet -> dataLength || (packet -> flags & SECUDP_PACKET_FLAG_NO_ALLOCATE))
     {
        packet -> dataLength = dataLength;
@@ -91,19 +244,187 @@ secudp_packet_resize (SecUdpPacket * packet, size_t dataLength)
        return 0;
     }
 
-    newData = (secudp_uint8 *) secudp_malloc (dataLength);
+    if (secudp_packet_pool_data (packet) &&
+        dataLength + SECUDP_SEALBYTES <= secudp_packet_pool_class_size (packet -> poolClass))
+    {
+       packet -> dataLength = dataLength;
+
+       return 0;
+    }
+
+    newData = (secudp_uint8 *) secudp_malloc (dataLength + SECUDP_SEALBYTES);
     if (newData == NULL)
       return -1;
 
     memcpy (newData, packet -> data, packet -> dataLength);
-    secudp_free (packet -> data);
+    if (! secudp_packet_pool_data (packet))
+      secudp_free (packet -> data);
     
+    /*
+     *  Received packets keep their ciphertext as a view of data,
+     *  which no longer exists after reallocation.
+     */
+    if (packet -> ciphertext == packet -> data)
+    {
+       packet -> ciphertext = NULL;
+       packet -> cipherLength = 0;
+    }
+
     packet -> data = newData;
     packet -> dataLength = dataLength;
 
     return 0;
 }
 
+/** Seals the packet data in place for sending, appending the nonce counter
+    and mac in the tailroom reserved by secudp_packet_create().
+    @param packet packet to seal
+    @param suite cipher suite to encrypt with
+    @param key key to encrypt with, or NULL to send the data as is because
+    the whole datagram will be sealed
+    @param noncePrefix prefix of the nonce derived for key
+    @param nonceCounter counter completing the nonce, never reused with key
+*/
+void
+secudp_packet_seal (SecUdpPacket * packet, SecUdpCipherSuite suite, const secudp_uint8 * key, const secudp_uint8 * noncePrefix, secudp_uint64 nonceCounter)
+{
+    secudp_uint8 nonce [SECUDP_NONCEBYTES];
+    secudp_uint8 * counterData = packet -> data + packet -> dataLength;
+    int i;
+
+    if (packet -> ciphertext != NULL && packet -> ciphertext != packet -> data)
+      secudp_free (packet -> ciphertext);
+
+    packet -> ciphertext = packet -> data;
+    packet -> flags |= SECUDP_PACKET_FLAG_SEALED;
+
+    if (key == NULL)
+    {
+       packet -> cipherLength = packet -> dataLength;
+
+       return;
+    }
+
+    for (i = 0; i < SECUDP_NONCE_COUNTERBYTES; ++ i)
+      counterData [i] = (secudp_uint8) (nonceCounter >> (i * 8));
+
+    secudp_cipher_nonce (suite, nonce, noncePrefix, counterData);
+    secudp_cipher_encrypt (suite, packet -> data, counterData + SECUDP_NONCE_COUNTERBYTES, packet -> data, packet -> dataLength, NULL, 0, nonce, key);
+
+    packet -> cipherLength = packet -> dataLength + SECUDP_SEALBYTES;
+}
+
+/** Opens a packet sealed by secudp_packet_seal() in place, leaving the
+    ciphertext as a view of the same buffer.
+    @param packet packet to open
+    @param suite cipher suite the packet was sealed with
+    @param key key to decrypt with
+    @param noncePrefix prefix of the nonce derived for key
+    @retval 0 on success
+    @retval < 0 if the packet is too short, there is no key or the packet fails to authenticate
+*/
+int
+secudp_packet_open (SecUdpPacket * packet, SecUdpCipherSuite suite, const secudp_uint8 * key, const secudp_uint8 * noncePrefix)
+{
+    secudp_uint8 nonce [SECUDP_NONCEBYTES];
+    secudp_uint8 * counterData;
+    size_t dataLength;
+
+    if (packet -> dataLength < SECUDP_SEALBYTES || key == NULL)
+      return -1;
+
+    dataLength = packet -> dataLength - SECUDP_SEALBYTES;
+    counterData = packet -> data + dataLength;
+
+    secudp_cipher_nonce (suite, nonce, noncePrefix, counterData);
+
+    if (secudp_cipher_decrypt (suite, packet -> data, packet -> data, counterData + SECUDP_NONCE_COUNTERBYTES, dataLength, NULL, 0, nonce, key))
+      return -1;
+
+    packet -> ciphertext = packet -> data;
+    packet -> cipherLength = packet -> dataLength;
+    packet -> dataLength = dataLength;
+
+    return 0;
+}
+
+/** Reverts secudp_packet_seal() on a packet that could not be queued,
+    decrypting its data in place so that it may be sent again.
+    @param packet packet to unseal
+    @param suite cipher suite the packet was sealed with
+    @param key key the packet was sealed with, or NULL if its data was left as is
+    @param noncePrefix prefix of the nonce derived for key
+*/
+void
+secudp_packet_unseal (SecUdpPacket * packet, SecUdpCipherSuite suite, const secudp_uint8 * key, const secudp_uint8 * noncePrefix)
+{
+    secudp_uint8 nonce [SECUDP_NONCEBYTES];
+    secudp_uint8 * counterData = packet -> data + packet -> dataLength;
+
+    if (key != NULL)
+    {
+       secudp_cipher_nonce (suite, nonce, noncePrefix, counterData);
+       secudp_cipher_decrypt (suite, packet -> data, packet -> data, counterData + SECUDP_NONCE_COUNTERBYTES, packet -> dataLength, NULL, 0, nonce, key);
+    }
+
+    packet -> ciphertext = NULL;
+    packet -> cipherLength = 0;
+    packet -> flags &= ~ SECUDP_PACKET_FLAG_SEALED;
+}
+
+/** Seals several packets in place under the same key, as if by calling
+    secudp_packet_seal() on each with consecutive nonce counters, but with
+    the per-key cipher setup done once for the whole batch.
+    @param packets packets to seal
+    @param packetCount number of packets to seal
+    @param suite cipher suite to encrypt with
+    @param key key to encrypt with
+    @param noncePrefix prefix of the nonce derived for key
+    @param nonceCounter counter completing the nonce of the first packet
+*/
+void
+secudp_packet_seal_batch (SecUdpPacket ** packets, size_t packetCount, SecUdpCipherSuite suite, const secudp_uint8 * key, const secudp_uint8 * noncePrefix, secudp_uint64 nonceCounter)
+{
+    void * messages [SECUDP_PACKET_SEAL_BATCH_SIZE],
+         * macs [SECUDP_PACKET_SEAL_BATCH_SIZE];
+    const void * counters [SECUDP_PACKET_SEAL_BATCH_SIZE];
+    size_t lengths [SECUDP_PACKET_SEAL_BATCH_SIZE];
+
+    while (packetCount > 0)
+    {
+       size_t batchCount = packetCount < SECUDP_PACKET_SEAL_BATCH_SIZE ? packetCount : SECUDP_PACKET_SEAL_BATCH_SIZE,
+              batchIndex;
+
+       for (batchIndex = 0; batchIndex < batchCount; ++ batchIndex)
+       {
+          SecUdpPacket * packet = packets [batchIndex];
+          secudp_uint8 * counterData = packet -> data + packet -> dataLength;
+          int i;
+
+          if (packet -> ciphertext != NULL && packet -> ciphertext != packet -> data)
+            secudp_free (packet -> ciphertext);
+
+          packet -> ciphertext = packet -> data;
+          packet -> cipherLength = packet -> dataLength + SECUDP_SEALBYTES;
+          packet -> flags |= SECUDP_PACKET_FLAG_SEALED;
+
+          for (i = 0; i < SECUDP_NONCE_COUNTERBYTES; ++ i)
+            counterData [i] = (secudp_uint8) (nonceCounter >> (i * 8));
+          ++ nonceCounter;
+
+          messages [batchIndex] = packet -> data;
+          macs [batchIndex] = counterData + SECUDP_NONCE_COUNTERBYTES;
+          counters [batchIndex] = counterData;
+          lengths [batchIndex] = packet -> dataLength;
+       }
+
+       secudp_cipher_encrypt_batch (suite, messages, macs, lengths, counters, batchCount, noncePrefix, key);
+
+       packets += batchCount;
+       packetCount -= batchCount;
+    }
+}
+
 static int initializedCRC32 = 0;
 static secudp_uint32 crcTable [256];
 
@@ -5,6 +5,7 @@
 #include <string.h>
 #define SECUDP_BUILDING_LIB 1
 #include "secudp/secudp.h"
+#include "secudp/time.h"
 #include "secudp/crypto.h"
 
 /** @defgroup peer SecUdp peer functions 
@@ -59,6 +60,73 @@ secudp_peer_throttle_configure (SecUdpPeer * peer, secudp_uint32 interval, secud
     secudp_peer_queue_outgoing_command (peer, & command, NULL, 0, 0);
 }
 
+/** Joins a peer to the broadcast group of its host.
+    @param peer peer to join
+    @retval 0 on success
+    @retval < 0 on failure
+    @remarks The group key is sent reliably to the peer sealed with its session key. Broadcasts
+    are only sealed with the group key for the peer once it has acknowledged the key; until then
+    it receives its own copy as with any other peer. Group broadcasts are authenticated as sealed
+    by the host or some member of the group, not by the host alone.
+    @sa secudp_host_group_create()
+*/
+int
+secudp_peer_group_join (SecUdpPeer * peer)
+{
+    SecUdpHost * host = peer -> host;
+    SecUdpProtocol command;
+    secudp_uint8 nonce [SECUDP_NONCEBYTES];
+    secudp_uint8 groupKey [SECUDP_SESSIONKEYBYTES + SECUDP_NONCE_COUNTERBYTES];
+    secudp_uint64 nonceCounter;
+    int i;
+
+    if (host -> group == NULL || peer -> state != SECUDP_PEER_STATE_CONNECTED)
+      return -1;
+
+    if (peer -> flags & (SECUDP_PEER_FLAG_GROUP_PENDING | SECUDP_PEER_FLAG_GROUP_MEMBER))
+      return 0;
+
+    command.header.command = SECUDP_PROTOCOL_COMMAND_GROUP_KEY | SECUDP_PROTOCOL_COMMAND_FLAG_ACKNOWLEDGE;
+    command.header.channelID = 0xFF;
+
+    nonceCounter = peer -> outgoingNonceCounter ++;
+    memcpy (groupKey, host -> group -> key, SECUDP_SESSIONKEYBYTES);
+    for (i = 0; i < SECUDP_NONCE_COUNTERBYTES; ++ i)
+    {
+      command.groupKey.nonceCounter [i] = (secudp_uint8) (nonceCounter >> (i * 8));
+      groupKey [SECUDP_SESSIONKEYBYTES + i] = (secudp_uint8) (host -> group -> firstNonceCounter >> (i * 8));
+    }
+
+    /* The key and its first counter are sealed as one message into the adjacent key and firstNonceCounter. */
+    secudp_cipher_nonce (peer -> cipherSuite, nonce, peer -> secret -> sessionPair.sendNoncePrefix, command.groupKey.nonceCounter);
+    secudp_cipher_encrypt (peer -> cipherSuite, command.groupKey.key, command.groupKey.mac, groupKey, sizeof (groupKey), NULL, 0, nonce, peer -> secret -> sessionPair.sendKey);
+
+    sodium_memzero (groupKey, sizeof (groupKey));
+
+    if (secudp_peer_queue_outgoing_command (peer, & command, NULL, 0, 0) == NULL)
+      return -1;
+
+    peer -> flags |= SECUDP_PEER_FLAG_GROUP_PENDING;
+
+    return 0;
+}
+
+/** Removes a peer from the broadcast group of its host.
+    @param peer peer to remove
+    @remarks Broadcasts already queued to the peer are still delivered. The group is rekeyed
+    for the remaining members with secudp_host_group_rekey(), as it is when a member disconnects.
+*/
+void
+secudp_peer_group_leave (SecUdpPeer * peer)
+{
+    if (! (peer -> flags & (SECUDP_PEER_FLAG_GROUP_PENDING | SECUDP_PEER_FLAG_GROUP_MEMBER)))
+      return;
+
+    peer -> flags &= ~ (SECUDP_PEER_FLAG_GROUP_PENDING | SECUDP_PEER_FLAG_GROUP_MEMBER);
+
+    secudp_host_group_rekey (peer -> host);
+}
+
 int
 secudp_peer_throttle (SecUdpPeer * peer, secudp_uint32 rtt)
 {
@@ -90,47 +158,149 @@ secudp_peer_throttle (SecUdpPeer * peer, secudp_uint32 rtt)
     return 0;
 }
 
+/* Restores the plaintext of packets sealed for peer that could not be queued. */
+static void
+secudp_peer_unseal_packets (SecUdpPeer * peer, SecUdpPacket ** packets, size_t packetCount)
+{
+   size_t packetIndex;
+
+   for (packetIndex = 0; packetIndex < packetCount; ++ packetIndex)
+   {
+      if (peer -> flags & SECUDP_PEER_FLAG_SEAL_DATAGRAMS)
+        secudp_packet_unseal (packets [packetIndex], peer -> cipherSuite, NULL, NULL);
+      else
+        secudp_packet_unseal (packets [packetIndex], peer -> cipherSuite, peer -> secret -> sessionPair.sendKey, peer -> secret -> sessionPair.sendNoncePrefix);
+   }
+}
+
 /** Queues a packet to be sent.
     @param peer destination for the packet
     @param channelID channel on which to send
     @param packet packet to send
     @retval 0 on success
     @retval < 0 on failure
+    @remarks the packet data is encrypted in place, so a packet may only be queued to a single peer;
+    use secudp_host_broadcast() to send the same data to several peers. If the host has a crypto
+    pool, the packet is encrypted by a worker and queued during a later secudp_host_service().
 */
 int
 secudp_peer_send (SecUdpPeer * peer, secudp_uint8 channelID, SecUdpPacket * packet)
 {
-   SecUdpChannel * channel = & peer -> channels [channelID];
-   SecUdpProtocol command;
-   size_t fragmentLength;
-   secudp_uint8 *ciphertext;
-   secudp_uint8 *nonce;
-   secudp_uint8 *mac;
-
-   packet -> cipherLength = packet -> dataLength + SECUDP_NONCEBYTES + SECUDP_MACBYTES;
-   if(packet -> cipherLength < packet -> dataLength)
+   if (peer -> state != SECUDP_PEER_STATE_CONNECTED ||
+       channelID >= peer -> channelCount ||
+       packet -> dataLength > peer -> host -> maximumPacketSize ||
+       (packet -> flags & SECUDP_PACKET_FLAG_SEALED))
      return -1;
 
    /*
-    *  Encrypt the packet data. Special step not in ENet.
+    *  Leave the encryption to the crypto pool if the host has one;
+    *  the packet is queued once it comes back sealed.
     */
-   ciphertext = (secudp_uint8 *) secudp_malloc(packet -> cipherLength);
-   if(ciphertext == NULL)
-     return -1;
-   nonce = ciphertext + packet -> dataLength;
-   mac = nonce + SECUDP_NONCEBYTES;
-   secudp_random(nonce, SECUDP_NONCEBYTES);
-   secudp_peer_encrypt(ciphertext, mac, packet -> data, packet -> dataLength, nonce, peer -> secret -> sessionPair.sendKey);
-   packet -> ciphertext = ciphertext;
+   if (peer -> host -> cryptoPool != NULL && ! (peer -> flags & SECUDP_PEER_FLAG_SEAL_DATAGRAMS))
+     return secudp_host_crypto_pool_seal (peer -> host, peer, channelID, packet);
+
+   /*
+    *  Encrypt the packet data in place with the session key,
+    *  unless whole datagrams are sealed for this peer.
+    *  Special step not in ENet.
+    */
+   if (peer -> flags & SECUDP_PEER_FLAG_SEAL_DATAGRAMS)
+     secudp_packet_seal (packet, peer -> cipherSuite, NULL, NULL, 0);
+   else
+     secudp_packet_seal (packet, peer -> cipherSuite, peer -> secret -> sessionPair.sendKey, peer -> secret -> sessionPair.sendNoncePrefix, peer -> outgoingNonceCounter ++);
+
+   if (secudp_peer_send_sealed (peer, channelID, packet, 0) < 0)
+   {
+      secudp_peer_unseal_packets (peer, & packet, 1);
+
+      return -1;
+   }
+
+   return 0;
+}
+
+/** Queues several packets to be sent, sealing them together.
+    @param peer destination for the packets
+    @param channelID channel on which to send
+    @param packets packets to send, in order
+    @param packetCount number of packets to send
+    @returns the number of packets queued, or < 0 if none could be
+    @remarks this is equivalent to calling secudp_peer_send() on each packet
+    in turn, but the per-key cipher setup is shared by the whole batch. If
+    fewer than packetCount packets are queued, the rest are left unsealed
+    and may be sent again.
+*/
+int
+secudp_peer_send_batch (SecUdpPeer * peer, secudp_uint8 channelID, SecUdpPacket ** packets, size_t packetCount)
+{
+   size_t packetIndex;
 
    if (peer -> state != SECUDP_PEER_STATE_CONNECTED ||
-       channelID >= peer -> channelCount ||
-       packet -> dataLength > peer -> host -> maximumPacketSize)
+       channelID >= peer -> channelCount)
      return -1;
 
+   for (packetIndex = 0; packetIndex < packetCount; ++ packetIndex)
+   {
+      if (packets [packetIndex] -> dataLength > peer -> host -> maximumPacketSize ||
+          (packets [packetIndex] -> flags & SECUDP_PACKET_FLAG_SEALED))
+        return -1;
+   }
+
+   if (peer -> host -> cryptoPool != NULL && ! (peer -> flags & SECUDP_PEER_FLAG_SEAL_DATAGRAMS))
+   {
+      for (packetIndex = 0; packetIndex < packetCount; ++ packetIndex)
+      {
+         if (secudp_host_crypto_pool_seal (peer -> host, peer, channelID, packets [packetIndex]) < 0)
+           return packetIndex > 0 ? (int) packetIndex : -1;
+      }
+
+      return (int) packetCount;
+   }
+
+   if (peer -> flags & SECUDP_PEER_FLAG_SEAL_DATAGRAMS)
+   {
+      for (packetIndex = 0; packetIndex < packetCount; ++ packetIndex)
+        secudp_packet_seal (packets [packetIndex], peer -> cipherSuite, NULL, NULL, 0);
+   }
+   else
+   {
+      secudp_packet_seal_batch (packets, packetCount, peer -> cipherSuite, peer -> secret -> sessionPair.sendKey, peer -> secret -> sessionPair.sendNoncePrefix, peer -> outgoingNonceCounter);
+      peer -> outgoingNonceCounter += packetCount;
+   }
+
+   for (packetIndex = 0; packetIndex < packetCount; ++ packetIndex)
+   {
+      if (secudp_peer_send_sealed (peer, channelID, packets [packetIndex], 0) < 0)
+      {
+         secudp_peer_unseal_packets (peer, & packets [packetIndex], packetCount - packetIndex);
+
+         return packetIndex > 0 ? (int) packetIndex : -1;
+      }
+   }
+
+   return (int) packetCount;
+}
+
+/** Queues an already sealed packet to be sent.
+    @param peer destination for the packet
+    @param channelID channel on which to send
+    @param packet sealed packet to send
+    @param commandFlags additional protocol command flags for the queued commands
+    @retval 0 on success
+    @retval < 0 on failure
+*/
+int
+secudp_peer_send_sealed (SecUdpPeer * peer, secudp_uint8 channelID, SecUdpPacket * packet, secudp_uint8 commandFlags)
+{
+   SecUdpChannel * channel = & peer -> channels [channelID];
+   SecUdpProtocol command;
+   size_t fragmentLength;
+
    fragmentLength = peer -> mtu - sizeof (SecUdpProtocolHeader) - sizeof (SecUdpProtocolSendFragment);
    if (peer -> host -> checksum != NULL)
      fragmentLength -= sizeof(secudp_uint32);
+   if (peer -> flags & SECUDP_PEER_FLAG_SEAL_DATAGRAMS)
+     fragmentLength -= SECUDP_DATAGRAM_SEALBYTES;
 
    if (packet -> cipherLength > fragmentLength)
    {
@@ -148,12 +318,12 @@ secudp_peer_send (SecUdpPeer * peer, secudp_uint8 channelID, SecUdpPacket * pack
       if ((packet -> flags & (SECUDP_PACKET_FLAG_RELIABLE | SECUDP_PACKET_FLAG_UNRELIABLE_FRAGMENT)) == SECUDP_PACKET_FLAG_UNRELIABLE_FRAGMENT &&
           channel -> outgoingUnreliableSequenceNumber < 0xFFFF)
       {
-         commandNumber = SECUDP_PROTOCOL_COMMAND_SEND_UNRELIABLE_FRAGMENT;
+         commandNumber = SECUDP_PROTOCOL_COMMAND_SEND_UNRELIABLE_FRAGMENT | commandFlags;
          startSequenceNumber = SECUDP_HOST_TO_NET_16 (channel -> outgoingUnreliableSequenceNumber + 1);
       }
       else
       {
-         commandNumber = SECUDP_PROTOCOL_COMMAND_SEND_FRAGMENT | SECUDP_PROTOCOL_COMMAND_FLAG_ACKNOWLEDGE;
+         commandNumber = SECUDP_PROTOCOL_COMMAND_SEND_FRAGMENT | SECUDP_PROTOCOL_COMMAND_FLAG_ACKNOWLEDGE | commandFlags;
          startSequenceNumber = SECUDP_HOST_TO_NET_16 (channel -> outgoingReliableSequenceNumber + 1);
       }
         
@@ -168,14 +338,14 @@ secudp_peer_send (SecUdpPeer * peer, secudp_uint8 channelID, SecUdpPacket * pack
          if (packet -> cipherLength - fragmentOffset < fragmentLength)
            fragmentLength = packet -> cipherLength - fragmentOffset;
 
-         fragment = (SecUdpOutgoingCommand *) secudp_malloc (sizeof (SecUdpOutgoingCommand));
+         fragment = (SecUdpOutgoingCommand *) secudp_pool_alloc (& peer -> host -> outgoingCommandPool);
          if (fragment == NULL)
          {
             while (! secudp_list_empty (& fragments))
             {
                fragment = (SecUdpOutgoingCommand *) secudp_list_remove (secudp_list_begin (& fragments));
                
-               secudp_free (fragment);
+               secudp_pool_free (& peer -> host -> outgoingCommandPool, fragment);
             }
             
             return -1;
@@ -227,28 +397,71 @@ secudp_peer_send (SecUdpPeer * peer, secudp_uint8 channelID, SecUdpPacket * pack
       command.sendUnreliable.dataLength = SECUDP_HOST_TO_NET_16 (packet -> cipherLength);
    }
 
+   command.header.command |= commandFlags;
+
    if (secudp_peer_queue_outgoing_command (peer, & command, packet, 0, packet -> cipherLength) == NULL)
      return -1;
 
    return 0;
 }
 
-/** Attempts to dequeue any incoming queued packet.
+/*
+ *  Fragment bitmaps come from the host's pool for the next
+ *  power of two words, or from secudp_malloc() once they
+ *  outgrow the largest pool. Addition to ENet.
+ */
+static size_t
+secudp_peer_fragment_pool (secudp_uint32 fragmentCount)
+{
+   size_t words = (fragmentCount + 31) / 32, pool = 0;
+
+   while (((size_t) 1 << pool) < words)
+     ++ pool;
+
+   return pool;
+}
+
+static secudp_uint32 *
+secudp_peer_alloc_fragments (SecUdpPeer * peer, secudp_uint32 fragmentCount)
+{
+   size_t pool = secudp_peer_fragment_pool (fragmentCount);
+
+   if (pool < SECUDP_HOST_FRAGMENT_POOLS)
+     return (secudp_uint32 *) secudp_pool_alloc (& peer -> host -> fragmentPools [pool]);
+
+   return (secudp_uint32 *) secudp_malloc ((fragmentCount + 31) / 32 * sizeof (secudp_uint32));
+}
+
+static void
+secudp_peer_free_incoming_command (SecUdpPeer * peer, SecUdpIncomingCommand * incomingCommand)
+{
+   if (incomingCommand -> fragments != NULL)
+   {
+      size_t pool = secudp_peer_fragment_pool (incomingCommand -> fragmentCount);
+
+      if (pool < SECUDP_HOST_FRAGMENT_POOLS)
+        secudp_pool_free (& peer -> host -> fragmentPools [pool], incomingCommand -> fragments);
+      else
+        secudp_free (incomingCommand -> fragments);
+   }
+
+   secudp_pool_free (& peer -> host -> incomingCommandPool, incomingCommand);
+}
+
+/** Dequeues any incoming queued packet without opening it.
     @param peer peer to dequeue packets from
     @param channelID holds the channel ID of the channel the packet was received on success
+    @param suite holds the cipher suite the packet was sealed with
+    @param key holds the key the packet was sealed with, or NULL if the peer has none
+    @param noncePrefix holds the prefix of the nonce derived for key
     @returns a pointer to the packet, or NULL if there are no available incoming queued packets
+    @remarks the packet arrives as is if whole datagrams are sealed for the peer
 */
 SecUdpPacket *
-secudp_peer_receive (SecUdpPeer * peer, secudp_uint8 * channelID)
+secudp_peer_receive_sealed (SecUdpPeer * peer, secudp_uint8 * channelID, SecUdpCipherSuite * suite, const secudp_uint8 ** key, const secudp_uint8 ** noncePrefix)
 {
    SecUdpIncomingCommand * incomingCommand;
    SecUdpPacket * packet;
-   secudp_uint8 * data;
-   secudp_uint8 * ciphertext;
-   size_t dataLength;
-   size_t cipherLength;
-   secudp_uint8 * mac;
-   secudp_uint8 * nonce;
    
    if (secudp_list_empty (& peer -> dispatchedCommands))
      return NULL;
@@ -262,58 +475,102 @@ secudp_peer_receive (SecUdpPeer * peer, secudp_uint8 * channelID)
 
    -- packet -> referenceCount;
 
-   if (incomingCommand -> fragments != NULL)
-     secudp_free (incomingCommand -> fragments);
-
-   secudp_free (incomingCommand);
-
    /*
-    *  One man's ciphertext is another's data.
-    *  data here is actually the ciphertext of the
-    *  sender, so decrypt that into ciphertext and 
-    *  do a swap.
+    *  Broadcasts sealed with the peer's group key are
+    *  flagged in the command header. Those sealed before
+    *  the key last changed need the previous one.
     */
-   if(packet -> dataLength < SECUDP_NONCEBYTES + SECUDP_MACBYTES)
+   if (incomingCommand -> command.header.command & SECUDP_PROTOCOL_COMMAND_FLAG_GROUP)
    {
-       secudp_packet_destroy(packet);
-       return NULL;
+     secudp_uint64 nonceCounter = 0;
+     int i;
+
+     if (packet -> dataLength >= SECUDP_SEALBYTES)
+     {
+        const secudp_uint8 * counterData = packet -> data + packet -> dataLength - SECUDP_SEALBYTES;
+
+        for (i = 0; i < SECUDP_NONCE_COUNTERBYTES; ++ i)
+          nonceCounter |= (secudp_uint64) counterData [i] << (i * 8);
+     }
+
+     if (nonceCounter >= peer -> secret -> sessionPair.groupNonceCounter)
+     {
+        * key = peer -> secret -> sessionPair.groupKey;
+        * noncePrefix = peer -> secret -> sessionPair.groupNoncePrefix;
+     }
+     else
+     {
+        * key = peer -> secret -> sessionPair.previousGroupKey;
+        * noncePrefix = peer -> secret -> sessionPair.previousGroupNoncePrefix;
+     }
+
+     if (! (peer -> flags & SECUDP_PEER_FLAG_GROUP_KEY))
+       * key = NULL;
+
+     * suite = SECUDP_CIPHER_SUITE_XSALSA20_POLY1305;
    }
-   ciphertext = packet -> data;
-   cipherLength = packet -> dataLength;
-   dataLength = cipherLength - SECUDP_NONCEBYTES - SECUDP_MACBYTES;
-   data = secudp_malloc(dataLength);
-   if(data == NULL)
+   else
    {
-       secudp_packet_destroy(packet);
-       return NULL;
+     * key = peer -> secret -> sessionPair.recvKey;
+     * noncePrefix = peer -> secret -> sessionPair.recvNoncePrefix;
+     * suite = peer -> cipherSuite;
    }
-   nonce = ciphertext + dataLength;
-   mac = nonce + SECUDP_NONCEBYTES;
-   
+
+   secudp_peer_free_incoming_command (peer, incomingCommand);
+
+   peer -> totalWaitingData -= packet -> dataLength;
+
+   return packet;
+}
+
+/** Attempts to dequeue any incoming queued packet.
+    @param peer peer to dequeue packets from
+    @param channelID holds the channel ID of the channel the packet was received on success
+    @returns a pointer to the packet, or NULL if there are no available incoming queued packets
+*/
+SecUdpPacket *
+secudp_peer_receive (SecUdpPeer * peer, secudp_uint8 * channelID)
+{
+   SecUdpPacket * packet;
+   const secudp_uint8 * key,
+                      * noncePrefix;
+   SecUdpCipherSuite suite;
+
+   packet = secudp_peer_receive_sealed (peer, channelID, & suite, & key, & noncePrefix);
+   if (packet == NULL)
+     return NULL;
+
    /*
-    *  Decrypt the data and return NULL if it's bad data. 
-    *  Special step not in ENet.
+    *  Payloads arrive as is when whole datagrams are sealed,
+    *  since those were already opened when received.
     */
-   if(secudp_peer_decrypt(data, ciphertext, mac, dataLength, nonce, peer -> secret -> sessionPair.recvKey))
+   if (peer -> flags & SECUDP_PEER_FLAG_SEAL_DATAGRAMS)
+   {
+       packet -> ciphertext = packet -> data;
+       packet -> cipherLength = packet -> dataLength;
+
+       return packet;
+   }
+
+   /*
+    *  One man's ciphertext is another's data.
+    *  data here is actually the ciphertext of the
+    *  sender, so decrypt it in place and return NULL
+    *  if it's bad data. Special step not in ENet.
+    */
+   if (secudp_packet_open (packet, suite, key, noncePrefix) < 0)
    {
      printf("Failed decryption\n");
        
      secudp_packet_destroy(packet);
-     secudp_free(data);
      return NULL;
    } 
    
-   packet -> ciphertext = ciphertext;
-   packet -> data = data;
-   packet -> dataLength = dataLength;
-   packet -> cipherLength = cipherLength;
-   
-   peer -> totalWaitingData -= packet -> cipherLength;
    return packet;
 }
 
 static void
-secudp_peer_reset_outgoing_commands (SecUdpList * queue)
+secudp_peer_reset_outgoing_commands (SecUdpPeer * peer, SecUdpList * queue)
 {
     SecUdpOutgoingCommand * outgoingCommand;
 
@@ -329,12 +586,12 @@ secudp_peer_reset_outgoing_commands (SecUdpList * queue)
             secudp_packet_destroy (outgoingCommand -> packet);
        }
 
-       secudp_free (outgoingCommand);
+       secudp_pool_free (& peer -> host -> outgoingCommandPool, outgoingCommand);
     }
 }
 
 static void
-secudp_peer_remove_incoming_commands (SecUdpList * queue, SecUdpListIterator startCommand, SecUdpListIterator endCommand, SecUdpIncomingCommand * excludeCommand)
+secudp_peer_remove_incoming_commands (SecUdpPeer * peer, SecUdpList * queue, SecUdpListIterator startCommand, SecUdpListIterator endCommand, SecUdpIncomingCommand * excludeCommand)
 {
     SecUdpListIterator currentCommand;    
     
@@ -357,19 +614,128 @@ secudp_peer_remove_incoming_commands (SecUdpList * queue, SecUdpListIterator sta
             secudp_packet_destroy (incomingCommand -> packet);
        }
 
-       if (incomingCommand -> fragments != NULL)
-         secudp_free (incomingCommand -> fragments);
-
-       secudp_free (incomingCommand);
+       secudp_peer_free_incoming_command (peer, incomingCommand);
     }
 }
 
 static void
-secudp_peer_reset_incoming_commands (SecUdpList * queue)
+secudp_peer_reset_incoming_commands (SecUdpPeer * peer, SecUdpList * queue)
 {
-    secudp_peer_remove_incoming_commands(queue, secudp_list_begin (queue), secudp_list_end (queue), NULL);
+    secudp_peer_remove_incoming_commands(peer, queue, secudp_list_begin (queue), secudp_list_end (queue), NULL);
 }
  
+static void
+secudp_peer_timer_swap (SecUdpHost * host, size_t first, size_t second)
+{
+    SecUdpPeer * peer = host -> peerTimers [first];
+
+    host -> peerTimers [first] = host -> peerTimers [second];
+    host -> peerTimers [second] = peer;
+
+    host -> peerTimers [first] -> timerIndex = first + 1;
+    host -> peerTimers [second] -> timerIndex = second + 1;
+}
+
+static void
+secudp_peer_timer_sift (SecUdpHost * host, size_t index)
+{
+    while (index > 0)
+    {
+       size_t parent = (index - 1) / 2;
+
+       if (! SECUDP_TIME_LESS (host -> peerTimers [index] -> timerDeadline, host -> peerTimers [parent] -> timerDeadline))
+         break;
+
+       secudp_peer_timer_swap (host, index, parent);
+       index = parent;
+    }
+
+    for (;;)
+    {
+       size_t child = 2 * index + 1;
+
+       if (child >= host -> peerTimerCount)
+         break;
+
+       if (child + 1 < host -> peerTimerCount &&
+           SECUDP_TIME_LESS (host -> peerTimers [child + 1] -> timerDeadline, host -> peerTimers [child] -> timerDeadline))
+         ++ child;
+
+       if (! SECUDP_TIME_LESS (host -> peerTimers [child] -> timerDeadline, host -> peerTimers [index] -> timerDeadline))
+         break;
+
+       secudp_peer_timer_swap (host, index, child);
+       index = child;
+    }
+}
+
+/** Sets the time by which the host next has to visit a peer in its send pass,
+    adding the peer to the host's timer heap if it is not there yet.
+    @param peer peer to schedule
+    @param deadline service time at which the peer is due
+*/
+void
+secudp_peer_schedule (SecUdpPeer * peer, secudp_uint32 deadline)
+{
+    SecUdpHost * host = peer -> host;
+
+    peer -> timerDeadline = deadline;
+
+    if (peer -> timerIndex == 0)
+    {
+       host -> peerTimers [host -> peerTimerCount ++] = peer;
+       peer -> timerIndex = host -> peerTimerCount;
+    }
+
+    secudp_peer_timer_sift (host, peer -> timerIndex - 1);
+}
+
+/** Removes a peer from the host's timer heap and send queue.
+    @param peer peer to unschedule
+*/
+void
+secudp_peer_unschedule (SecUdpPeer * peer)
+{
+    SecUdpHost * host = peer -> host;
+    size_t index;
+
+    if (peer -> flags & SECUDP_PEER_FLAG_NEEDS_SEND)
+    {
+       secudp_list_remove (& peer -> sendList);
+
+       peer -> flags &= ~ SECUDP_PEER_FLAG_NEEDS_SEND;
+    }
+
+    if (peer -> timerIndex == 0)
+      return;
+
+    index = peer -> timerIndex - 1;
+    peer -> timerIndex = 0;
+
+    if (index != -- host -> peerTimerCount)
+    {
+       host -> peerTimers [index] = host -> peerTimers [host -> peerTimerCount];
+       host -> peerTimers [index] -> timerIndex = index + 1;
+
+       secudp_peer_timer_sift (host, index);
+    }
+}
+
+/** Queues a peer to be visited by the host's next send pass, because it has
+    something new to send or acknowledge, or because what it waits on may have changed.
+    @param peer peer to queue
+*/
+void
+secudp_peer_queue_send (SecUdpPeer * peer)
+{
+    if (peer -> flags & SECUDP_PEER_FLAG_NEEDS_SEND)
+      return;
+
+    secudp_list_insert (secudp_list_end (& peer -> host -> sendQueue), & peer -> sendList);
+
+    peer -> flags |= SECUDP_PEER_FLAG_NEEDS_SEND;
+}
+
 void
 secudp_peer_reset_queues (SecUdpPeer * peer)
 {
@@ -382,13 +748,22 @@ secudp_peer_reset_queues (SecUdpPeer * peer)
        peer -> flags &= ~ SECUDP_PEER_FLAG_NEEDS_DISPATCH;
     }
 
-    while (! secudp_list_empty (& peer -> acknowledgements))
-      secudp_free (secudp_list_remove (secudp_list_begin (& peer -> acknowledgements)));
+    secudp_peer_unschedule (peer);
 
-    secudp_peer_reset_outgoing_commands (& peer -> sentReliableCommands);
-    secudp_peer_reset_outgoing_commands (& peer -> sentUnreliableCommands);
-    secudp_peer_reset_outgoing_commands (& peer -> outgoingCommands);
-    secudp_peer_reset_incoming_commands (& peer -> dispatchedCommands);
+    peer -> acknowledgementHead = 0;
+    peer -> acknowledgementCount = 0;
+
+    if (peer -> reliableCommandCount > 0)
+    {
+       memset (peer -> reliableCommands, 0, (peer -> reliableCommandMask + 1) * sizeof (SecUdpOutgoingCommand *));
+
+       peer -> reliableCommandCount = 0;
+    }
+
+    secudp_peer_reset_outgoing_commands (peer, & peer -> sentReliableCommands);
+    secudp_peer_reset_outgoing_commands (peer, & peer -> sentUnreliableCommands);
+    secudp_peer_reset_outgoing_commands (peer, & peer -> outgoingCommands);
+    secudp_peer_reset_incoming_commands (peer, & peer -> dispatchedCommands);
 
     if (peer -> channels != NULL && peer -> channelCount > 0)
     {
@@ -396,8 +771,8 @@ secudp_peer_reset_queues (SecUdpPeer * peer)
              channel < & peer -> channels [peer -> channelCount];
              ++ channel)
         {
-            secudp_peer_reset_incoming_commands (& channel -> incomingReliableCommands);
-            secudp_peer_reset_incoming_commands (& channel -> incomingUnreliableCommands);
+            secudp_peer_reset_incoming_commands (peer, & channel -> incomingReliableCommands);
+            secudp_peer_reset_incoming_commands (peer, & channel -> incomingUnreliableCommands);
         }
 
         secudp_free (peer -> channels);
@@ -416,6 +791,8 @@ secudp_peer_on_connect (SecUdpPeer * peer)
           ++ peer -> host -> bandwidthLimitedPeers;
 
         ++ peer -> host -> connectedPeers;
+
+        secudp_list_insert (secudp_list_end (& peer -> host -> connectedPeerList), & peer -> connectedList);
     }
 }
 
@@ -428,7 +805,160 @@ secudp_peer_on_disconnect (SecUdpPeer * peer)
           -- peer -> host -> bandwidthLimitedPeers;
 
         -- peer -> host -> connectedPeers;
+
+        secudp_list_remove (& peer -> connectedList);
+    }
+}
+
+/*
+ *  Sets the address of a peer that is not disconnected,
+ *  keeping the host's address tables in step. Addition
+ *  to ENet.
+ */
+void
+secudp_peer_set_address (SecUdpPeer * peer, const SecUdpAddress * address)
+{
+    secudp_host_unindex_peer (peer -> host, peer);
+
+    peer -> address = * address;
+
+    secudp_host_index_peer (peer -> host, peer);
+}
+
+static size_t
+secudp_peer_hash_reliable_command (SecUdpPeer * peer, secudp_uint8 channelID, secudp_uint16 reliableSequenceNumber)
+{
+    /* Consecutive sequence numbers on a channel take consecutive slots. */
+    return ((size_t) channelID * 0x9E3779B1u + reliableSequenceNumber) & peer -> reliableCommandMask;
+}
+
+/*
+ *  Doubles the table of sent reliable commands, or creates it,
+ *  and rehashes the commands already in it.
+ */
+static int
+secudp_peer_grow_reliable_commands (SecUdpPeer * peer)
+{
+    SecUdpOutgoingCommand ** reliableCommands = peer -> reliableCommands;
+    size_t reliableCommandCount = reliableCommands != NULL ? peer -> reliableCommandMask + 1 : 0,
+           newCount = reliableCommandCount > 0 ? reliableCommandCount * 2 : SECUDP_PEER_RELIABLE_COMMANDS_MINIMUM,
+           slot, index;
+
+    peer -> reliableCommands = (SecUdpOutgoingCommand **) secudp_malloc (newCount * sizeof (SecUdpOutgoingCommand *));
+    if (peer -> reliableCommands == NULL)
+    {
+       peer -> reliableCommands = reliableCommands;
+
+       return -1;
+    }
+
+    memset (peer -> reliableCommands, 0, newCount * sizeof (SecUdpOutgoingCommand *));
+
+    peer -> reliableCommandMask = newCount - 1;
+
+    for (slot = 0; slot < reliableCommandCount; ++ slot)
+    {
+       SecUdpOutgoingCommand * outgoingCommand = reliableCommands [slot];
+
+       if (outgoingCommand == NULL)
+         continue;
+
+       index = secudp_peer_hash_reliable_command (peer, outgoingCommand -> command.header.channelID, outgoingCommand -> reliableSequenceNumber);
+
+       while (peer -> reliableCommands [index] != NULL)
+         index = (index + 1) & peer -> reliableCommandMask;
+
+       peer -> reliableCommands [index] = outgoingCommand;
+    }
+
+    if (reliableCommands != NULL)
+      secudp_free (reliableCommands);
+
+    return 0;
+}
+
+/*
+ *  Adds a reliable command being sent for the first time to the
+ *  peer's table of sent reliable commands, so acknowledgements find
+ *  it without searching the command lists. The table is kept at
+ *  most half full. Addition to ENet.
+ */
+int
+secudp_peer_index_reliable_command (SecUdpPeer * peer, SecUdpOutgoingCommand * outgoingCommand)
+{
+    size_t index;
+
+    if ((peer -> reliableCommands == NULL || (peer -> reliableCommandCount + 1) * 2 > peer -> reliableCommandMask + 1) &&
+        secudp_peer_grow_reliable_commands (peer) < 0)
+      return -1;
+
+    index = secudp_peer_hash_reliable_command (peer, outgoingCommand -> command.header.channelID, outgoingCommand -> reliableSequenceNumber);
+
+    while (peer -> reliableCommands [index] != NULL)
+      index = (index + 1) & peer -> reliableCommandMask;
+
+    peer -> reliableCommands [index] = outgoingCommand;
+
+    ++ peer -> reliableCommandCount;
+
+    return 0;
+}
+
+/*
+ *  Removes an acknowledged reliable command from the peer's table of
+ *  sent reliable commands. Emptied slots are filled from later in their
+ *  cluster so probing never stops short. Addition to ENet.
+ */
+void
+secudp_peer_unindex_reliable_command (SecUdpPeer * peer, SecUdpOutgoingCommand * outgoingCommand)
+{
+    size_t index = secudp_peer_hash_reliable_command (peer, outgoingCommand -> command.header.channelID, outgoingCommand -> reliableSequenceNumber), next;
+
+    while (peer -> reliableCommands [index] != outgoingCommand)
+      index = (index + 1) & peer -> reliableCommandMask;
+
+    for (next = (index + 1) & peer -> reliableCommandMask;
+         peer -> reliableCommands [next] != NULL;
+         next = (next + 1) & peer -> reliableCommandMask)
+    {
+       size_t home = secudp_peer_hash_reliable_command (peer, peer -> reliableCommands [next] -> command.header.channelID, peer -> reliableCommands [next] -> reliableSequenceNumber);
+
+       if (((next - home) & peer -> reliableCommandMask) >= ((next - index) & peer -> reliableCommandMask))
+       {
+          peer -> reliableCommands [index] = peer -> reliableCommands [next];
+          index = next;
+       }
     }
+
+    peer -> reliableCommands [index] = NULL;
+
+    -- peer -> reliableCommandCount;
+}
+
+/*
+ *  Finds the sent reliable command with the given channel and sequence
+ *  number that still awaits acknowledgement, or NULL. Addition to ENet.
+ */
+SecUdpOutgoingCommand *
+secudp_peer_find_reliable_command (SecUdpPeer * peer, secudp_uint8 channelID, secudp_uint16 reliableSequenceNumber)
+{
+    size_t index;
+
+    if (peer -> reliableCommandCount == 0)
+      return NULL;
+
+    for (index = secudp_peer_hash_reliable_command (peer, channelID, reliableSequenceNumber);
+         peer -> reliableCommands [index] != NULL;
+         index = (index + 1) & peer -> reliableCommandMask)
+    {
+       SecUdpOutgoingCommand * outgoingCommand = peer -> reliableCommands [index];
+
+       if (outgoingCommand -> reliableSequenceNumber == reliableSequenceNumber &&
+           outgoingCommand -> command.header.channelID == channelID)
+         return outgoingCommand;
+    }
+
+    return NULL;
 }
 
 /** Forcefully disconnects a peer.
@@ -439,7 +969,16 @@ secudp_peer_on_disconnect (SecUdpPeer * peer)
 void
 secudp_peer_reset (SecUdpPeer * peer)
 {
+    int groupMember = (peer -> flags & (SECUDP_PEER_FLAG_GROUP_PENDING | SECUDP_PEER_FLAG_GROUP_MEMBER)) != 0;
+
     secudp_peer_on_disconnect (peer);
+
+    if (peer -> state != SECUDP_PEER_STATE_DISCONNECTED)
+    {
+        secudp_host_unindex_peer (peer -> host, peer);
+
+        peer -> host -> freePeers [peer -> host -> freePeerCount ++] = peer;
+    }
         
     peer -> outgoingPeerID = SECUDP_PROTOCOL_MAXIMUM_PEER_ID;
     peer -> connectID = 0;
@@ -486,11 +1025,32 @@ secudp_peer_reset (SecUdpPeer * peer)
     peer -> outgoingUnsequencedGroup = 0;
     peer -> eventData = 0;
     peer -> totalWaitingData = 0;
+
+    secudp_peer_unschedule (peer);
+
     peer -> flags = 0;
+    peer -> outgoingDatagramCounter = 0;
+    peer -> incomingDatagramCounter = 0;
+    peer -> incomingDatagramWindow = 0;
+    peer -> outgoingNonceCounter = 0;
+    peer -> cipherSuite = SECUDP_CIPHER_SUITE_XSALSA20_POLY1305;
+
+    if (peer -> secret != NULL)
+    {
+       sodium_memzero (peer -> secret, sizeof (SecUdpPeerSecret));
+
+       secudp_free (peer -> secret);
+
+       peer -> secret = NULL;
+    }
 
     memset (peer -> unsequencedWindow, 0, sizeof (peer -> unsequencedWindow));
     
     secudp_peer_reset_queues (peer);
+
+    /* The peer still holds the group key, so the others move to a new one. */
+    if (groupMember)
+      secudp_host_group_rekey (peer -> host);
 }
 
 /** Sends a ping request to a peer.
@@ -527,6 +1087,9 @@ void
 secudp_peer_ping_interval (SecUdpPeer * peer, secudp_uint32 pingInterval)
 {
     peer -> pingInterval = pingInterval ? pingInterval : SECUDP_PEER_PING_INTERVAL;
+
+    if (peer -> state != SECUDP_PEER_STATE_DISCONNECTED)
+      secudp_peer_queue_send (peer);
 }
 
 /** Sets the timeout parameters for a peer.
@@ -552,6 +1115,9 @@ secudp_peer_timeout (SecUdpPeer * peer, secudp_uint32 timeoutLimit, secudp_uint3
     peer -> timeoutLimit = timeoutLimit ? timeoutLimit : SECUDP_PEER_TIMEOUT_LIMIT;
     peer -> timeoutMinimum = timeoutMinimum ? timeoutMinimum : SECUDP_PEER_TIMEOUT_MINIMUM;
     peer -> timeoutMaximum = timeoutMaximum ? timeoutMaximum : SECUDP_PEER_TIMEOUT_MAXIMUM;
+
+    if (peer -> state != SECUDP_PEER_STATE_DISCONNECTED)
+      secudp_peer_queue_send (peer);
 }
 
 /** Force an immediate disconnection from a peer.
@@ -640,7 +1206,8 @@ secudp_peer_disconnect_later (SecUdpPeer * peer, secudp_uint32 data)
 {   
     if ((peer -> state == SECUDP_PEER_STATE_CONNECTED || peer -> state == SECUDP_PEER_STATE_DISCONNECT_LATER) && 
         ! (secudp_list_empty (& peer -> outgoingCommands) &&
-           secudp_list_empty (& peer -> sentReliableCommands)))
+           secudp_list_empty (& peer -> sentReliableCommands) &&
+           peer -> pendingSeals == 0))
     {
         peer -> state = SECUDP_PEER_STATE_DISCONNECT_LATER;
         peer -> eventData = data;
@@ -649,6 +1216,38 @@ secudp_peer_disconnect_later (SecUdpPeer * peer, secudp_uint32 data)
       secudp_peer_disconnect (peer, data);
 }
 
+/*
+ *  Doubles the acknowledgement ring, unwrapping the queued
+ *  acknowledgements to the start of the new ring. The ring
+ *  stops growing at a reliable window's worth of entries.
+ */
+static int
+secudp_peer_grow_acknowledgements (SecUdpPeer * peer)
+{
+    SecUdpAcknowledgement * acknowledgements;
+    size_t capacity = peer -> acknowledgementCapacity > 0 ? peer -> acknowledgementCapacity * 2 : SECUDP_PEER_ACKNOWLEDGEMENT_RING_MINIMUM,
+           index;
+
+    if (capacity > SECUDP_PEER_ACKNOWLEDGEMENT_RING_MAXIMUM)
+      return -1;
+
+    acknowledgements = (SecUdpAcknowledgement *) secudp_malloc (capacity * sizeof (SecUdpAcknowledgement));
+    if (acknowledgements == NULL)
+      return -1;
+
+    for (index = 0; index < peer -> acknowledgementCount; ++ index)
+      acknowledgements [index] = peer -> acknowledgements [(peer -> acknowledgementHead + index) & (peer -> acknowledgementCapacity - 1)];
+
+    if (peer -> acknowledgements != NULL)
+      secudp_free (peer -> acknowledgements);
+
+    peer -> acknowledgements = acknowledgements;
+    peer -> acknowledgementCapacity = capacity;
+    peer -> acknowledgementHead = 0;
+
+    return 0;
+}
+
 SecUdpAcknowledgement *
 secudp_peer_queue_acknowledgement (SecUdpPeer * peer, const SecUdpProtocol * command, secudp_uint16 sentTime)
 {
@@ -667,16 +1266,22 @@ secudp_peer_queue_acknowledgement (SecUdpPeer * peer, const SecUdpProtocol * com
           return NULL;
     }
 
-    acknowledgement = (SecUdpAcknowledgement *) secudp_malloc (sizeof (SecUdpAcknowledgement));
-    if (acknowledgement == NULL)
+    /* A full ring drops the acknowledgement, and the sender resends the command. */
+    if (peer -> acknowledgementCount >= peer -> acknowledgementCapacity &&
+        secudp_peer_grow_acknowledgements (peer) < 0)
       return NULL;
 
     peer -> outgoingDataTotal += sizeof (SecUdpProtocolAcknowledge);
 
+    acknowledgement = & peer -> acknowledgements [(peer -> acknowledgementHead + peer -> acknowledgementCount) & (peer -> acknowledgementCapacity - 1)];
+    acknowledgement -> reliableSequenceNumber = command -> header.reliableSequenceNumber;
     acknowledgement -> sentTime = sentTime;
-    acknowledgement -> command = * command;
-    
-    secudp_list_insert (secudp_list_end (& peer -> acknowledgements), acknowledgement);
+    acknowledgement -> channelID = command -> header.channelID;
+    acknowledgement -> command = command -> header.command;
+
+    ++ peer -> acknowledgementCount;
+
+    secudp_peer_queue_send (peer);
     
     return acknowledgement;
 }
@@ -722,6 +1327,7 @@ secudp_peer_setup_outgoing_command (SecUdpPeer * peer, SecUdpOutgoingCommand * o
     }
    
     outgoingCommand -> sendAttempts = 0;
+    outgoingCommand -> inTransit = 0;
     outgoingCommand -> sentTime = 0;
     outgoingCommand -> roundTripTimeout = 0;
     outgoingCommand -> roundTripTimeoutLimit = 0;
@@ -742,12 +1348,14 @@ secudp_peer_setup_outgoing_command (SecUdpPeer * peer, SecUdpOutgoingCommand * o
     }
 
     secudp_list_insert (secudp_list_end (& peer -> outgoingCommands), outgoingCommand);
+
+    secudp_peer_queue_send (peer);
 }
 
 SecUdpOutgoingCommand *
 secudp_peer_queue_outgoing_command (SecUdpPeer * peer, const SecUdpProtocol * command, SecUdpPacket * packet, secudp_uint32 offset, secudp_uint16 length)
 {
-    SecUdpOutgoingCommand * outgoingCommand = (SecUdpOutgoingCommand *) secudp_malloc (sizeof (SecUdpOutgoingCommand));
+    SecUdpOutgoingCommand * outgoingCommand = (SecUdpOutgoingCommand *) secudp_pool_alloc (& peer -> host -> outgoingCommandPool);
     if (outgoingCommand == NULL)
       return NULL;
 
@@ -843,7 +1451,7 @@ secudp_peer_dispatch_incoming_unreliable_commands (SecUdpPeer * peer, SecUdpChan
        droppedCommand = currentCommand;
     }
 
-    secudp_peer_remove_incoming_commands (& channel -> incomingUnreliableCommands, secudp_list_begin (& channel -> incomingUnreliableCommands), droppedCommand, queuedCommand);
+    secudp_peer_remove_incoming_commands (peer, & channel -> incomingUnreliableCommands, secudp_list_begin (& channel -> incomingUnreliableCommands), droppedCommand, queuedCommand);
 }
 
 void
@@ -998,11 +1606,11 @@ secudp_peer_queue_incoming_command (SecUdpPeer * peer, const SecUdpProtocol * co
     if (peer -> totalWaitingData >= peer -> host -> maximumWaitingData)
       goto notifyError;
 
-    packet = secudp_packet_create (data, dataLength, flags);
+    packet = secudp_host_packet_create (peer -> host, data, dataLength, flags);
     if (packet == NULL)
       goto notifyError;
 
-    incomingCommand = (SecUdpIncomingCommand *) secudp_malloc (sizeof (SecUdpIncomingCommand));
+    incomingCommand = (SecUdpIncomingCommand *) secudp_pool_alloc (& peer -> host -> incomingCommandPool);
     if (incomingCommand == NULL)
       goto notifyError;
 
@@ -1017,10 +1625,10 @@ secudp_peer_queue_incoming_command (SecUdpPeer * peer, const SecUdpProtocol * co
     if (fragmentCount > 0)
     { 
        if (fragmentCount <= SECUDP_PROTOCOL_MAXIMUM_FRAGMENT_COUNT)
-         incomingCommand -> fragments = (secudp_uint32 *) secudp_malloc ((fragmentCount + 31) / 32 * sizeof (secudp_uint32));
+         incomingCommand -> fragments = secudp_peer_alloc_fragments (peer, fragmentCount);
        if (incomingCommand -> fragments == NULL)
        {
-          secudp_free (incomingCommand);
+          secudp_pool_free (& peer -> host -> incomingCommandPool, incomingCommand);
 
           goto notifyError;
        }
@@ -1031,7 +1639,7 @@ secudp_peer_queue_incoming_command (SecUdpPeer * peer, const SecUdpProtocol * co
     {
        ++ packet -> referenceCount;
       
-       peer -> totalWaitingData += packet -> cipherLength;
+       peer -> totalWaitingData += packet -> dataLength;
     }
 
     secudp_list_insert (secudp_list_next (currentCommand), incomingCommand);
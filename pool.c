@@ -0,0 +1,95 @@
+/**
+ @file pool.c
+ @brief SecUdp fixed-size object pool functions
+*/
+#define SECUDP_BUILDING_LIB 1
+#include "secudp/secudp.h"
+
+/**
+    @defgroup pool SecUdp object pool utility functions
+    @ingroup private
+    @{
+*/
+
+/*
+ *  Slab header, padded so the objects that follow it
+ *  are as aligned as memory from secudp_malloc().
+ */
+typedef union _SecUdpPoolSlab
+{
+   union _SecUdpPoolSlab * next;
+   void * pointer;
+   double number;
+   secudp_uint32 padding [4];
+} SecUdpPoolSlab;
+
+void
+secudp_pool_init (SecUdpPool * pool, size_t objectSize, size_t slabObjects)
+{
+   if (objectSize < sizeof (SecUdpPoolSlab))
+     objectSize = sizeof (SecUdpPoolSlab);
+
+   pool -> objectSize = (objectSize + sizeof (SecUdpPoolSlab) - 1) / sizeof (SecUdpPoolSlab) * sizeof (SecUdpPoolSlab);
+   pool -> slabObjects = slabObjects > 0 ? slabObjects : 1;
+   pool -> freeObjects = NULL;
+   pool -> slabs = NULL;
+}
+
+void
+secudp_pool_clear (SecUdpPool * pool)
+{
+   while (pool -> slabs != NULL)
+   {
+      SecUdpPoolSlab * slab = (SecUdpPoolSlab *) pool -> slabs;
+
+      pool -> slabs = slab -> next;
+
+      secudp_free (slab);
+   }
+
+   pool -> freeObjects = NULL;
+}
+
+void *
+secudp_pool_alloc (SecUdpPool * pool)
+{
+   void * object;
+
+   if (pool -> freeObjects == NULL)
+   {
+      SecUdpPoolSlab * slab = (SecUdpPoolSlab *) secudp_malloc (sizeof (SecUdpPoolSlab) + pool -> slabObjects * pool -> objectSize);
+      secudp_uint8 * slabObject;
+      size_t objectIndex;
+
+      if (slab == NULL)
+        return NULL;
+
+      slab -> next = (SecUdpPoolSlab *) pool -> slabs;
+      pool -> slabs = slab;
+
+      for (objectIndex = pool -> slabObjects, slabObject = (secudp_uint8 *) (slab + 1) + pool -> slabObjects * pool -> objectSize;
+           objectIndex > 0;
+           -- objectIndex)
+      {
+         slabObject -= pool -> objectSize;
+
+         * (void **) slabObject = pool -> freeObjects;
+         pool -> freeObjects = slabObject;
+      }
+   }
+
+   object = pool -> freeObjects;
+   pool -> freeObjects = * (void **) object;
+
+   return object;
+}
+
+void
+secudp_pool_free (SecUdpPool * pool, void * object)
+{
+   * (void **) object = pool -> freeObjects;
+   pool -> freeObjects = object;
+}
+
+/** @} */
+
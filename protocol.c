@@ -4,11 +4,15 @@
 */
 #include <stdio.h>
 #include <string.h>
+#include <stddef.h>
+#include <time.h>
 #define SECUDP_BUILDING_LIB 1
 #include "secudp/utility.h"
 #include "secudp/time.h"
 #include "secudp/secudp.h"
 
+#define SECUDP_PROTOCOL_HANDSHAKE_TRANSCRIPT_SIZE (SECUDP_KX_PUBLICBYTES + 3 * sizeof (secudp_uint32) + sizeof (SecUdpProtocolVerifyConnect))
+
 static size_t commandSizes [SECUDP_PROTOCOL_COMMAND_COUNT] =
 {
     0,
@@ -23,7 +27,10 @@ static size_t commandSizes [SECUDP_PROTOCOL_COMMAND_COUNT] =
     sizeof (SecUdpProtocolSendUnsequenced),
     sizeof (SecUdpProtocolBandwidthLimit),
     sizeof (SecUdpProtocolThrottleConfigure),
-    sizeof (SecUdpProtocolSendFragment)
+    sizeof (SecUdpProtocolSendFragment),
+    sizeof (SecUdpProtocolGroupKey),
+    sizeof (SecUdpProtocolRetryConnect),
+    sizeof (SecUdpProtocolSelectiveAcknowledge)
 };
 
 size_t
@@ -40,7 +47,17 @@ secudp_protocol_change_state (SecUdpHost * host, SecUdpPeer * peer, SecUdpPeerSt
     else
       secudp_peer_on_disconnect (peer);
 
-    peer -> state = state;
+    /* Peers start counting towards duplicatePeers once done connecting. */
+    if (peer -> state == SECUDP_PEER_STATE_CONNECTING)
+    {
+       secudp_host_unindex_peer (host, peer);
+
+       peer -> state = state;
+
+       secudp_host_index_peer (host, peer);
+    }
+    else
+      peer -> state = state;
 }
 
 static void
@@ -59,6 +76,10 @@ secudp_protocol_dispatch_state (SecUdpHost * host, SecUdpPeer * peer, SecUdpPeer
 static int
 secudp_protocol_dispatch_incoming_commands (SecUdpHost * host, SecUdpEvent * event)
 {
+    if (host -> cryptoPool != NULL &&
+        secudp_host_crypto_pool_complete_open (host, event))
+      return 1;
+
     while (! secudp_list_empty (& host -> dispatchQueue))
     {
        SecUdpPeer * peer = (SecUdpPeer *) secudp_list_remove (secudp_list_begin (& host -> dispatchQueue));
@@ -96,6 +117,25 @@ secudp_protocol_dispatch_incoming_commands (SecUdpHost * host, SecUdpEvent * eve
            if (secudp_list_empty (& peer -> dispatchedCommands))
              continue;
 
+           /*
+            *  With a crypto pool, the packets are handed to the
+            *  workers and produce events once they are opened.
+            *  Addition to ENet.
+            */
+           if (host -> cryptoPool != NULL && ! (peer -> flags & SECUDP_PEER_FLAG_SEAL_DATAGRAMS))
+           {
+              if (secudp_host_crypto_pool_open (host, peer))
+              {
+                 peer -> flags |= SECUDP_PEER_FLAG_NEEDS_DISPATCH;
+
+                 secudp_list_insert (secudp_list_end (& host -> dispatchQueue), & peer -> dispatchList);
+
+                 return 0;
+              }
+
+              continue;
+           }
+
            event -> packet = secudp_peer_receive (peer, & event -> channelID);
            if (event -> packet == NULL)
              continue;
@@ -192,65 +232,26 @@ secudp_protocol_remove_sent_unreliable_commands (SecUdpPeer * peer)
            }
         }
 
-        secudp_free (outgoingCommand);
+        secudp_pool_free (& peer -> host -> outgoingCommandPool, outgoingCommand);
     } while (! secudp_list_empty (& peer -> sentUnreliableCommands));
 
     if (peer -> state == SECUDP_PEER_STATE_DISCONNECT_LATER &&
         secudp_list_empty (& peer -> outgoingCommands) &&
-        secudp_list_empty (& peer -> sentReliableCommands))
+        secudp_list_empty (& peer -> sentReliableCommands) &&
+        peer -> pendingSeals == 0)
       secudp_peer_disconnect (peer, peer -> eventData);
 }
 
 static SecUdpProtocolCommand
-secudp_protocol_remove_sent_reliable_command (SecUdpPeer * peer, secudp_uint16 reliableSequenceNumber, secudp_uint8 channelID)
+secudp_protocol_release_reliable_command (SecUdpPeer * peer, SecUdpOutgoingCommand * outgoingCommand)
 {
-    SecUdpOutgoingCommand * outgoingCommand = NULL;
-    SecUdpListIterator currentCommand;
+    secudp_uint8 channelID = outgoingCommand -> command.header.channelID;
     SecUdpProtocolCommand commandNumber;
-    int wasSent = 1;
-
-    for (currentCommand = secudp_list_begin (& peer -> sentReliableCommands);
-         currentCommand != secudp_list_end (& peer -> sentReliableCommands);
-         currentCommand = secudp_list_next (currentCommand))
-    {
-       outgoingCommand = (SecUdpOutgoingCommand *) currentCommand;
-        
-       if (outgoingCommand -> reliableSequenceNumber == reliableSequenceNumber &&
-           outgoingCommand -> command.header.channelID == channelID)
-         break;
-    }
-
-    if (currentCommand == secudp_list_end (& peer -> sentReliableCommands))
-    {
-       for (currentCommand = secudp_list_begin (& peer -> outgoingCommands);
-            currentCommand != secudp_list_end (& peer -> outgoingCommands);
-            currentCommand = secudp_list_next (currentCommand))
-       {
-          outgoingCommand = (SecUdpOutgoingCommand *) currentCommand;
-
-          if (! (outgoingCommand -> command.header.command & SECUDP_PROTOCOL_COMMAND_FLAG_ACKNOWLEDGE))
-            continue;
-
-          if (outgoingCommand -> sendAttempts < 1) return SECUDP_PROTOCOL_COMMAND_NONE;
-
-          if (outgoingCommand -> reliableSequenceNumber == reliableSequenceNumber &&
-              outgoingCommand -> command.header.channelID == channelID)
-            break;
-       }
-
-       if (currentCommand == secudp_list_end (& peer -> outgoingCommands))
-         return SECUDP_PROTOCOL_COMMAND_NONE;
-
-       wasSent = 0;
-    }
-
-    if (outgoingCommand == NULL)
-      return SECUDP_PROTOCOL_COMMAND_NONE;
 
     if (channelID < peer -> channelCount)
     {
        SecUdpChannel * channel = & peer -> channels [channelID];
-       secudp_uint16 reliableWindow = reliableSequenceNumber / SECUDP_PEER_RELIABLE_WINDOW_SIZE;
+       secudp_uint16 reliableWindow = outgoingCommand -> reliableSequenceNumber / SECUDP_PEER_RELIABLE_WINDOW_SIZE;
        if (channel -> reliableWindows [reliableWindow] > 0)
        {
           -- channel -> reliableWindows [reliableWindow];
@@ -261,11 +262,13 @@ secudp_protocol_remove_sent_reliable_command (SecUdpPeer * peer, secudp_uint16 r
 
     commandNumber = (SecUdpProtocolCommand) (outgoingCommand -> command.header.command & SECUDP_PROTOCOL_COMMAND_MASK);
     
+    secudp_peer_unindex_reliable_command (peer, outgoingCommand);
+
     secudp_list_remove (& outgoingCommand -> outgoingCommandList);
 
     if (outgoingCommand -> packet != NULL)
     {
-       if (wasSent)
+       if (outgoingCommand -> inTransit)
          peer -> reliableDataInTransit -= outgoingCommand -> fragmentLength;
 
        -- outgoingCommand -> packet -> referenceCount;
@@ -278,7 +281,22 @@ secudp_protocol_remove_sent_reliable_command (SecUdpPeer * peer, secudp_uint16 r
        }
     }
 
-    secudp_free (outgoingCommand);
+    secudp_pool_free (& peer -> host -> outgoingCommandPool, outgoingCommand);
+
+    return commandNumber;
+}
+
+static SecUdpProtocolCommand
+secudp_protocol_remove_sent_reliable_command (SecUdpPeer * peer, secudp_uint16 reliableSequenceNumber, secudp_uint8 channelID)
+{
+    SecUdpOutgoingCommand * outgoingCommand;
+    SecUdpProtocolCommand commandNumber;
+
+    outgoingCommand = secudp_peer_find_reliable_command (peer, channelID, reliableSequenceNumber);
+    if (outgoingCommand == NULL)
+      return SECUDP_PROTOCOL_COMMAND_NONE;
+
+    commandNumber = secudp_protocol_release_reliable_command (peer, outgoingCommand);
 
     if (secudp_list_empty (& peer -> sentReliableCommands))
       return commandNumber;
@@ -290,16 +308,169 @@ secudp_protocol_remove_sent_reliable_command (SecUdpPeer * peer, secudp_uint16 r
     return commandNumber;
 } 
 
+/*
+ *  Removes the reliable commands a selective acknowledge covers,
+ *  updating the next timeout once for all of them. Returns the
+ *  number of the last command removed. Addition to ENet.
+ */
+static SecUdpProtocolCommand
+secudp_protocol_remove_sent_reliable_commands (SecUdpPeer * peer, secudp_uint8 channelID, secudp_uint16 reliableSequenceNumber, secudp_uint32 receivedMask)
+{
+    SecUdpOutgoingCommand * outgoingCommand;
+    SecUdpProtocolCommand commandNumber = SECUDP_PROTOCOL_COMMAND_NONE;
+    secudp_uint64 remaining = ((secudp_uint64) receivedMask << 1) | 1;
+    secudp_uint16 offset;
+
+    for (offset = 0; remaining != 0; ++ offset, remaining >>= 1)
+    {
+       if (! (remaining & 1))
+         continue;
+
+       outgoingCommand = secudp_peer_find_reliable_command (peer, channelID, reliableSequenceNumber + offset);
+       if (outgoingCommand != NULL)
+         commandNumber = secudp_protocol_release_reliable_command (peer, outgoingCommand);
+    }
+
+    if (secudp_list_empty (& peer -> sentReliableCommands))
+      return commandNumber;
+
+    outgoingCommand = (SecUdpOutgoingCommand *) secudp_list_front (& peer -> sentReliableCommands);
+
+    peer -> nextTimeout = outgoingCommand -> sentTime + outgoingCommand -> roundTripTimeout;
+
+    return commandNumber;
+}
+
+#define SECUDP_PROTOCOL_COOKIE_MESSAGE_SIZE (sizeof (secudp_uint32) + sizeof (secudp_uint16) + sizeof (secudp_uint32) + sizeof (secudp_uint32))
+
+/*
+ *  Builds what the cookie for a connect is computed over: the
+ *  received address, the connect ID and the interval.
+ *  Addition to ENet.
+ */
+static void
+secudp_protocol_connect_cookie_message (SecUdpHost * host, const SecUdpProtocol * command, secudp_uint32 interval, secudp_uint8 * message)
+{
+    secudp_uint8 * position = message;
+
+    memcpy (position, & host -> receivedAddress.host, sizeof (secudp_uint32));
+    position += sizeof (secudp_uint32);
+    memcpy (position, & host -> receivedAddress.port, sizeof (secudp_uint16));
+    position += sizeof (secudp_uint16);
+    memcpy (position, & command -> connect.connectID, sizeof (secudp_uint32));
+    position += sizeof (secudp_uint32);
+    memcpy (position, & interval, sizeof (secudp_uint32));
+}
+
+/*
+ *  Checks the cookie of a connect against the current and previous
+ *  interval, so a cookie stays valid for at least one interval.
+ *  Addition to ENet.
+ */
+static int
+secudp_protocol_check_connect_cookie (SecUdpHost * host, const SecUdpProtocol * command)
+{
+    secudp_uint32 interval = host -> serviceTime / SECUDP_HOST_COOKIE_INTERVAL;
+    secudp_uint8 message [SECUDP_PROTOCOL_COOKIE_MESSAGE_SIZE];
+
+    secudp_protocol_connect_cookie_message (host, command, interval, message);
+    if (secudp_host_verify_cookie (command -> connect.cookie, message, sizeof (message), host -> cookieKey) == 0)
+      return 0;
+
+    secudp_protocol_connect_cookie_message (host, command, interval - 1, message);
+    return secudp_host_verify_cookie (command -> connect.cookie, message, sizeof (message), host -> cookieKey);
+}
+
+/*
+ *  Answers a connect without a valid cookie with a fresh one. Nothing
+ *  is allocated and the reply is smaller than the connect, so spoofed
+ *  connects cost a hash and cannot be used for amplification.
+ *  Addition to ENet.
+ */
+static void
+secudp_protocol_send_retry_connect (SecUdpHost * host, const SecUdpProtocol * command)
+{
+    secudp_uint8 headerData [sizeof (SecUdpProtocolHeader) + sizeof (secudp_uint32)];
+    SecUdpProtocolHeader * header = (SecUdpProtocolHeader *) headerData;
+    secudp_uint8 message [SECUDP_PROTOCOL_COOKIE_MESSAGE_SIZE];
+    SecUdpProtocol retryCommand;
+    SecUdpBuffer buffers [2];
+
+    header -> peerID = SECUDP_HOST_TO_NET_16 (SECUDP_NET_TO_HOST_16 (command -> connect.outgoingPeerID) & SECUDP_PROTOCOL_MAXIMUM_PEER_ID);
+
+    retryCommand.header.command = SECUDP_PROTOCOL_COMMAND_RETRY_CONNECT;
+    retryCommand.header.channelID = 0xFF;
+    retryCommand.header.reliableSequenceNumber = 0;
+    retryCommand.retryConnect.connectID = command -> connect.connectID;
+    secudp_protocol_connect_cookie_message (host, command, host -> serviceTime / SECUDP_HOST_COOKIE_INTERVAL, message);
+    secudp_host_gen_cookie (retryCommand.retryConnect.cookie, message, sizeof (message), host -> cookieKey);
+
+    buffers [0].data = headerData;
+    buffers [0].dataLength = (size_t) & ((SecUdpProtocolHeader *) 0) -> sentTime;
+    buffers [1].data = & retryCommand;
+    buffers [1].dataLength = sizeof (SecUdpProtocolRetryConnect);
+
+    if (host -> checksum != NULL)
+    {
+        secudp_uint32 * checksum = (secudp_uint32 *) & headerData [buffers [0].dataLength];
+        * checksum = command -> connect.connectID;
+        buffers [0].dataLength += sizeof (secudp_uint32);
+        * checksum = host -> checksum (buffers, 2);
+    }
+
+    if (secudp_socket_send (host -> socket, & host -> receivedAddress, buffers, 2) > 0)
+      host -> totalSentData += buffers [0].dataLength + buffers [1].dataLength;
+}
+
+/*
+ *  Lays out the handshake transcript the verify connect mac
+ *  covers: the key exchange key of the connecting side, its
+ *  connect ID and the options and cipher suites it offered,
+ *  then everything in the verify connect up to the mac, as
+ *  sent on the wire. Returns the transcript length. Addition
+ *  to ENet.
+ */
+static size_t
+secudp_protocol_handshake_transcript (secudp_uint8 * transcript, const secudp_uint8 * publicKx, secudp_uint32 connectID, secudp_uint32 options, secudp_uint32 cipherSuites, const SecUdpProtocolVerifyConnect * verifyConnect)
+{
+    secudp_uint8 * data = transcript;
+
+    memcpy (data, publicKx, SECUDP_KX_PUBLICBYTES);
+    data += SECUDP_KX_PUBLICBYTES;
+
+    memcpy (data, & connectID, sizeof (secudp_uint32));
+    data += sizeof (secudp_uint32);
+
+    options = SECUDP_HOST_TO_NET_32 (options);
+    memcpy (data, & options, sizeof (secudp_uint32));
+    data += sizeof (secudp_uint32);
+
+    cipherSuites = SECUDP_HOST_TO_NET_32 (cipherSuites);
+    memcpy (data, & cipherSuites, sizeof (secudp_uint32));
+    data += sizeof (secudp_uint32);
+
+    memcpy (data, (const secudp_uint8 *) verifyConnect + sizeof (SecUdpProtocolCommandHeader), offsetof (SecUdpProtocolVerifyConnect, mac) - sizeof (SecUdpProtocolCommandHeader));
+    data += offsetof (SecUdpProtocolVerifyConnect, mac) - sizeof (SecUdpProtocolCommandHeader);
+
+    return data - transcript;
+}
+
 static SecUdpPeer *
 secudp_protocol_handle_connect (SecUdpHost * host, SecUdpProtocolHeader * header, SecUdpProtocol * command)
 {
     secudp_uint8 incomingSessionID, outgoingSessionID;
-    secudp_uint32 mtu, windowSize;
+    secudp_uint32 mtu, windowSize, options, cipherSuites;
     SecUdpChannel * channel;
-    size_t channelCount, duplicatePeers = 0;
-    SecUdpPeer * currentPeer, * peer = NULL;
+    size_t channelCount;
+    SecUdpPeer * currentPeer, * peer;
     SecUdpProtocol verifyCommand;
     SecUdpPeerSecret secret;
+    SecUdpHostKx * kx;
+    SecUdpKxPair kxPair;
+    const secudp_uint8 * publicKx;
+    secudp_uint8 transcript [SECUDP_PROTOCOL_HANDSHAKE_TRANSCRIPT_SIZE];
+    secudp_uint32 notAfter;
+    int keysFailed;
 
     channelCount = SECUDP_NET_TO_HOST_32 (command -> connect.channelCount);
 
@@ -307,30 +478,41 @@ secudp_protocol_handle_connect (SecUdpHost * host, SecUdpProtocolHeader * header
         channelCount > SECUDP_PROTOCOL_MAXIMUM_CHANNEL_COUNT)
       return NULL;
 
-    for (currentPeer = host -> peers;
-         currentPeer < & host -> peers [host -> peerCount];
-         ++ currentPeer)
+    if (host -> connectCookies && secudp_protocol_check_connect_cookie (host, command) < 0)
     {
-        if (currentPeer -> state == SECUDP_PEER_STATE_DISCONNECTED)
-        {
-            if (peer == NULL)
-              peer = currentPeer;
-        }
-        else 
-        if (currentPeer -> state != SECUDP_PEER_STATE_CONNECTING &&
-            currentPeer -> address.host == host -> receivedAddress.host)
-        {
-            if (currentPeer -> address.port == host -> receivedAddress.port &&
-                currentPeer -> connectID == command -> connect.connectID)
-              return NULL;
+        secudp_protocol_send_retry_connect (host, command);
+        return NULL;
+    }
 
-            ++ duplicatePeers;
-        }
+    options = SECUDP_NET_TO_HOST_32 (command -> connect.options) & (SECUDP_PROTOCOL_OPTION_SEAL_DATAGRAMS | SECUDP_PROTOCOL_OPTION_SELECTIVE_ACKNOWLEDGE);
+    if (! host -> sealDatagrams)
+      options &= ~ SECUDP_PROTOCOL_OPTION_SEAL_DATAGRAMS;
+
+    /*
+     *  Settle on the strongest cipher suite both sides support.
+     *  Sealing whole datagrams needs a suite with additional data,
+     *  so fall back to per-message sealing without one.
+     */
+    cipherSuites = SECUDP_NET_TO_HOST_32 (command -> connect.cipherSuites) & host -> cipherSuites & secudp_cipher_suites_available ();
+    if (options & SECUDP_PROTOCOL_OPTION_SEAL_DATAGRAMS)
+    {
+        if (cipherSuites & SECUDP_CIPHER_SUITES_AEAD)
+          cipherSuites &= SECUDP_CIPHER_SUITES_AEAD;
+        else
+          options &= ~ SECUDP_PROTOCOL_OPTION_SEAL_DATAGRAMS;
     }
+    if (cipherSuites == 0)
+      return NULL;
+
+    currentPeer = secudp_host_find_peer (host, & host -> receivedAddress, command -> connect.connectID);
+    if (currentPeer != NULL && currentPeer -> state != SECUDP_PEER_STATE_CONNECTING)
+      return NULL;
 
-    if (peer == NULL || duplicatePeers >= host -> duplicatePeers)
+    if (host -> freePeerCount == 0 || secudp_host_count_peers (host, host -> receivedAddress.host) >= host -> duplicatePeers)
       return NULL;
 
+    peer = host -> freePeers [host -> freePeerCount - 1];
+
     if (channelCount > host -> channelLimit)
       channelCount = host -> channelLimit;
     peer -> channels = (SecUdpChannel *) secudp_malloc (channelCount * sizeof (SecUdpChannel));
@@ -339,7 +521,10 @@ secudp_protocol_handle_connect (SecUdpHost * host, SecUdpProtocolHeader * header
       
     /*
      *  Additionally generate a secret key pair for use
-     *  in key exchange. Extension of ENet.
+     *  in key exchange, or reuse the host's signed
+     *  semi-static one. The session keys are derived
+     *  right away so the private key never lands in
+     *  the peer. Extension of ENet.
      */
     peer -> secret = (SecUdpPeerSecret *) secudp_malloc (sizeof(SecUdpPeerSecret));
     if (peer -> secret == NULL)
@@ -347,18 +532,33 @@ secudp_protocol_handle_connect (SecUdpHost * host, SecUdpProtocolHeader * header
         secudp_free(peer -> channels);
         return NULL;
     }
-    secudp_peer_gen_key_exchange_pair(peer -> secret -> kxPair.publicKx, peer -> secret -> kxPair.privateKx);
-    if(secudp_host_gen_session_keys(secret.sessionPair.sendKey, secret.sessionPair.recvKey, peer -> secret -> kxPair.publicKx, peer -> secret -> kxPair.privateKx, command -> connect.publicKx))
+    kx = secudp_host_kx (host);
+    if (kx != NULL)
+    {
+        publicKx = kx -> publicKx;
+        keysFailed = secudp_host_gen_session_keys(secret.sessionPair.sendKey, secret.sessionPair.recvKey, kx -> publicKx, kx -> privateKx, command -> connect.publicKx);
+    }
+    else
+    {
+        secudp_host_gen_key_exchange_pair (host, kxPair.publicKx, kxPair.privateKx);
+        publicKx = kxPair.publicKx;
+        keysFailed = secudp_host_gen_session_keys(secret.sessionPair.sendKey, secret.sessionPair.recvKey, kxPair.publicKx, kxPair.privateKx, command -> connect.publicKx);
+        sodium_memzero (kxPair.privateKx, SECUDP_KX_PRIVATEBYTES);
+    }
+    if (keysFailed)
     {
+        sodium_memzero (& secret, sizeof (secret));
         secudp_free(peer -> channels);
         secudp_free(peer -> secret);
         return NULL;
     }
     
+    -- host -> freePeerCount;
     peer -> channelCount = channelCount;
     peer -> state = SECUDP_PEER_STATE_ACKNOWLEDGING_CONNECT;
     peer -> connectID = command -> connect.connectID;
     peer -> address = host -> receivedAddress;
+    secudp_host_index_peer (host, peer);
     peer -> outgoingPeerID = SECUDP_NET_TO_HOST_16 (command -> connect.outgoingPeerID);
     peer -> incomingBandwidth = SECUDP_NET_TO_HOST_32 (command -> connect.incomingBandwidth);
     peer -> outgoingBandwidth = SECUDP_NET_TO_HOST_32 (command -> connect.outgoingBandwidth);
@@ -366,6 +566,7 @@ secudp_protocol_handle_connect (SecUdpHost * host, SecUdpProtocolHeader * header
     peer -> packetThrottleAcceleration = SECUDP_NET_TO_HOST_32 (command -> connect.packetThrottleAcceleration);
     peer -> packetThrottleDeceleration = SECUDP_NET_TO_HOST_32 (command -> connect.packetThrottleDeceleration);
     peer -> eventData = SECUDP_NET_TO_HOST_32 (command -> connect.data);
+    peer -> cipherSuite = (SecUdpCipherSuite) secudp_cipher_suite_select (cipherSuites);
 
     incomingSessionID = command -> connect.incomingSessionID == 0xFF ? peer -> outgoingSessionID : command -> connect.incomingSessionID;
     incomingSessionID = (incomingSessionID + 1) & (SECUDP_PROTOCOL_HEADER_SESSION_MASK >> SECUDP_PROTOCOL_HEADER_SESSION_SHIFT);
@@ -454,10 +655,45 @@ secudp_protocol_handle_connect (SecUdpHost * host, SecUdpProtocolHeader * header
     verifyCommand.verifyConnect.packetThrottleAcceleration = SECUDP_HOST_TO_NET_32 (peer -> packetThrottleAcceleration);
     verifyCommand.verifyConnect.packetThrottleDeceleration = SECUDP_HOST_TO_NET_32 (peer -> packetThrottleDeceleration);
     verifyCommand.verifyConnect.connectID = peer -> connectID;
-    memcpy(verifyCommand.verifyConnect.publicKx, peer -> secret -> kxPair.publicKx, SECUDP_KX_PUBLICBYTES);
-    secudp_host_generate_signature(verifyCommand.verifyConnect.signature, verifyCommand.verifyConnect.publicKx, SECUDP_KX_PUBLICBYTES, host -> secret -> privateKey);
+    verifyCommand.verifyConnect.options = SECUDP_HOST_TO_NET_32 (options);
+    verifyCommand.verifyConnect.cipherSuite = SECUDP_HOST_TO_NET_32 (peer -> cipherSuite);
+    memcpy(verifyCommand.verifyConnect.publicKx, publicKx, SECUDP_KX_PUBLICBYTES);
+    if (kx != NULL)
+    {
+        notAfter = kx -> notAfter;
+        memcpy (verifyCommand.verifyConnect.signature, kx -> signature, SECUDP_SIGN_BYTES);
+    }
+    else
+    {
+        notAfter = (secudp_uint32) time (NULL) + SECUDP_HOST_KX_EXPIRY_MARGIN;
+        secudp_host_sign_kx (verifyCommand.verifyConnect.signature, publicKx, notAfter, host -> secret -> privateKey);
+    }
+    verifyCommand.verifyConnect.notAfter = SECUDP_HOST_TO_NET_32 (notAfter);
+    secudp_gen_handshake_mac (verifyCommand.verifyConnect.mac, transcript,
+                              secudp_protocol_handshake_transcript (transcript, command -> connect.publicKx, command -> connect.connectID, SECUDP_NET_TO_HOST_32 (command -> connect.options), SECUDP_NET_TO_HOST_32 (command -> connect.cipherSuites), & verifyCommand.verifyConnect),
+                              secret.sessionPair.sendKey);
     memcpy(peer -> secret -> sessionPair.sendKey, secret.sessionPair.sendKey, SECUDP_SESSIONKEYBYTES);
     memcpy(peer -> secret -> sessionPair.recvKey, secret.sessionPair.recvKey, SECUDP_SESSIONKEYBYTES);
+    secudp_gen_nonce_prefix(peer -> secret -> sessionPair.sendNoncePrefix, secret.sessionPair.sendKey);
+    secudp_gen_nonce_prefix(peer -> secret -> sessionPair.recvNoncePrefix, secret.sessionPair.recvKey);
+
+    /*
+     *  The peer seals everything it sends once it has verified
+     *  the connect, but the verify itself goes out in the clear
+     *  until the peer proves it holds the keys.
+     */
+    if (options & SECUDP_PROTOCOL_OPTION_SEAL_DATAGRAMS)
+    {
+        secudp_peer_gen_datagram_key (peer -> secret -> sessionPair.sendDatagramKey, secret.sessionPair.sendKey);
+        secudp_peer_gen_datagram_key (peer -> secret -> sessionPair.recvDatagramKey, secret.sessionPair.recvKey);
+
+        peer -> flags |= SECUDP_PEER_FLAG_SEAL_DATAGRAMS | SECUDP_PEER_FLAG_SEAL_INCOMING;
+    }
+
+    if (options & SECUDP_PROTOCOL_OPTION_SELECTIVE_ACKNOWLEDGE)
+      peer -> flags |= SECUDP_PEER_FLAG_SELECTIVE_ACKNOWLEDGE;
+
+    sodium_memzero (& secret, sizeof (secret));
 
     secudp_peer_queue_outgoing_command (peer, & verifyCommand, NULL, 0, 0);
 
@@ -837,6 +1073,121 @@ secudp_protocol_handle_throttle_configure (SecUdpHost * host, SecUdpPeer * peer,
     return 0;
 }
 
+static int
+secudp_protocol_handle_group_key (SecUdpPeer * peer, const SecUdpProtocol * command)
+{
+    secudp_uint8 nonce [SECUDP_NONCEBYTES];
+    secudp_uint8 groupKey [SECUDP_SESSIONKEYBYTES + SECUDP_NONCE_COUNTERBYTES];
+    secudp_uint64 firstNonceCounter = 0;
+    int i;
+
+    if (peer -> state != SECUDP_PEER_STATE_CONNECTED && peer -> state != SECUDP_PEER_STATE_DISCONNECT_LATER)
+      return -1;
+
+    secudp_cipher_nonce (peer -> cipherSuite, nonce, peer -> secret -> sessionPair.recvNoncePrefix, command -> groupKey.nonceCounter);
+    if (secudp_cipher_decrypt (peer -> cipherSuite, groupKey, command -> groupKey.key, command -> groupKey.mac, sizeof (groupKey), NULL, 0, nonce, peer -> secret -> sessionPair.recvKey))
+      return -1;
+
+    for (i = 0; i < SECUDP_NONCE_COUNTERBYTES; ++ i)
+      firstNonceCounter |= (secudp_uint64) groupKey [SECUDP_SESSIONKEYBYTES + i] << (i * 8);
+
+    /* Broadcasts sealed before the rekey may still be waiting to be received. */
+    if (peer -> flags & SECUDP_PEER_FLAG_GROUP_KEY)
+    {
+       memcpy (peer -> secret -> sessionPair.previousGroupKey, peer -> secret -> sessionPair.groupKey, SECUDP_SESSIONKEYBYTES);
+       memcpy (peer -> secret -> sessionPair.previousGroupNoncePrefix, peer -> secret -> sessionPair.groupNoncePrefix, SECUDP_NONCE_PREFIXBYTES);
+    }
+    else
+      firstNonceCounter = 0;
+
+    memcpy (peer -> secret -> sessionPair.groupKey, groupKey, SECUDP_SESSIONKEYBYTES);
+    secudp_gen_nonce_prefix (peer -> secret -> sessionPair.groupNoncePrefix, peer -> secret -> sessionPair.groupKey);
+    peer -> secret -> sessionPair.groupNonceCounter = firstNonceCounter;
+
+    sodium_memzero (groupKey, sizeof (groupKey));
+
+    peer -> flags |= SECUDP_PEER_FLAG_GROUP_KEY;
+
+    return 0;
+}
+
+/*
+ *  Whether a group key queued after the one just acknowledged
+ *  is still on its way to the peer. Addition to ENet.
+ */
+static int
+secudp_protocol_group_key_queued (SecUdpPeer * peer)
+{
+    SecUdpList * lists [2] = { & peer -> outgoingCommands, & peer -> sentReliableCommands };
+    SecUdpListIterator currentCommand;
+    size_t listIndex;
+
+    for (listIndex = 0; listIndex < 2; ++ listIndex)
+    {
+       for (currentCommand = secudp_list_begin (lists [listIndex]);
+            currentCommand != secudp_list_end (lists [listIndex]);
+            currentCommand = secudp_list_next (currentCommand))
+       {
+          SecUdpOutgoingCommand * outgoingCommand = (SecUdpOutgoingCommand *) currentCommand;
+
+          if ((outgoingCommand -> command.header.command & SECUDP_PROTOCOL_COMMAND_MASK) == SECUDP_PROTOCOL_COMMAND_GROUP_KEY)
+            return 1;
+       }
+    }
+
+    return 0;
+}
+
+/*
+ *  Resends the pending connect right away with the cookie from a
+ *  retry. Addition to ENet.
+ */
+static int
+secudp_protocol_handle_retry_connect (SecUdpPeer * peer, const SecUdpProtocol * command)
+{
+    SecUdpListIterator currentCommand;
+    SecUdpOutgoingCommand * outgoingCommand = NULL;
+
+    if (peer -> state != SECUDP_PEER_STATE_CONNECTING ||
+        command -> retryConnect.connectID != peer -> connectID)
+      return 0;
+
+    for (currentCommand = secudp_list_begin (& peer -> sentReliableCommands);
+         currentCommand != secudp_list_end (& peer -> sentReliableCommands);
+         currentCommand = secudp_list_next (currentCommand))
+    {
+       outgoingCommand = (SecUdpOutgoingCommand *) currentCommand;
+
+       if ((outgoingCommand -> command.header.command & SECUDP_PROTOCOL_COMMAND_MASK) == SECUDP_PROTOCOL_COMMAND_CONNECT)
+         break;
+    }
+
+    if (currentCommand == secudp_list_end (& peer -> sentReliableCommands))
+      return 0;
+
+    memcpy (outgoingCommand -> command.connect.cookie, command -> retryConnect.cookie, SECUDP_COOKIEBYTES);
+
+    /*
+     *  Start the retried connect over as secudp_host_connect() would,
+     *  so it does not inherit the timeouts of the refused one. It is
+     *  indexed again when sent.
+     */
+    secudp_peer_unindex_reliable_command (peer, outgoingCommand);
+
+    outgoingCommand -> sendAttempts = 0;
+    outgoingCommand -> inTransit = 0;
+    outgoingCommand -> sentTime = 0;
+    outgoingCommand -> roundTripTimeout = 0;
+    outgoingCommand -> roundTripTimeoutLimit = 0;
+
+    peer -> nextTimeout = 0;
+    peer -> earliestTimeout = 0;
+
+    secudp_list_insert (secudp_list_begin (& peer -> outgoingCommands), secudp_list_remove (& outgoingCommand -> outgoingCommandList));
+
+    return 0;
+}
+
 static int
 secudp_protocol_handle_disconnect (SecUdpHost * host, SecUdpPeer * peer, const SecUdpProtocol * command)
 {
@@ -844,11 +1195,6 @@ secudp_protocol_handle_disconnect (SecUdpHost * host, SecUdpPeer * peer, const S
       return 0;
 
     secudp_peer_reset_queues (peer);
-    if(peer -> secret != NULL)
-    {
-        secudp_free(peer -> secret);
-        peer -> secret = NULL;
-    }
 
     if (peer -> state == SECUDP_PEER_STATE_CONNECTION_SUCCEEDED || peer -> state == SECUDP_PEER_STATE_DISCONNECTING || peer -> state == SECUDP_PEER_STATE_CONNECTING)
         secudp_protocol_dispatch_state (host, peer, SECUDP_PEER_STATE_ZOMBIE);
@@ -872,23 +1218,18 @@ secudp_protocol_handle_disconnect (SecUdpHost * host, SecUdpPeer * peer, const S
 }
 
 static int
-secudp_protocol_handle_acknowledge (SecUdpHost * host, SecUdpEvent * event, SecUdpPeer * peer, const SecUdpProtocol * command)
+secudp_protocol_update_round_trip_time (SecUdpHost * host, SecUdpPeer * peer, secudp_uint16 sentTime)
 {
     secudp_uint32 roundTripTime,
-           receivedSentTime,
-           receivedReliableSequenceNumber;
-    SecUdpProtocolCommand commandNumber;
+           receivedSentTime;
 
-    if (peer -> state == SECUDP_PEER_STATE_DISCONNECTED || peer -> state == SECUDP_PEER_STATE_ZOMBIE)
-      return 0;
-
-    receivedSentTime = SECUDP_NET_TO_HOST_16 (command -> acknowledge.receivedSentTime);
+    receivedSentTime = sentTime;
     receivedSentTime |= host -> serviceTime & 0xFFFF0000;
     if ((receivedSentTime & 0x8000) > (host -> serviceTime & 0x8000))
         receivedSentTime -= 0x10000;
 
     if (SECUDP_TIME_LESS (host -> serviceTime, receivedSentTime))
-      return 0;
+      return -1;
 
     roundTripTime = SECUDP_TIME_DIFFERENCE (host -> serviceTime, receivedSentTime);
     roundTripTime = SECUDP_MAX (roundTripTime, 1);
@@ -937,9 +1278,19 @@ secudp_protocol_handle_acknowledge (SecUdpHost * host, SecUdpEvent * event, SecU
     peer -> lastReceiveTime = SECUDP_MAX (host -> serviceTime, 1);
     peer -> earliestTimeout = 0;
 
-    receivedReliableSequenceNumber = SECUDP_NET_TO_HOST_16 (command -> acknowledge.receivedReliableSequenceNumber);
+    return 0;
+}
 
-    commandNumber = secudp_protocol_remove_sent_reliable_command (peer, receivedReliableSequenceNumber, command -> header.channelID);
+static int
+secudp_protocol_handle_acknowledged (SecUdpHost * host, SecUdpEvent * event, SecUdpPeer * peer, SecUdpProtocolCommand commandNumber)
+{
+    if (commandNumber == SECUDP_PROTOCOL_COMMAND_GROUP_KEY &&
+        (peer -> flags & SECUDP_PEER_FLAG_GROUP_PENDING) &&
+        ! secudp_protocol_group_key_queued (peer))
+    {
+       peer -> flags &= ~ SECUDP_PEER_FLAG_GROUP_PENDING;
+       peer -> flags |= SECUDP_PEER_FLAG_GROUP_MEMBER;
+    }
 
     switch (peer -> state)
     {
@@ -971,38 +1322,122 @@ secudp_protocol_handle_acknowledge (SecUdpHost * host, SecUdpEvent * event, SecU
 }
 
 static int
-secudp_protocol_handle_verify_connect (SecUdpHost * host, SecUdpEvent * event, SecUdpPeer * peer, const SecUdpProtocol * command)
+secudp_protocol_handle_acknowledge (SecUdpHost * host, SecUdpEvent * event, SecUdpPeer * peer, const SecUdpProtocol * command)
 {
-    secudp_uint32 mtu, windowSize;
-    size_t channelCount;
-    SecUdpPeerSecret secret;
+    secudp_uint32 receivedReliableSequenceNumber;
+    SecUdpProtocolCommand commandNumber;
 
-    if (peer -> state != SECUDP_PEER_STATE_CONNECTING)
+    if (peer -> state == SECUDP_PEER_STATE_DISCONNECTED || peer -> state == SECUDP_PEER_STATE_ZOMBIE)
       return 0;
 
-    channelCount = SECUDP_NET_TO_HOST_32 (command -> verifyConnect.channelCount);
+    if (secudp_protocol_update_round_trip_time (host, peer, SECUDP_NET_TO_HOST_16 (command -> acknowledge.receivedSentTime)) < 0)
+      return 0;
 
-    /*
-     *  Additionally check if session keys can be generated from the secret key
-     *  exchange pair and the public key received. Extension of ENet.
-     */
-    if (channelCount < SECUDP_PROTOCOL_MINIMUM_CHANNEL_COUNT || channelCount > SECUDP_PROTOCOL_MAXIMUM_CHANNEL_COUNT ||
-        SECUDP_NET_TO_HOST_32 (command -> verifyConnect.packetThrottleInterval) != peer -> packetThrottleInterval ||
-        SECUDP_NET_TO_HOST_32 (command -> verifyConnect.packetThrottleAcceleration) != peer -> packetThrottleAcceleration ||
-        SECUDP_NET_TO_HOST_32 (command -> verifyConnect.packetThrottleDeceleration) != peer -> packetThrottleDeceleration ||
-        command -> verifyConnect.connectID != peer -> connectID || 
-        secudp_peer_gen_session_keys(secret.sessionPair.sendKey, secret.sessionPair.recvKey, peer -> secret -> kxPair.publicKx, peer -> secret -> kxPair.privateKx, command -> verifyConnect.publicKx) ||
-        secudp_host_verify_signature(command -> verifyConnect.signature, command -> verifyConnect.publicKx, SECUDP_KX_PUBLICBYTES, host -> secret -> publicKey))
-    {
-        peer -> eventData = 0;
-        secudp_protocol_dispatch_state (host, peer, SECUDP_PEER_STATE_ZOMBIE);
+    receivedReliableSequenceNumber = SECUDP_NET_TO_HOST_16 (command -> acknowledge.receivedReliableSequenceNumber);
+
+    commandNumber = secudp_protocol_remove_sent_reliable_command (peer, receivedReliableSequenceNumber, command -> header.channelID);
+
+    if (commandNumber == SECUDP_PROTOCOL_COMMAND_PING &&
+        (peer -> flags & SECUDP_PEER_FLAG_PATH_PENDING) &&
+        command -> header.channelID == 0xFF &&
+        receivedReliableSequenceNumber == peer -> pathChallenge)
+      peer -> flags &= ~ SECUDP_PEER_FLAG_PATH_PENDING;
+
+    return secudp_protocol_handle_acknowledged (host, event, peer, commandNumber);
+}
+
+static int
+secudp_protocol_handle_selective_acknowledge (SecUdpHost * host, SecUdpEvent * event, SecUdpPeer * peer, const SecUdpProtocol * command)
+{
+    SecUdpProtocolCommand commandNumber;
+
+    if (peer -> state == SECUDP_PEER_STATE_DISCONNECTED || peer -> state == SECUDP_PEER_STATE_ZOMBIE)
+      return 0;
+
+    if (command -> header.channelID >= peer -> channelCount)
+      return -1;
+
+    if (secudp_protocol_update_round_trip_time (host, peer, SECUDP_NET_TO_HOST_16 (command -> selectiveAcknowledge.receivedSentTime)) < 0)
+      return 0;
+
+    commandNumber = secudp_protocol_remove_sent_reliable_commands (peer,
+                                                                   command -> header.channelID,
+                                                                   command -> header.reliableSequenceNumber,
+                                                                   SECUDP_NET_TO_HOST_32 (command -> selectiveAcknowledge.receivedMask));
+
+    return secudp_protocol_handle_acknowledged (host, event, peer, commandNumber);
+}
+
+static int
+secudp_protocol_handle_verify_connect (SecUdpHost * host, SecUdpEvent * event, SecUdpPeer * peer, const SecUdpProtocol * command)
+{
+    secudp_uint32 mtu, windowSize;
+    size_t channelCount;
+    SecUdpPeerSecret secret;
+    secudp_uint32 options, cipherSuite, notAfter;
+    secudp_uint8 transcript [SECUDP_PROTOCOL_HANDSHAKE_TRANSCRIPT_SIZE];
+    size_t transcriptLength;
+
+    if (peer -> state != SECUDP_PEER_STATE_CONNECTING)
+      return 0;
+
+    options = SECUDP_NET_TO_HOST_32 (command -> verifyConnect.options);
+    cipherSuite = SECUDP_NET_TO_HOST_32 (command -> verifyConnect.cipherSuite);
+    notAfter = SECUDP_NET_TO_HOST_32 (command -> verifyConnect.notAfter);
+    transcriptLength = secudp_protocol_handshake_transcript (transcript, peer -> secret -> kxPair.publicKx, peer -> connectID, peer -> secret -> kxPair.options, peer -> secret -> kxPair.cipherSuites, & command -> verifyConnect);
+
+    channelCount = SECUDP_NET_TO_HOST_32 (command -> verifyConnect.channelCount);
+
+    /*
+     *  Additionally check if session keys can be generated from the secret key
+     *  exchange pair and the public key received, that the signature of that
+     *  key has not expired and that the handshake mac proves the signed key
+     *  answered this very connect. The mac covers the options and cipher
+     *  suites offered and accepted, so a stripped option or suite fails it,
+     *  and accepting an option or suite that was never offered aborts the
+     *  handshake. Extension of ENet.
+     */
+    if (channelCount < SECUDP_PROTOCOL_MINIMUM_CHANNEL_COUNT || channelCount > SECUDP_PROTOCOL_MAXIMUM_CHANNEL_COUNT ||
+        SECUDP_NET_TO_HOST_32 (command -> verifyConnect.packetThrottleInterval) != peer -> packetThrottleInterval ||
+        SECUDP_NET_TO_HOST_32 (command -> verifyConnect.packetThrottleAcceleration) != peer -> packetThrottleAcceleration ||
+        SECUDP_NET_TO_HOST_32 (command -> verifyConnect.packetThrottleDeceleration) != peer -> packetThrottleDeceleration ||
+        command -> verifyConnect.connectID != peer -> connectID || 
+        (options & ~ peer -> secret -> kxPair.options) ||
+        cipherSuite >= SECUDP_CIPHER_SUITE_COUNT ||
+        ! (peer -> secret -> kxPair.cipherSuites & (1 << cipherSuite)) ||
+        ((options & SECUDP_PROTOCOL_OPTION_SEAL_DATAGRAMS) && ! (SECUDP_CIPHER_SUITES_AEAD & (1 << cipherSuite))) ||
+        (secudp_uint32) time (NULL) > notAfter ||
+        secudp_host_verify_kx(command -> verifyConnect.signature, command -> verifyConnect.publicKx, notAfter, host -> secret -> publicKey) ||
+        secudp_peer_gen_session_keys(secret.sessionPair.sendKey, secret.sessionPair.recvKey, peer -> secret -> kxPair.publicKx, peer -> secret -> kxPair.privateKx, command -> verifyConnect.publicKx) ||
+        secudp_verify_handshake_mac(command -> verifyConnect.mac, transcript, transcriptLength, secret.sessionPair.recvKey))
+    {
+        sodium_memzero (& secret, sizeof (secret));
+        peer -> eventData = 0;
+        secudp_protocol_dispatch_state (host, peer, SECUDP_PEER_STATE_ZOMBIE);
 
         return -1;
     }
 
     memcpy(peer -> secret -> sessionPair.sendKey, secret.sessionPair.sendKey, SECUDP_SESSIONKEYBYTES);
     memcpy(peer -> secret -> sessionPair.recvKey, secret.sessionPair.recvKey, SECUDP_SESSIONKEYBYTES);
+    secudp_gen_nonce_prefix(peer -> secret -> sessionPair.sendNoncePrefix, secret.sessionPair.sendKey);
+    secudp_gen_nonce_prefix(peer -> secret -> sessionPair.recvNoncePrefix, secret.sessionPair.recvKey);
     secudp_protocol_remove_sent_reliable_command (peer, 1, 0xFF);
+
+    peer -> cipherSuite = (SecUdpCipherSuite) cipherSuite;
+
+    if (options & SECUDP_PROTOCOL_OPTION_SEAL_DATAGRAMS)
+    {
+        secudp_peer_gen_datagram_key (peer -> secret -> sessionPair.sendDatagramKey, secret.sessionPair.sendKey);
+        secudp_peer_gen_datagram_key (peer -> secret -> sessionPair.recvDatagramKey, secret.sessionPair.recvKey);
+
+        peer -> flags |= SECUDP_PEER_FLAG_SEAL_DATAGRAMS | SECUDP_PEER_FLAG_SEAL_OUTGOING;
+    }
+
+    if (options & SECUDP_PROTOCOL_OPTION_SELECTIVE_ACKNOWLEDGE)
+      peer -> flags |= SECUDP_PEER_FLAG_SELECTIVE_ACKNOWLEDGE;
+
+    sodium_memzero (& secret, sizeof (secret));
     
     if (channelCount < peer -> channelCount)
       peer -> channelCount = channelCount;
@@ -1041,6 +1476,111 @@ secudp_protocol_handle_verify_connect (SecUdpHost * host, SecUdpEvent * event, S
     return 0;
 }
 
+/*
+ *  Opens a sealed datagram in place. The header up to and including
+ *  the checksum is authenticated as additional data, and the counter
+ *  carried in the trailer is checked against a window of recently
+ *  received counters to reject replays. Addition to ENet.
+ */
+static int
+secudp_protocol_open_datagram (SecUdpHost * host, SecUdpPeer * peer, size_t headerSize)
+{
+    secudp_uint8 nonce [SECUDP_NONCEBYTES];
+    secudp_uint8 * data = host -> receivedData + headerSize,
+                 * counterData,
+                 * mac;
+    secudp_uint64 counter = 0;
+    size_t dataLength;
+    int i;
+
+    if (host -> receivedDataLength < headerSize + SECUDP_DATAGRAM_SEALBYTES)
+      return -1;
+
+    dataLength = host -> receivedDataLength - headerSize - SECUDP_DATAGRAM_SEALBYTES;
+    counterData = data + dataLength;
+    mac = counterData + SECUDP_NONCE_COUNTERBYTES;
+
+    for (i = SECUDP_NONCE_COUNTERBYTES; i > 0; -- i)
+      counter = (counter << 8) | counterData [i - 1];
+
+    if (counter <= peer -> incomingDatagramCounter &&
+        (peer -> incomingDatagramCounter - counter >= 64 ||
+         (peer -> incomingDatagramWindow & ((secudp_uint64) 1 << (peer -> incomingDatagramCounter - counter)))))
+      return -1;
+
+    secudp_cipher_nonce (peer -> cipherSuite, nonce, NULL, counterData);
+
+    /*
+     *  Until the peer is known to seal its datagrams, only verify so
+     *  an unsealed datagram is left intact when the check fails.
+     */
+    if (! (peer -> flags & SECUDP_PEER_FLAG_SEAL_INCOMING) &&
+        secudp_cipher_decrypt (peer -> cipherSuite, NULL, data, mac, dataLength, host -> receivedData, headerSize, nonce, peer -> secret -> sessionPair.recvDatagramKey))
+      return -1;
+
+    if (secudp_cipher_decrypt (peer -> cipherSuite, data, data, mac, dataLength, host -> receivedData, headerSize, nonce, peer -> secret -> sessionPair.recvDatagramKey))
+      return -1;
+
+    if (counter > peer -> incomingDatagramCounter)
+    {
+       secudp_uint64 shift = counter - peer -> incomingDatagramCounter;
+
+       peer -> incomingDatagramWindow = shift >= 64 ? 0 : peer -> incomingDatagramWindow << shift;
+       peer -> incomingDatagramCounter = counter;
+    }
+
+    peer -> incomingDatagramWindow |= (secudp_uint64) 1 << (peer -> incomingDatagramCounter - counter);
+
+    host -> receivedDataLength -= SECUDP_DATAGRAM_SEALBYTES;
+
+    return 0;
+}
+
+/*
+ *  Moves a peer to the address of the datagram being handled and
+ *  sends a ping there as a challenge. Only once it is acknowledged
+ *  is the new address known to reach the peer rather than someone
+ *  the datagram was replayed from. Addition to ENet.
+ */
+static void
+secudp_protocol_migrate_peer (SecUdpHost * host, SecUdpPeer * peer)
+{
+    SecUdpOutgoingCommand * outgoingCommand;
+    SecUdpProtocol command;
+
+    if (! (peer -> flags & SECUDP_PEER_FLAG_PATH_PENDING))
+      peer -> validatedAddress = peer -> address;
+
+    secudp_peer_set_address (peer, & host -> receivedAddress);
+
+    if (peer -> address.host == peer -> validatedAddress.host &&
+        peer -> address.port == peer -> validatedAddress.port)
+    {
+       peer -> flags &= ~ SECUDP_PEER_FLAG_PATH_PENDING;
+
+       return;
+    }
+
+    command.header.command = SECUDP_PROTOCOL_COMMAND_PING | SECUDP_PROTOCOL_COMMAND_FLAG_ACKNOWLEDGE;
+    command.header.channelID = 0xFF;
+
+    outgoingCommand = secudp_peer_queue_outgoing_command (peer, & command, NULL, 0, 0);
+    if (outgoingCommand == NULL)
+    {
+       secudp_peer_set_address (peer, & peer -> validatedAddress);
+
+       peer -> flags &= ~ SECUDP_PEER_FLAG_PATH_PENDING;
+
+       return;
+    }
+
+    peer -> flags |= SECUDP_PEER_FLAG_PATH_PENDING;
+    peer -> pathChallenge = outgoingCommand -> reliableSequenceNumber;
+    peer -> pathChallengeTime = host -> serviceTime;
+    peer -> pathDataSent = 0;
+    peer -> pathDataReceived = 0;
+}
+
 static int
 secudp_protocol_handle_incoming_commands (SecUdpHost * host, SecUdpEvent * event)
 {
@@ -1051,6 +1591,7 @@ secudp_protocol_handle_incoming_commands (SecUdpHost * host, SecUdpEvent * event
     size_t headerSize;
     secudp_uint16 peerID, flags;
     secudp_uint8 sessionID;
+    int updateAddress = 0;
 
     if (host -> receivedDataLength < (size_t) & ((SecUdpProtocolHeader *) 0) -> sentTime)
       return 0;
@@ -1077,12 +1618,47 @@ secudp_protocol_handle_incoming_commands (SecUdpHost * host, SecUdpEvent * event
 
        if (peer -> state == SECUDP_PEER_STATE_DISCONNECTED ||
            peer -> state == SECUDP_PEER_STATE_ZOMBIE ||
-           ((host -> receivedAddress.host != peer -> address.host ||
-             host -> receivedAddress.port != peer -> address.port) &&
-             peer -> address.host != SECUDP_HOST_BROADCAST) ||
            (peer -> outgoingPeerID < SECUDP_PROTOCOL_MAXIMUM_PEER_ID &&
             sessionID != peer -> incomingSessionID))
          return 0;
+
+       /*
+        *  A datagram from another address is only accepted once the
+        *  peer seals its datagrams, since opening it then proves it
+        *  came from the peer. The peer follows the address of its
+        *  newest datagram, as when its NAT rebinds, so a replayed or
+        *  reordered one cannot move it back, and the new address
+        *  is validated before the peer stays there. Addition to ENet.
+        */
+       if (host -> receivedAddress.host != peer -> address.host ||
+           host -> receivedAddress.port != peer -> address.port)
+       {
+          if (peer -> address.host != SECUDP_HOST_BROADCAST &&
+              ! (peer -> flags & SECUDP_PEER_FLAG_SEAL_INCOMING))
+            return 0;
+
+          updateAddress = 1;
+       }
+
+       if (peer -> flags & SECUDP_PEER_FLAG_SEAL_DATAGRAMS)
+       {
+          secudp_uint64 incomingDatagramCounter = peer -> incomingDatagramCounter;
+
+          if (secudp_protocol_open_datagram (host, peer, headerSize) < 0)
+          {
+             if (peer -> flags & SECUDP_PEER_FLAG_SEAL_INCOMING)
+               return 0;
+          }
+          else
+          {
+             if (updateAddress &&
+                 peer -> address.host != SECUDP_HOST_BROADCAST &&
+                 peer -> incomingDatagramCounter == incomingDatagramCounter)
+               updateAddress = 0;
+
+             peer -> flags |= SECUDP_PEER_FLAG_SEAL_INCOMING | SECUDP_PEER_FLAG_SEAL_OUTGOING;
+          }
+       }
     }
  
     if (flags & SECUDP_PROTOCOL_HEADER_FLAG_COMPRESSED)
@@ -1121,8 +1697,19 @@ secudp_protocol_handle_incoming_commands (SecUdpHost * host, SecUdpEvent * event
        
     if (peer != NULL)
     {
-       peer -> address.host = host -> receivedAddress.host;
-       peer -> address.port = host -> receivedAddress.port;
+       if (updateAddress)
+       {
+          if (peer -> address.host == SECUDP_HOST_BROADCAST)
+            secudp_peer_set_address (peer, & host -> receivedAddress);
+          else
+            secudp_protocol_migrate_peer (host, peer);
+       }
+
+       if ((peer -> flags & SECUDP_PEER_FLAG_PATH_PENDING) &&
+           host -> receivedAddress.host == peer -> address.host &&
+           host -> receivedAddress.port == peer -> address.port)
+         peer -> pathDataReceived += host -> receivedDataLength;
+
        peer -> incomingDataTotal += host -> receivedDataLength;
     }
     
@@ -1160,6 +1747,11 @@ secudp_protocol_handle_incoming_commands (SecUdpHost * host, SecUdpEvent * event
             goto commandError;
           break;
 
+       case SECUDP_PROTOCOL_COMMAND_SELECTIVE_ACKNOWLEDGE:
+          if (secudp_protocol_handle_selective_acknowledge (host, event, peer, command))
+            goto commandError;
+          break;
+
        case SECUDP_PROTOCOL_COMMAND_CONNECT:
           if (peer != NULL)
             goto commandError;
@@ -1218,6 +1810,16 @@ secudp_protocol_handle_incoming_commands (SecUdpHost * host, SecUdpEvent * event
             goto commandError;
           break;
 
+       case SECUDP_PROTOCOL_COMMAND_GROUP_KEY:
+          if (secudp_protocol_handle_group_key (peer, command))
+            goto commandError;
+          break;
+
+       case SECUDP_PROTOCOL_COMMAND_RETRY_CONNECT:
+          if (secudp_protocol_handle_retry_connect (peer, command))
+            goto commandError;
+          break;
+
        default:
           goto commandError;
        }
@@ -1253,6 +1855,16 @@ secudp_protocol_handle_incoming_commands (SecUdpHost * host, SecUdpEvent * event
     }
 
 commandError:
+    /*
+     *  Acknowledgements may have freed window for queued commands
+     *  or moved the retransmission timeout, so have the next send
+     *  pass look at the peer. Addition to ENet.
+     */
+    if (peer != NULL &&
+        peer -> state != SECUDP_PEER_STATE_DISCONNECTED &&
+        peer -> state != SECUDP_PEER_STATE_ZOMBIE)
+      secudp_peer_queue_send (peer);
+
     if (event != NULL && event -> type != SECUDP_EVENT_TYPE_NONE)
       return 1;
 
@@ -1262,29 +1874,85 @@ commandError:
 static int
 secudp_protocol_receive_incoming_commands (SecUdpHost * host, SecUdpEvent * event)
 {
+    SecUdpReceiveBatch * batch = host -> receiveBatch;
     int packets;
 
     for (packets = 0; packets < 256; ++ packets)
     {
-       int receivedLength;
-       SecUdpBuffer buffer;
+       size_t receivedLength;
+
+       /*
+        *  Datagrams are received a batch at a time and handled
+        *  one by one, possibly across several calls when one of
+        *  them produces an event. With receive offload, reads are
+        *  large enough for the kernel to coalesce datagrams into
+        *  and are split back up here. Addition to ENet.
+        */
+       if (batch -> index >= batch -> count)
+       {
+          int batchCount;
+
+          if (host -> uring != NULL)
+            batchCount = secudp_uring_receive_batch (host -> uring,
+                                                     batch -> addresses,
+                                                     batch -> buffers,
+                                                     batch -> lengths,
+                                                     batch -> segmentSizes,
+                                                     SECUDP_HOST_RECEIVE_BATCH_SIZE);
+          else
+          {
+             secudp_uint8 * data = batch -> data;
+             size_t bufferSize = SECUDP_PROTOCOL_MAXIMUM_MTU,
+                    i;
 
-       buffer.data = host -> packetData [0];
-       buffer.dataLength = sizeof (host -> packetData [0]);
+             if (host -> segmentOffload & SECUDP_SEGMENT_OFFLOAD_RECEIVE)
+             {
+                data = batch -> segmentData;
+                bufferSize = SECUDP_SOCKET_SEGMENT_BUFFER_SIZE;
+             }
 
-       receivedLength = secudp_socket_receive (host -> socket,
-                                             & host -> receivedAddress,
-                                             & buffer,
-                                             1);
+             for (i = 0; i < SECUDP_HOST_RECEIVE_BATCH_SIZE; ++ i)
+             {
+                batch -> buffers [i].data = data + i * bufferSize;
+                batch -> buffers [i].dataLength = bufferSize;
+             }
 
-       if (receivedLength < 0)
-         return -1;
+             batchCount = secudp_socket_receive_batch (host -> socket,
+                                                       batch -> addresses,
+                                                       batch -> buffers,
+                                                       batch -> lengths,
+                                                       batch -> segmentSizes,
+                                                       SECUDP_HOST_RECEIVE_BATCH_SIZE);
+          }
 
-       if (receivedLength == 0)
-         return 0;
+          if (batchCount < 0)
+            return -1;
+
+          if (batchCount == 0)
+            return 0;
+
+          batch -> count = batchCount;
+          batch -> index = 0;
+          batch -> offset = 0;
+       }
 
-       host -> receivedData = host -> packetData [0];
+       receivedLength = batch -> lengths [batch -> index] - batch -> offset;
+       if (receivedLength > batch -> segmentSizes [batch -> index])
+         receivedLength = batch -> segmentSizes [batch -> index];
+
+       host -> receivedAddress = batch -> addresses [batch -> index];
+       host -> receivedData = (secudp_uint8 *) batch -> buffers [batch -> index].data + batch -> offset;
        host -> receivedDataLength = receivedLength;
+
+       batch -> offset += receivedLength;
+       if (batch -> offset >= batch -> lengths [batch -> index])
+       {
+          ++ batch -> index;
+          batch -> offset = 0;
+       }
+
+       if (receivedLength == 0)
+         continue;
       
        host -> totalReceivedData += receivedLength;
        host -> totalReceivedPackets ++;
@@ -1323,18 +1991,23 @@ secudp_protocol_receive_incoming_commands (SecUdpHost * host, SecUdpEvent * even
     return 0;
 }
 
+/*
+ *  Sends the queued acknowledgements in order. Peers that agreed
+ *  to selective acknowledges get each run of acknowledgements for
+ *  one channel, within 32 of the first one's sequence number, as
+ *  a single selective acknowledge stamped with the latest sent time.
+ */
 static void
 secudp_protocol_send_acknowledgements (SecUdpHost * host, SecUdpPeer * peer)
 {
     SecUdpProtocol * command = & host -> commands [host -> commandCount];
     SecUdpBuffer * buffer = & host -> buffers [host -> bufferCount];
-    SecUdpAcknowledgement * acknowledgement;
-    SecUdpListIterator currentAcknowledgement;
-    secudp_uint16 reliableSequenceNumber;
+    SecUdpAcknowledgement * acknowledgement, * nextAcknowledgement;
+    secudp_uint16 reliableSequenceNumber, sentTime, offset;
+    secudp_uint32 receivedMask;
+    size_t acknowledgementCount;
  
-    currentAcknowledgement = secudp_list_begin (& peer -> acknowledgements);
-         
-    while (currentAcknowledgement != secudp_list_end (& peer -> acknowledgements))
+    while (peer -> acknowledgementCount > 0)
     {
        if (command >= & host -> commands [sizeof (host -> commands) / sizeof (SecUdpProtocol)] ||
            buffer >= & host -> buffers [sizeof (host -> buffers) / sizeof (SecUdpBuffer)] ||
@@ -1345,29 +2018,60 @@ secudp_protocol_send_acknowledgements (SecUdpHost * host, SecUdpPeer * peer)
           break;
        }
 
-       acknowledgement = (SecUdpAcknowledgement *) currentAcknowledgement;
- 
-       currentAcknowledgement = secudp_list_next (currentAcknowledgement);
+       acknowledgement = & peer -> acknowledgements [peer -> acknowledgementHead];
+       acknowledgementCount = 1;
+       sentTime = acknowledgement -> sentTime;
+       receivedMask = 0;
+
+       if ((peer -> flags & SECUDP_PEER_FLAG_SELECTIVE_ACKNOWLEDGE) &&
+           acknowledgement -> channelID < peer -> channelCount &&
+           peer -> mtu - host -> packetSize >= sizeof (SecUdpProtocolSelectiveAcknowledge))
+       {
+          for (; acknowledgementCount < peer -> acknowledgementCount; ++ acknowledgementCount)
+          {
+             nextAcknowledgement = & peer -> acknowledgements [(peer -> acknowledgementHead + acknowledgementCount) & (peer -> acknowledgementCapacity - 1)];
+             offset = nextAcknowledgement -> reliableSequenceNumber - acknowledgement -> reliableSequenceNumber;
+             if (nextAcknowledgement -> channelID != acknowledgement -> channelID || offset > 32)
+               break;
+
+             if (offset > 0)
+               receivedMask |= (secudp_uint32) 1 << (offset - 1);
+             sentTime = nextAcknowledgement -> sentTime;
+          }
+       }
+
+       peer -> acknowledgementHead = (peer -> acknowledgementHead + acknowledgementCount) & (peer -> acknowledgementCapacity - 1);
+       peer -> acknowledgementCount -= acknowledgementCount;
 
        buffer -> data = command;
-       buffer -> dataLength = sizeof (SecUdpProtocolAcknowledge);
 
-       host -> packetSize += buffer -> dataLength;
+       reliableSequenceNumber = SECUDP_HOST_TO_NET_16 (acknowledgement -> reliableSequenceNumber);
 
-       reliableSequenceNumber = SECUDP_HOST_TO_NET_16 (acknowledgement -> command.header.reliableSequenceNumber);
-  
-       command -> header.command = SECUDP_PROTOCOL_COMMAND_ACKNOWLEDGE;
-       command -> header.channelID = acknowledgement -> command.header.channelID;
+       command -> header.channelID = acknowledgement -> channelID;
        command -> header.reliableSequenceNumber = reliableSequenceNumber;
-       command -> acknowledge.receivedReliableSequenceNumber = reliableSequenceNumber;
-       command -> acknowledge.receivedSentTime = SECUDP_HOST_TO_NET_16 (acknowledgement -> sentTime);
+
+       if (receivedMask != 0)
+       {
+          buffer -> dataLength = sizeof (SecUdpProtocolSelectiveAcknowledge);
+
+          command -> header.command = SECUDP_PROTOCOL_COMMAND_SELECTIVE_ACKNOWLEDGE;
+          command -> selectiveAcknowledge.receivedSentTime = SECUDP_HOST_TO_NET_16 (sentTime);
+          command -> selectiveAcknowledge.receivedMask = SECUDP_HOST_TO_NET_32 (receivedMask);
+       }
+       else
+       {
+          buffer -> dataLength = sizeof (SecUdpProtocolAcknowledge);
+
+          command -> header.command = SECUDP_PROTOCOL_COMMAND_ACKNOWLEDGE;
+          command -> acknowledge.receivedReliableSequenceNumber = reliableSequenceNumber;
+          command -> acknowledge.receivedSentTime = SECUDP_HOST_TO_NET_16 (sentTime);
+       }
+
+       host -> packetSize += buffer -> dataLength;
   
-       if ((acknowledgement -> command.header.command & SECUDP_PROTOCOL_COMMAND_MASK) == SECUDP_PROTOCOL_COMMAND_DISCONNECT)
+       if ((acknowledgement -> command & SECUDP_PROTOCOL_COMMAND_MASK) == SECUDP_PROTOCOL_COMMAND_DISCONNECT)
          secudp_protocol_dispatch_state (host, peer, SECUDP_PEER_STATE_ZOMBIE);
 
-       secudp_list_remove (& acknowledgement -> acknowledgementList);
-       secudp_free (acknowledgement);
-
        ++ command;
        ++ buffer;
     }
@@ -1410,6 +2114,8 @@ secudp_protocol_check_timeouts (SecUdpHost * host, SecUdpPeer * peer, SecUdpEven
 
        if (outgoingCommand -> packet != NULL)
          peer -> reliableDataInTransit -= outgoingCommand -> fragmentLength;
+
+       outgoingCommand -> inTransit = 0;
           
        ++ peer -> packetsLost;
 
@@ -1502,6 +2208,12 @@ secudp_protocol_check_outgoing_commands (SecUdpHost * host, SecUdpPeer * peer)
 
        currentCommand = secudp_list_next (currentCommand);
 
+       /* Without room to index it, a reliable command waits for a later pass. */
+       if ((outgoingCommand -> command.header.command & SECUDP_PROTOCOL_COMMAND_FLAG_ACKNOWLEDGE) &&
+           outgoingCommand -> sendAttempts < 1 &&
+           secudp_peer_index_reliable_command (peer, outgoingCommand) < 0)
+         continue;
+
        if (outgoingCommand -> command.header.command & SECUDP_PROTOCOL_COMMAND_FLAG_ACKNOWLEDGE)
        {
           if (channel != NULL && outgoingCommand -> sendAttempts < 1)
@@ -1525,6 +2237,7 @@ secudp_protocol_check_outgoing_commands (SecUdpHost * host, SecUdpPeer * peer)
                             secudp_list_remove (& outgoingCommand -> outgoingCommandList));
 
           outgoingCommand -> sentTime = host -> serviceTime;
+          outgoingCommand -> inTransit = 1;
 
           host -> headerFlags |= SECUDP_PROTOCOL_HEADER_FLAG_SENT_TIME;
 
@@ -1549,7 +2262,7 @@ secudp_protocol_check_outgoing_commands (SecUdpHost * host, SecUdpPeer * peer)
                      secudp_packet_destroy (outgoingCommand -> packet);
 
                    secudp_list_remove (& outgoingCommand -> outgoingCommandList);
-                   secudp_free (outgoingCommand);
+                   secudp_pool_free (& host -> outgoingCommandPool, outgoingCommand);
 
                    if (currentCommand == secudp_list_end (& peer -> outgoingCommands))
                      break;
@@ -1590,7 +2303,7 @@ secudp_protocol_check_outgoing_commands (SecUdpHost * host, SecUdpPeer * peer)
        }
        else
        if (! (outgoingCommand -> command.header.command & SECUDP_PROTOCOL_COMMAND_FLAG_ACKNOWLEDGE))
-         secudp_free (outgoingCommand);
+         secudp_pool_free (& host -> outgoingCommandPool, outgoingCommand);
 
        ++ peer -> packetsSent;
         
@@ -1604,146 +2317,377 @@ secudp_protocol_check_outgoing_commands (SecUdpHost * host, SecUdpPeer * peer)
     if (peer -> state == SECUDP_PEER_STATE_DISCONNECT_LATER &&
         secudp_list_empty (& peer -> outgoingCommands) &&
         secudp_list_empty (& peer -> sentReliableCommands) &&
-        secudp_list_empty (& peer -> sentUnreliableCommands))
+        secudp_list_empty (& peer -> sentUnreliableCommands) &&
+        peer -> pendingSeals == 0)
       secudp_peer_disconnect (peer, peer -> eventData);
 
     return canPing;
 }
 
+/*
+ *  Gathers the commands of the datagram being built into a single
+ *  buffer and seals them, with the header as additional data and the
+ *  counter and mac appended. Addition to ENet.
+ */
+static void
+secudp_protocol_seal_datagram (SecUdpHost * host, SecUdpPeer * peer)
+{
+    secudp_uint8 nonce [SECUDP_NONCEBYTES];
+    secudp_uint8 * data = host -> packetData [1],
+                 * counterData;
+    secudp_uint64 counter = peer -> outgoingDatagramCounter ++;
+    size_t dataLength = 0;
+    SecUdpBuffer * buffer;
+    int i;
+
+    for (buffer = & host -> buffers [1];
+         buffer < & host -> buffers [host -> bufferCount];
+         ++ buffer)
+    {
+       if (buffer -> data != data + dataLength)
+         memcpy (data + dataLength, buffer -> data, buffer -> dataLength);
+
+       dataLength += buffer -> dataLength;
+    }
+
+    counterData = data + dataLength;
+    for (i = 0; i < SECUDP_NONCE_COUNTERBYTES; ++ i)
+      counterData [i] = (secudp_uint8) (counter >> (i * 8));
+
+    secudp_cipher_nonce (peer -> cipherSuite, nonce, NULL, counterData);
+    secudp_cipher_encrypt (peer -> cipherSuite, data, counterData + SECUDP_NONCE_COUNTERBYTES, data, dataLength, host -> buffers -> data, host -> buffers -> dataLength, nonce, peer -> secret -> sessionPair.sendDatagramKey);
+
+    host -> buffers [1].data = data;
+    host -> buffers [1].dataLength = dataLength + SECUDP_DATAGRAM_SEALBYTES;
+    host -> bufferCount = 2;
+}
+
+/*
+ *  Hands every staged datagram to the socket at once.
+ *  Addition to ENet.
+ */
 static int
-secudp_protocol_send_outgoing_commands (SecUdpHost * host, SecUdpEvent * event, int checkForTimeouts)
+secudp_protocol_flush_send_batch (SecUdpHost * host)
+{
+    SecUdpSendBatch * batch = host -> sendBatch;
+    int sentCount, i;
+
+    if (batch -> count == 0)
+      return 0;
+
+    if (host -> uring != NULL)
+      sentCount = secudp_uring_send_batch (host -> uring, batch -> addresses, batch -> buffers, batch -> count, host -> segmentOffload & SECUDP_SEGMENT_OFFLOAD_SEND);
+    else
+      sentCount = secudp_socket_send_batch (host -> socket, batch -> addresses, batch -> buffers, batch -> count, host -> segmentOffload & SECUDP_SEGMENT_OFFLOAD_SEND);
+
+    batch -> count = 0;
+
+    if (sentCount < 0)
+      return -1;
+
+    for (i = 0; i < sentCount; ++ i)
+      host -> totalSentData += batch -> buffers [i].dataLength;
+    host -> totalSentPackets += sentCount;
+
+    return 0;
+}
+
+/*
+ *  Copies the datagram described by the host buffers into the next
+ *  slot of the send batch, flushing the batch first if it is full,
+ *  so the buffers may be reused for the next peer right away.
+ *  Addition to ENet.
+ */
+static int
+secudp_protocol_stage_datagram (SecUdpHost * host, SecUdpPeer * peer)
+{
+    SecUdpSendBatch * batch = host -> sendBatch;
+    SecUdpBuffer * buffer;
+    secudp_uint8 * data;
+    size_t dataLength = 0;
+
+    if (batch -> count >= SECUDP_HOST_SEND_BATCH_SIZE &&
+        secudp_protocol_flush_send_batch (host) < 0)
+      return -1;
+
+    data = batch -> data [batch -> count];
+
+    for (buffer = host -> buffers;
+         buffer < & host -> buffers [host -> bufferCount];
+         ++ buffer)
+    {
+       memcpy (data + dataLength, buffer -> data, buffer -> dataLength);
+
+       dataLength += buffer -> dataLength;
+    }
+
+    batch -> buffers [batch -> count].data = data;
+    batch -> buffers [batch -> count].dataLength = dataLength;
+    batch -> addresses [batch -> count] = peer -> address;
+    ++ batch -> count;
+
+    return 0;
+}
+
+/*
+ *  Builds and stages at most one datagram for a peer: its pending
+ *  acknowledgements, resends once its retransmission timeout has
+ *  passed, queued commands and a ping if it has been quiet.
+ */
+static int
+secudp_protocol_send_peer (SecUdpHost * host, SecUdpPeer * currentPeer, SecUdpEvent * event, int checkForTimeouts)
 {
     secudp_uint8 headerData [sizeof (SecUdpProtocolHeader) + sizeof (secudp_uint32)];
     SecUdpProtocolHeader * header = (SecUdpProtocolHeader *) headerData;
-    SecUdpPeer * currentPeer;
-    int sentLength;
     size_t shouldCompress = 0;
- 
-    host -> continueSending = 1;
 
-    while (host -> continueSending)
-    for (host -> continueSending = 0,
-           currentPeer = host -> peers;
-         currentPeer < & host -> peers [host -> peerCount];
-         ++ currentPeer)
+    /*
+     *  An address the peer moved to that has not answered its
+     *  challenge is given up on after a while, and meanwhile is
+     *  only sent a bounded multiple of what came from it.
+     */
+    if (currentPeer -> flags & SECUDP_PEER_FLAG_PATH_PENDING)
     {
-        if (currentPeer -> state == SECUDP_PEER_STATE_DISCONNECTED ||
-            currentPeer -> state == SECUDP_PEER_STATE_ZOMBIE)
-          continue;
+       if (SECUDP_TIME_DIFFERENCE (host -> serviceTime, currentPeer -> pathChallengeTime) >= SECUDP_PEER_PATH_CHALLENGE_TIMEOUT)
+       {
+          currentPeer -> flags &= ~ SECUDP_PEER_FLAG_PATH_PENDING;
 
-        host -> headerFlags = 0;
-        host -> commandCount = 0;
-        host -> bufferCount = 1;
-        host -> packetSize = sizeof (SecUdpProtocolHeader);
+          secudp_peer_set_address (currentPeer, & currentPeer -> validatedAddress);
+       }
+       else
+       if (currentPeer -> pathDataSent >= SECUDP_PEER_PATH_AMPLIFICATION_FACTOR * currentPeer -> pathDataReceived)
+         return 0;
+    }
 
-        if (! secudp_list_empty (& currentPeer -> acknowledgements))
-          secudp_protocol_send_acknowledgements (host, currentPeer);
+    host -> headerFlags = 0;
+    host -> commandCount = 0;
+    host -> bufferCount = 1;
+    host -> packetSize = sizeof (SecUdpProtocolHeader);
+    if (currentPeer -> flags & SECUDP_PEER_FLAG_SEAL_DATAGRAMS)
+      host -> packetSize += SECUDP_DATAGRAM_SEALBYTES;
 
-        if (checkForTimeouts != 0 &&
-            ! secudp_list_empty (& currentPeer -> sentReliableCommands) &&
-            SECUDP_TIME_GREATER_EQUAL (host -> serviceTime, currentPeer -> nextTimeout) &&
-            secudp_protocol_check_timeouts (host, currentPeer, event) == 1)
-        {
-            if (event != NULL && event -> type != SECUDP_EVENT_TYPE_NONE)
-              return 1;
-            else
-              continue;
-        }
+    if (currentPeer -> acknowledgementCount > 0)
+      secudp_protocol_send_acknowledgements (host, currentPeer);
 
-        if ((secudp_list_empty (& currentPeer -> outgoingCommands) ||
-              secudp_protocol_check_outgoing_commands (host, currentPeer)) &&
-            secudp_list_empty (& currentPeer -> sentReliableCommands) &&
-            SECUDP_TIME_DIFFERENCE (host -> serviceTime, currentPeer -> lastReceiveTime) >= currentPeer -> pingInterval &&
-            currentPeer -> mtu - host -> packetSize >= sizeof (SecUdpProtocolPing))
-        { 
-            secudp_peer_ping (currentPeer);
-            secudp_protocol_check_outgoing_commands (host, currentPeer);
-        }
+    if (checkForTimeouts != 0 &&
+        ! secudp_list_empty (& currentPeer -> sentReliableCommands) &&
+        SECUDP_TIME_GREATER_EQUAL (host -> serviceTime, currentPeer -> nextTimeout) &&
+        secudp_protocol_check_timeouts (host, currentPeer, event) == 1)
+    {
+        if (event != NULL && event -> type != SECUDP_EVENT_TYPE_NONE)
+          return 1;
+        else
+          return 0;
+    }
 
-        if (host -> commandCount == 0)
-          continue;
+    if ((secudp_list_empty (& currentPeer -> outgoingCommands) ||
+          secudp_protocol_check_outgoing_commands (host, currentPeer)) &&
+        secudp_list_empty (& currentPeer -> sentReliableCommands) &&
+        SECUDP_TIME_DIFFERENCE (host -> serviceTime, currentPeer -> lastReceiveTime) >= currentPeer -> pingInterval &&
+        currentPeer -> mtu - host -> packetSize >= sizeof (SecUdpProtocolPing))
+    { 
+        secudp_peer_ping (currentPeer);
+        secudp_protocol_check_outgoing_commands (host, currentPeer);
+    }
 
-        if (currentPeer -> packetLossEpoch == 0)
-          currentPeer -> packetLossEpoch = host -> serviceTime;
-        else
-        if (SECUDP_TIME_DIFFERENCE (host -> serviceTime, currentPeer -> packetLossEpoch) >= SECUDP_PEER_PACKET_LOSS_INTERVAL &&
-            currentPeer -> packetsSent > 0)
-        {
-           secudp_uint32 packetLoss = currentPeer -> packetsLost * SECUDP_PEER_PACKET_LOSS_SCALE / currentPeer -> packetsSent;
+    if (host -> commandCount == 0)
+      return 0;
+
+    if (currentPeer -> packetLossEpoch == 0)
+      currentPeer -> packetLossEpoch = host -> serviceTime;
+    else
+    if (SECUDP_TIME_DIFFERENCE (host -> serviceTime, currentPeer -> packetLossEpoch) >= SECUDP_PEER_PACKET_LOSS_INTERVAL &&
+        currentPeer -> packetsSent > 0)
+    {
+       secudp_uint32 packetLoss = currentPeer -> packetsLost * SECUDP_PEER_PACKET_LOSS_SCALE / currentPeer -> packetsSent;
 
 #ifdef SECUDP_DEBUG
-           printf ("peer %u: %f%%+-%f%% packet loss, %u+-%u ms round trip time, %f%% throttle, %u outgoing, %u/%u incoming\n", currentPeer -> incomingPeerID, currentPeer -> packetLoss / (float) SECUDP_PEER_PACKET_LOSS_SCALE, currentPeer -> packetLossVariance / (float) SECUDP_PEER_PACKET_LOSS_SCALE, currentPeer -> roundTripTime, currentPeer -> roundTripTimeVariance, currentPeer -> packetThrottle / (float) SECUDP_PEER_PACKET_THROTTLE_SCALE, secudp_list_size (& currentPeer -> outgoingCommands), currentPeer -> channels != NULL ? secudp_list_size (& currentPeer -> channels -> incomingReliableCommands) : 0, currentPeer -> channels != NULL ? secudp_list_size (& currentPeer -> channels -> incomingUnreliableCommands) : 0);
+       printf ("peer %u: %f%%+-%f%% packet loss, %u+-%u ms round trip time, %f%% throttle, %u outgoing, %u/%u incoming\n", currentPeer -> incomingPeerID, currentPeer -> packetLoss / (float) SECUDP_PEER_PACKET_LOSS_SCALE, currentPeer -> packetLossVariance / (float) SECUDP_PEER_PACKET_LOSS_SCALE, currentPeer -> roundTripTime, currentPeer -> roundTripTimeVariance, currentPeer -> packetThrottle / (float) SECUDP_PEER_PACKET_THROTTLE_SCALE, secudp_list_size (& currentPeer -> outgoingCommands), currentPeer -> channels != NULL ? secudp_list_size (& currentPeer -> channels -> incomingReliableCommands) : 0, currentPeer -> channels != NULL ? secudp_list_size (& currentPeer -> channels -> incomingUnreliableCommands) : 0);
 #endif
 
-           currentPeer -> packetLossVariance = (currentPeer -> packetLossVariance * 3 + SECUDP_DIFFERENCE (packetLoss, currentPeer -> packetLoss)) / 4;
-           currentPeer -> packetLoss = (currentPeer -> packetLoss * 7 + packetLoss) / 8;
+       currentPeer -> packetLossVariance = (currentPeer -> packetLossVariance * 3 + SECUDP_DIFFERENCE (packetLoss, currentPeer -> packetLoss)) / 4;
+       currentPeer -> packetLoss = (currentPeer -> packetLoss * 7 + packetLoss) / 8;
 
-           currentPeer -> packetLossEpoch = host -> serviceTime;
-           currentPeer -> packetsSent = 0;
-           currentPeer -> packetsLost = 0;
-        }
+       currentPeer -> packetLossEpoch = host -> serviceTime;
+       currentPeer -> packetsSent = 0;
+       currentPeer -> packetsLost = 0;
+    }
 
-        host -> buffers -> data = headerData;
-        if (host -> headerFlags & SECUDP_PROTOCOL_HEADER_FLAG_SENT_TIME)
-        {
-            header -> sentTime = SECUDP_HOST_TO_NET_16 (host -> serviceTime & 0xFFFF);
+    host -> buffers -> data = headerData;
+    if (host -> headerFlags & SECUDP_PROTOCOL_HEADER_FLAG_SENT_TIME)
+    {
+        header -> sentTime = SECUDP_HOST_TO_NET_16 (host -> serviceTime & 0xFFFF);
 
-            host -> buffers -> dataLength = sizeof (SecUdpProtocolHeader);
-        }
-        else
-          host -> buffers -> dataLength = (size_t) & ((SecUdpProtocolHeader *) 0) -> sentTime;
+        host -> buffers -> dataLength = sizeof (SecUdpProtocolHeader);
+    }
+    else
+      host -> buffers -> dataLength = (size_t) & ((SecUdpProtocolHeader *) 0) -> sentTime;
 
-        shouldCompress = 0;
-        if (host -> compressor.context != NULL && host -> compressor.compress != NULL)
+    shouldCompress = 0;
+    if (host -> compressor.context != NULL && host -> compressor.compress != NULL)
+    {
+        size_t originalSize = host -> packetSize - sizeof(SecUdpProtocolHeader) - (currentPeer -> flags & SECUDP_PEER_FLAG_SEAL_DATAGRAMS ? SECUDP_DATAGRAM_SEALBYTES : 0),
+               compressedSize = host -> compressor.compress (host -> compressor.context,
+                                    & host -> buffers [1], host -> bufferCount - 1,
+                                    originalSize,
+                                    host -> packetData [1],
+                                    originalSize);
+        if (compressedSize > 0 && compressedSize < originalSize)
         {
-            size_t originalSize = host -> packetSize - sizeof(SecUdpProtocolHeader),
-                   compressedSize = host -> compressor.compress (host -> compressor.context,
-                                        & host -> buffers [1], host -> bufferCount - 1,
-                                        originalSize,
-                                        host -> packetData [1],
-                                        originalSize);
-            if (compressedSize > 0 && compressedSize < originalSize)
-            {
-                host -> headerFlags |= SECUDP_PROTOCOL_HEADER_FLAG_COMPRESSED;
-                shouldCompress = compressedSize;
+            host -> headerFlags |= SECUDP_PROTOCOL_HEADER_FLAG_COMPRESSED;
+            shouldCompress = compressedSize;
 #ifdef SECUDP_DEBUG_COMPRESS
-                printf ("peer %u: compressed %u -> %u (%u%%)\n", currentPeer -> incomingPeerID, originalSize, compressedSize, (compressedSize * 100) / originalSize);
+            printf ("peer %u: compressed %u -> %u (%u%%)\n", currentPeer -> incomingPeerID, originalSize, compressedSize, (compressedSize * 100) / originalSize);
 #endif
-            }
         }
+    }
+
+    if (currentPeer -> outgoingPeerID < SECUDP_PROTOCOL_MAXIMUM_PEER_ID)
+      host -> headerFlags |= currentPeer -> outgoingSessionID << SECUDP_PROTOCOL_HEADER_SESSION_SHIFT;
+    header -> peerID = SECUDP_HOST_TO_NET_16 (currentPeer -> outgoingPeerID | host -> headerFlags);
+    if (host -> checksum != NULL)
+    {
+        secudp_uint32 * checksum = (secudp_uint32 *) & headerData [host -> buffers -> dataLength];
+        * checksum = currentPeer -> outgoingPeerID < SECUDP_PROTOCOL_MAXIMUM_PEER_ID ? currentPeer -> connectID : 0;
+        host -> buffers -> dataLength += sizeof (secudp_uint32);
+        * checksum = host -> checksum (host -> buffers, host -> bufferCount);
+    }
+
+    if (shouldCompress > 0)
+    {
+        host -> buffers [1].data = host -> packetData [1];
+        host -> buffers [1].dataLength = shouldCompress;
+        host -> bufferCount = 2;
+    }
+
+    if (currentPeer -> flags & SECUDP_PEER_FLAG_SEAL_OUTGOING)
+      secudp_protocol_seal_datagram (host, currentPeer);
+
+    currentPeer -> lastSendTime = host -> serviceTime;
+
+    if (currentPeer -> flags & SECUDP_PEER_FLAG_PATH_PENDING)
+      currentPeer -> pathDataSent += host -> packetSize;
+
+    if (secudp_protocol_stage_datagram (host, currentPeer) < 0)
+      return -1;
+
+    secudp_protocol_remove_sent_unreliable_commands (currentPeer);
+
+    return 0;
+}
+
+/*
+ *  Sets the timer of a peer after it was visited: when its
+ *  retransmission timeout passes or, with nothing in flight,
+ *  when it is due a ping. One already due is put off to the
+ *  next service time, so a peer whose resend was skipped by a
+ *  flush is not visited again in the same pass.
+ */
+static void
+secudp_protocol_schedule_peer (SecUdpHost * host, SecUdpPeer * peer)
+{
+    secudp_uint32 deadline;
 
-        if (currentPeer -> outgoingPeerID < SECUDP_PROTOCOL_MAXIMUM_PEER_ID)
-          host -> headerFlags |= currentPeer -> outgoingSessionID << SECUDP_PROTOCOL_HEADER_SESSION_SHIFT;
-        header -> peerID = SECUDP_HOST_TO_NET_16 (currentPeer -> outgoingPeerID | host -> headerFlags);
-        if (host -> checksum != NULL)
+    if (peer -> state == SECUDP_PEER_STATE_DISCONNECTED ||
+        peer -> state == SECUDP_PEER_STATE_ZOMBIE)
+    {
+       secudp_peer_unschedule (peer);
+
+       return;
+    }
+
+    if (! secudp_list_empty (& peer -> sentReliableCommands))
+    {
+       if (SECUDP_TIME_GREATER_EQUAL (host -> serviceTime, peer -> nextTimeout))
+         deadline = host -> serviceTime + 1;
+       else
+         deadline = peer -> nextTimeout;
+    }
+    else
+    {
+       if (SECUDP_TIME_DIFFERENCE (host -> serviceTime, peer -> lastReceiveTime) >= peer -> pingInterval)
+         deadline = host -> serviceTime + 1;
+       else
+         deadline = peer -> lastReceiveTime + peer -> pingInterval;
+    }
+
+    if (peer -> flags & SECUDP_PEER_FLAG_PATH_PENDING)
+    {
+       secudp_uint32 pathDeadline = peer -> pathChallengeTime + SECUDP_PEER_PATH_CHALLENGE_TIMEOUT;
+
+       if (SECUDP_TIME_LESS_EQUAL (pathDeadline, host -> serviceTime))
+         pathDeadline = host -> serviceTime + 1;
+
+       if (SECUDP_TIME_LESS (pathDeadline, deadline))
+         deadline = pathDeadline;
+    }
+
+    secudp_peer_schedule (peer, deadline);
+}
+
+static int
+secudp_protocol_send_outgoing_commands (SecUdpHost * host, SecUdpEvent * event, int checkForTimeouts)
+{
+    if (host -> cryptoPool != NULL)
+      secudp_host_crypto_pool_complete_seals (host);
+
+    /*
+     *  Only peers with something new to send and peers whose timer
+     *  is due get visited, instead of every peer slot. A peer that
+     *  filled a datagram and has more goes to the back of the send
+     *  queue, so peers take turns as they did. Addition to ENet.
+     */
+    for (;;)
+    {
+        SecUdpPeer * currentPeer;
+        int result;
+
+        if (! secudp_list_empty (& host -> sendQueue))
         {
-            secudp_uint32 * checksum = (secudp_uint32 *) & headerData [host -> buffers -> dataLength];
-            * checksum = currentPeer -> outgoingPeerID < SECUDP_PROTOCOL_MAXIMUM_PEER_ID ? currentPeer -> connectID : 0;
-            host -> buffers -> dataLength += sizeof (secudp_uint32);
-            * checksum = host -> checksum (host -> buffers, host -> bufferCount);
+            currentPeer = (SecUdpPeer *) ((secudp_uint8 *) secudp_list_front (& host -> sendQueue) - offsetof (SecUdpPeer, sendList));
+
+            secudp_list_remove (& currentPeer -> sendList);
+            currentPeer -> flags &= ~ SECUDP_PEER_FLAG_NEEDS_SEND;
         }
+        else
+        if (host -> peerTimerCount > 0 &&
+            SECUDP_TIME_LESS_EQUAL (host -> peerTimers [0] -> timerDeadline, host -> serviceTime))
+          currentPeer = host -> peerTimers [0];
+        else
+          break;
 
-        if (shouldCompress > 0)
+        if (currentPeer -> state == SECUDP_PEER_STATE_DISCONNECTED ||
+            currentPeer -> state == SECUDP_PEER_STATE_ZOMBIE)
         {
-            host -> buffers [1].data = host -> packetData [1];
-            host -> buffers [1].dataLength = shouldCompress;
-            host -> bufferCount = 2;
+            secudp_peer_unschedule (currentPeer);
+
+            continue;
         }
 
-        currentPeer -> lastSendTime = host -> serviceTime;
+        host -> continueSending = 0;
 
-        sentLength = secudp_socket_send (host -> socket, & currentPeer -> address, host -> buffers, host -> bufferCount);
+        result = secudp_protocol_send_peer (host, currentPeer, event, checkForTimeouts);
 
-        secudp_protocol_remove_sent_unreliable_commands (currentPeer);
+        /* A ping queued while visiting the peer has already gone out with its datagram. */
+        if (currentPeer -> flags & SECUDP_PEER_FLAG_NEEDS_SEND)
+        {
+            secudp_list_remove (& currentPeer -> sendList);
+            currentPeer -> flags &= ~ SECUDP_PEER_FLAG_NEEDS_SEND;
+        }
+
+        if (host -> continueSending)
+          secudp_peer_queue_send (currentPeer);
 
-        if (sentLength < 0)
+        secudp_protocol_schedule_peer (host, currentPeer);
+
+        if (result < 0)
           return -1;
 
-        host -> totalSentData += sentLength;
-        host -> totalSentPackets ++;
+        if (result > 0)
+          return secudp_protocol_flush_send_batch (host) < 0 ? -1 : 1;
     }
-   
-    return 0;
+
+    return secudp_protocol_flush_send_batch (host);
 }
 
 /** Sends any queued packets on the host specified to its designated peers.
@@ -1781,6 +2725,52 @@ secudp_host_check_events (SecUdpHost * host, SecUdpEvent * event)
     return secudp_protocol_dispatch_incoming_commands (host, event);
 }
 
+/** Returns how long a host may go without being serviced, unless its socket
+    becomes readable, before it has to resend, ping or time out a peer.
+
+    @param host    host to check
+    @returns the number of milliseconds until the earliest deadline of the host,
+    or 0 if secudp_host_service() should be called right away
+    @remarks Together with host -> socket, or secudp_uring_socket (host -> uring) while the host
+    uses io_uring, this lets an event loop wait on many hosts at once and call secudp_host_service()
+    with a timeout of 0 only on hosts whose socket is readable or whose deadline has passed.
+    @ingroup host
+*/
+secudp_uint32
+secudp_host_next_timeout (SecUdpHost * host)
+{
+    return secudp_host_next_timeout_at (host, secudp_time_get ());
+}
+
+/*
+ *  Same as secudp_host_next_timeout() but measured from currentTime,
+ *  so a caller checking many hosts reads the clock only once.
+ */
+secudp_uint32
+secudp_host_next_timeout_at (SecUdpHost * host, secudp_uint32 currentTime)
+{
+    secudp_uint32 deadline = host -> bandwidthThrottleEpoch + SECUDP_HOST_BANDWIDTH_THROTTLE_INTERVAL;
+
+    if (! secudp_list_empty (& host -> dispatchQueue) ||
+        ! secudp_list_empty (& host -> sendQueue) ||
+        host -> receiveBatch -> index < host -> receiveBatch -> count ||
+        (host -> uring != NULL && secudp_uring_ready (host -> uring)))
+      return 0;
+
+    if (host -> cryptoPool != NULL && host -> cryptoPool -> pending > 0 &&
+        SECUDP_TIME_LESS (currentTime + SECUDP_HOST_CRYPTO_POLL_INTERVAL, deadline))
+      deadline = currentTime + SECUDP_HOST_CRYPTO_POLL_INTERVAL;
+
+    if (host -> peerTimerCount > 0 &&
+        SECUDP_TIME_LESS (host -> peerTimers [0] -> timerDeadline, deadline))
+      deadline = host -> peerTimers [0] -> timerDeadline;
+
+    if (SECUDP_TIME_GREATER_EQUAL (currentTime, deadline))
+      return 0;
+
+    return SECUDP_TIME_DIFFERENCE (deadline, currentTime);
+}
+
 /** Waits for events on the host specified and shuttles packets between
     the host and its peers.
 
@@ -1797,7 +2787,7 @@ secudp_host_check_events (SecUdpHost * host, SecUdpEvent * event)
 int
 secudp_host_service (SecUdpHost * host, SecUdpEvent * event, secudp_uint32 timeout)
 {
-    secudp_uint32 waitCondition;
+    secudp_uint32 waitCondition, waitTime;
 
     if (event != NULL)
     {
@@ -1901,6 +2891,8 @@ secudp_host_service (SecUdpHost * host, SecUdpEvent * event, secudp_uint32 timeo
        if (SECUDP_TIME_GREATER_EQUAL (host -> serviceTime, timeout))
          return 0;
 
+       secudp_host_kx_pool_refill (host, timeout);
+
        do
        {
           host -> serviceTime = secudp_time_get ();
@@ -1909,14 +2901,31 @@ secudp_host_service (SecUdpHost * host, SecUdpEvent * event, secudp_uint32 timeo
             return 0;
 
           waitCondition = SECUDP_SOCKET_WAIT_RECEIVE | SECUDP_SOCKET_WAIT_INTERRUPT;
-
-          if (secudp_socket_wait (host -> socket, & waitCondition, SECUDP_TIME_DIFFERENCE (timeout, host -> serviceTime)) != 0)
+          waitTime = SECUDP_TIME_DIFFERENCE (timeout, host -> serviceTime);
+
+          /*
+           *  Workers signal nothing when they finish, so poll
+           *  for their results while any are outstanding.
+           */
+          if (host -> cryptoPool != NULL && host -> cryptoPool -> pending > 0 && waitTime > SECUDP_HOST_CRYPTO_POLL_INTERVAL)
+            waitTime = SECUDP_HOST_CRYPTO_POLL_INTERVAL;
+
+          /*
+           *  Completions the io_uring already holds leave nothing
+           *  to wait for; otherwise wait on the ring, since the
+           *  socket itself is drained by the multishot receive.
+           */
+          if (host -> uring != NULL && secudp_uring_ready (host -> uring))
+            waitCondition = SECUDP_SOCKET_WAIT_RECEIVE;
+          else
+          if (secudp_socket_wait (host -> uring != NULL ? secudp_uring_socket (host -> uring) : host -> socket, & waitCondition, waitTime) != 0)
             return -1;
        }
        while (waitCondition & SECUDP_SOCKET_WAIT_INTERRUPT);
 
        host -> serviceTime = secudp_time_get ();
-    } while (waitCondition & SECUDP_SOCKET_WAIT_RECEIVE);
+    } while ((waitCondition & SECUDP_SOCKET_WAIT_RECEIVE) ||
+             (host -> cryptoPool != NULL && host -> cryptoPool -> pending > 0));
 
     return 0; 
 }
@@ -0,0 +1,342 @@
+/**
+ @file  reactor.c
+ @brief SecUdp multi-host reactor functions
+*/
+#define SECUDP_BUILDING_LIB 1
+#include <errno.h>
+#include <string.h>
+#include "secudp/secudp.h"
+#include "secudp/time.h"
+
+#if ! defined (_WIN32) && defined (HAS_EPOLL)
+#include <sys/epoll.h>
+#include <unistd.h>
+#endif
+
+/** @defgroup reactor SecUdp reactor functions
+    @{
+*/
+
+/*
+ *  Descriptor that becomes readable when a host has datagrams
+ *  to receive, which is its io_uring while it uses one.
+ */
+static SecUdpSocket
+secudp_reactor_host_socket (SecUdpHost * host)
+{
+    return host -> uring != NULL ? secudp_uring_socket (host -> uring) : host -> socket;
+}
+
+/** Creates a reactor to service many hosts from one thread.
+    @param maximumHosts maximum number of hosts that may be added to the reactor
+    @returns the reactor on success and NULL on failure
+*/
+SecUdpReactor *
+secudp_reactor_create (size_t maximumHosts)
+{
+    SecUdpReactor * reactor;
+
+    if (maximumHosts == 0)
+      return NULL;
+
+    reactor = (SecUdpReactor *) secudp_malloc (sizeof (SecUdpReactor));
+    if (reactor == NULL)
+      return NULL;
+
+    reactor -> hosts = (SecUdpReactorHost *) secudp_malloc (maximumHosts * sizeof (SecUdpReactorHost));
+    if (reactor -> hosts == NULL)
+    {
+       secudp_free (reactor);
+
+       return NULL;
+    }
+
+    reactor -> hostCount = 0;
+    reactor -> maximumHosts = maximumHosts;
+    reactor -> nextHost = 0;
+    reactor -> pollSocket = -1;
+
+#if ! defined (_WIN32) && defined (HAS_EPOLL)
+    reactor -> pollSocket = epoll_create1 (EPOLL_CLOEXEC);
+    if (reactor -> pollSocket < 0)
+    {
+       secudp_free (reactor -> hosts);
+       secudp_free (reactor);
+
+       return NULL;
+    }
+#endif
+
+    return reactor;
+}
+
+/** Destroys a reactor. The hosts added to it are left as they are.
+    @param reactor reactor to destroy
+*/
+void
+secudp_reactor_destroy (SecUdpReactor * reactor)
+{
+    if (reactor == NULL)
+      return;
+
+#if ! defined (_WIN32) && defined (HAS_EPOLL)
+    close (reactor -> pollSocket);
+#endif
+
+    secudp_free (reactor -> hosts);
+    secudp_free (reactor);
+}
+
+/** Adds a host to a reactor.
+    @param reactor reactor to add the host to
+    @param host host to add, which from now on should only be serviced through the reactor,
+    and which should not switch to or from io_uring while added
+    @retval 0 on success
+    @retval < 0 on failure
+*/
+int
+secudp_reactor_add (SecUdpReactor * reactor, SecUdpHost * host)
+{
+    SecUdpReactorHost * reactorHost;
+
+    if (reactor -> hostCount >= reactor -> maximumHosts)
+      return -1;
+
+#if ! defined (_WIN32) && defined (HAS_EPOLL)
+    {
+       struct epoll_event pollEvent;
+
+       memset (& pollEvent, 0, sizeof (pollEvent));
+       pollEvent.events = EPOLLIN;
+       pollEvent.data.u64 = reactor -> hostCount;
+
+       if (epoll_ctl (reactor -> pollSocket, EPOLL_CTL_ADD, secudp_reactor_host_socket (host), & pollEvent) < 0)
+         return -1;
+    }
+#endif
+
+    reactorHost = & reactor -> hosts [reactor -> hostCount ++];
+    reactorHost -> host = host;
+    reactorHost -> ready = 1;
+
+    return 0;
+}
+
+/** Removes a host from a reactor.
+    @param reactor reactor to remove the host from
+    @param host host to remove
+*/
+void
+secudp_reactor_remove (SecUdpReactor * reactor, SecUdpHost * host)
+{
+    SecUdpReactorHost * reactorHost;
+
+    for (reactorHost = reactor -> hosts;
+         reactorHost < & reactor -> hosts [reactor -> hostCount];
+         ++ reactorHost)
+    {
+       if (reactorHost -> host != host)
+         continue;
+
+#if ! defined (_WIN32) && defined (HAS_EPOLL)
+       epoll_ctl (reactor -> pollSocket, EPOLL_CTL_DEL, secudp_reactor_host_socket (host), NULL);
+#endif
+
+       * reactorHost = reactor -> hosts [-- reactor -> hostCount];
+
+#if ! defined (_WIN32) && defined (HAS_EPOLL)
+       /* The last host moved into this slot, so its events must carry the new index. */
+       if (reactorHost < & reactor -> hosts [reactor -> hostCount])
+       {
+          struct epoll_event pollEvent;
+
+          memset (& pollEvent, 0, sizeof (pollEvent));
+          pollEvent.events = EPOLLIN;
+          pollEvent.data.u64 = reactorHost - reactor -> hosts;
+
+          epoll_ctl (reactor -> pollSocket, EPOLL_CTL_MOD, secudp_reactor_host_socket (reactorHost -> host), & pollEvent);
+       }
+#endif
+
+       if (reactor -> nextHost >= reactor -> hostCount)
+         reactor -> nextHost = 0;
+
+       return;
+    }
+}
+
+/*
+ *  Waits up to timeout for any socket of the reactor to become
+ *  readable and flags those hosts ready.
+ */
+static int
+secudp_reactor_wait (SecUdpReactor * reactor, secudp_uint32 timeout)
+{
+#if ! defined (_WIN32) && defined (HAS_EPOLL)
+    struct epoll_event pollEvents [SECUDP_REACTOR_WAIT_EVENTS];
+    int pollCount, pollIndex;
+
+    pollCount = epoll_wait (reactor -> pollSocket, pollEvents, SECUDP_REACTOR_WAIT_EVENTS, (int) timeout);
+    if (pollCount < 0)
+      return errno == EINTR ? 0 : -1;
+
+    for (pollIndex = 0; pollIndex < pollCount; ++ pollIndex)
+    {
+       secudp_uint64 hostIndex = pollEvents [pollIndex].data.u64;
+
+       if (hostIndex < reactor -> hostCount)
+         reactor -> hosts [hostIndex].ready = 1;
+    }
+
+    return 0;
+#else
+    SecUdpSocketSet readSet;
+    SecUdpSocket maxSocket = 0;
+    SecUdpReactorHost * reactorHost;
+    int selectCount;
+
+    SECUDP_SOCKETSET_EMPTY (readSet);
+
+    for (reactorHost = reactor -> hosts;
+         reactorHost < & reactor -> hosts [reactor -> hostCount];
+         ++ reactorHost)
+    {
+       SecUdpSocket socket = secudp_reactor_host_socket (reactorHost -> host);
+
+       SECUDP_SOCKETSET_ADD (readSet, socket);
+
+       if (socket > maxSocket)
+         maxSocket = socket;
+    }
+
+    selectCount = secudp_socketset_select (maxSocket, & readSet, NULL, timeout);
+    if (selectCount <= 0)
+      return selectCount;
+
+    for (reactorHost = reactor -> hosts;
+         reactorHost < & reactor -> hosts [reactor -> hostCount];
+         ++ reactorHost)
+    {
+       if (SECUDP_SOCKETSET_CHECK (readSet, secudp_reactor_host_socket (reactorHost -> host)))
+         reactorHost -> ready = 1;
+    }
+
+    return 0;
+#endif
+}
+
+/*
+ *  Services ready hosts, starting after the one that produced
+ *  the last event, until one produces an event. A host stays
+ *  ready until servicing it produces nothing.
+ */
+static int
+secudp_reactor_dispatch (SecUdpReactor * reactor, SecUdpEvent * event, SecUdpHost ** eventHost)
+{
+    size_t hostIndex, hostCount;
+
+    for (hostCount = 0, hostIndex = reactor -> nextHost;
+         hostCount < reactor -> hostCount;
+         ++ hostCount, hostIndex = (hostIndex + 1) % reactor -> hostCount)
+    {
+       SecUdpReactorHost * reactorHost = & reactor -> hosts [hostIndex];
+
+       if (! reactorHost -> ready)
+         continue;
+
+       switch (secudp_host_service (reactorHost -> host, event, 0))
+       {
+       case 1:
+          if (eventHost != NULL)
+            * eventHost = reactorHost -> host;
+
+          reactor -> nextHost = (hostIndex + 1) % reactor -> hostCount;
+
+          return 1;
+
+       case -1:
+          return -1;
+
+       default:
+          reactorHost -> ready = 0;
+          break;
+       }
+    }
+
+    return 0;
+}
+
+/** Waits for events on every host of a reactor, servicing only the hosts whose
+    socket is readable or whose deadline from secudp_host_next_timeout() has passed.
+    @param reactor reactor to service
+    @param event an event structure where event details will be placed if one occurs
+    @param eventHost if not NULL, holds the host the event occurred on
+    @param timeout number of milliseconds that SecUdp should wait for events
+    @retval > 0 if an event occurred within the specified time limit
+    @retval 0 if no event occurred
+    @retval < 0 on failure
+    @sa secudp_host_service()
+*/
+int
+secudp_reactor_service (SecUdpReactor * reactor, SecUdpEvent * event, SecUdpHost ** eventHost, secudp_uint32 timeout)
+{
+    secudp_uint32 deadline = secudp_time_get () + timeout;
+
+    do
+    {
+       secudp_uint32 currentTime = secudp_time_get (),
+                     waitTime = SECUDP_TIME_LESS (currentTime, deadline) ? SECUDP_TIME_DIFFERENCE (deadline, currentTime) : 0;
+       SecUdpReactorHost * reactorHost;
+
+       for (reactorHost = reactor -> hosts;
+            reactorHost < & reactor -> hosts [reactor -> hostCount];
+            ++ reactorHost)
+       {
+          secudp_uint32 hostTimeout;
+
+          if (reactorHost -> ready)
+          {
+             waitTime = 0;
+
+             continue;
+          }
+
+          hostTimeout = secudp_host_next_timeout_at (reactorHost -> host, currentTime);
+          if (hostTimeout == 0)
+            reactorHost -> ready = 1;
+
+          if (hostTimeout < waitTime)
+            waitTime = hostTimeout;
+       }
+
+       if (secudp_reactor_wait (reactor, waitTime) < 0)
+         return -1;
+
+       currentTime = secudp_time_get ();
+
+       for (reactorHost = reactor -> hosts;
+            reactorHost < & reactor -> hosts [reactor -> hostCount];
+            ++ reactorHost)
+       {
+          if (! reactorHost -> ready && secudp_host_next_timeout_at (reactorHost -> host, currentTime) == 0)
+            reactorHost -> ready = 1;
+       }
+
+       switch (secudp_reactor_dispatch (reactor, event, eventHost))
+       {
+       case 1:
+          return 1;
+
+       case -1:
+          return -1;
+
+       default:
+          break;
+       }
+    }
+    while (SECUDP_TIME_LESS (secudp_time_get (), deadline));
+
+    return 0;
+}
+
+/** @} */
@@ -0,0 +1,675 @@
+/**
+ @file  shard.c
+ @brief SecUdp sharded host functions
+*/
+#define SECUDP_BUILDING_LIB 1
+#include <string.h>
+#include "secudp/secudp.h"
+#include "secudp/time.h"
+
+/** @defgroup shard SecUdp sharded host functions
+    @{
+*/
+
+/*
+ *  Wakes a shard thread out of its wait so that it services its host
+ *  right away. Called with the shard's mutex held; one unread datagram
+ *  is enough, so further calls send nothing until the thread reads it.
+ */
+static void
+secudp_sharded_host_wake (SecUdpHostShard * shard)
+{
+    SecUdpBuffer buffer;
+    secudp_uint8 data = 0;
+
+    if (shard -> wakePending)
+      return;
+
+    buffer.data = & data;
+    buffer.dataLength = sizeof (data);
+
+    if (secudp_socket_send (shard -> wakeSocket, & shard -> wakeAddress, & buffer, 1) > 0)
+      shard -> wakePending = 1;
+}
+
+static void
+secudp_sharded_host_drain_wake (SecUdpHostShard * shard)
+{
+    SecUdpBuffer buffer;
+    secudp_uint8 data [16];
+
+    buffer.data = data;
+    buffer.dataLength = sizeof (data);
+
+    while (secudp_socket_receive (shard -> wakeSocket, NULL, & buffer, 1) > 0)
+      ;
+
+    shard -> wakePending = 0;
+}
+
+/*
+ *  Holds a slot of the event ring for the event the next service
+ *  call may produce, so that it never has to be dropped. Fails and
+ *  marks the shard stalled while the ring is full.
+ */
+static int
+secudp_sharded_host_reserve_event (SecUdpHostShard * shard)
+{
+    SecUdpShardedHost * shardedHost = shard -> shardedHost;
+    int result = 0;
+
+    secudp_mutex_lock (& shardedHost -> eventMutex);
+
+    if (shardedHost -> eventCount + shardedHost -> eventsReserved >= shardedHost -> eventCapacity)
+    {
+       shard -> stalled = 1;
+
+       result = -1;
+    }
+    else
+      ++ shardedHost -> eventsReserved;
+
+    secudp_mutex_unlock (& shardedHost -> eventMutex);
+
+    return result;
+}
+
+static void
+secudp_sharded_host_release_event (SecUdpHostShard * shard)
+{
+    SecUdpShardedHost * shardedHost = shard -> shardedHost;
+
+    secudp_mutex_lock (& shardedHost -> eventMutex);
+    -- shardedHost -> eventsReserved;
+    secudp_mutex_unlock (& shardedHost -> eventMutex);
+}
+
+/*
+ *  Queues an event into the slot reserved for it.
+ */
+static void
+secudp_sharded_host_queue_event (SecUdpHostShard * shard, const SecUdpEvent * event)
+{
+    SecUdpShardedHost * shardedHost = shard -> shardedHost;
+    SecUdpShardEvent * shardEvent;
+    size_t peerIndex = event -> peer - shard -> host -> peers;
+    secudp_uint32 connectID;
+
+    /* The peer is already reset by its disconnect event, so use the recorded connectID. */
+    switch (event -> type)
+    {
+    case SECUDP_EVENT_TYPE_CONNECT:
+       connectID = shard -> connectIDs [peerIndex] = event -> peer -> connectID;
+       break;
+
+    case SECUDP_EVENT_TYPE_DISCONNECT:
+       connectID = shard -> connectIDs [peerIndex];
+       shard -> connectIDs [peerIndex] = 0;
+       break;
+
+    default:
+       connectID = event -> peer -> connectID;
+       break;
+    }
+
+    secudp_mutex_lock (& shardedHost -> eventMutex);
+
+    shardEvent = & shardedHost -> events [(shardedHost -> eventHead + shardedHost -> eventCount) % shardedHost -> eventCapacity];
+    shardEvent -> event = * event;
+    shardEvent -> connectID = connectID;
+
+    ++ shardedHost -> eventCount;
+    -- shardedHost -> eventsReserved;
+
+    secudp_condition_signal (& shardedHost -> eventCondition);
+
+    secudp_mutex_unlock (& shardedHost -> eventMutex);
+}
+
+static void SECUDP_CALLBACK
+secudp_sharded_host_thread (void * data)
+{
+    SecUdpHostShard * shard = (SecUdpHostShard *) data;
+    SecUdpEvent event;
+    int reserved = 0, woken = 0;
+
+    secudp_mutex_lock (& shard -> mutex);
+
+    while (shard -> running)
+    {
+       SecUdpSocket socket = shard -> host -> uring != NULL ? secudp_uring_socket (shard -> host -> uring) : shard -> host -> socket,
+                    maxSocket = shard -> wakeSocket;
+       SecUdpSocketSet readSet;
+       secudp_uint32 waitTime;
+       int stalled = 0;
+
+       if (woken)
+         secudp_sharded_host_drain_wake (shard);
+
+       for (;;)
+       {
+          if (! reserved)
+          {
+             if (secudp_sharded_host_reserve_event (shard) < 0)
+             {
+                stalled = 1;
+
+                break;
+             }
+
+             reserved = 1;
+          }
+
+          if (secudp_host_service (shard -> host, & event, 0) <= 0)
+            break;
+
+          secudp_sharded_host_queue_event (shard, & event);
+
+          reserved = 0;
+       }
+
+       SECUDP_SOCKETSET_EMPTY (readSet);
+       SECUDP_SOCKETSET_ADD (readSet, shard -> wakeSocket);
+
+       /*
+        *  A stalled shard leaves its host alone until an event is taken
+        *  and it is woken, checking again now and then in case the wake
+        *  datagram could not be sent.
+        */
+       if (stalled)
+         waitTime = SECUDP_HOST_BANDWIDTH_THROTTLE_INTERVAL;
+       else
+       {
+          SECUDP_SOCKETSET_ADD (readSet, socket);
+
+          if (socket > maxSocket)
+            maxSocket = socket;
+
+          waitTime = secudp_host_next_timeout (shard -> host);
+       }
+
+       /* Wait unlocked so other threads may queue sends meanwhile. */
+       secudp_mutex_unlock (& shard -> mutex);
+
+       woken = secudp_socketset_select (maxSocket, & readSet, NULL, waitTime) > 0 &&
+               SECUDP_SOCKETSET_CHECK (readSet, shard -> wakeSocket);
+
+       secudp_mutex_lock (& shard -> mutex);
+    }
+
+    secudp_mutex_unlock (& shard -> mutex);
+
+    if (reserved)
+      secudp_sharded_host_release_event (shard);
+}
+
+static void
+secudp_sharded_host_stop (SecUdpShardedHost * shardedHost)
+{
+    SecUdpHostShard * shard;
+
+    for (shard = shardedHost -> shards;
+         shard < & shardedHost -> shards [shardedHost -> shardCount];
+         ++ shard)
+    {
+       if (! shard -> running)
+         continue;
+
+       secudp_mutex_lock (& shard -> mutex);
+       shard -> running = 0;
+       secudp_sharded_host_wake (shard);
+       secudp_mutex_unlock (& shard -> mutex);
+
+       secudp_thread_join (shard -> thread);
+    }
+
+    shardedHost -> started = 0;
+}
+
+static int
+secudp_sharded_host_start (SecUdpShardedHost * shardedHost)
+{
+    SecUdpHostShard * shard;
+
+    for (shard = shardedHost -> shards;
+         shard < & shardedHost -> shards [shardedHost -> shardCount];
+         ++ shard)
+    {
+       shard -> running = 1;
+
+       if (secudp_thread_create (& shard -> thread, secudp_sharded_host_thread, shard) < 0)
+       {
+          shard -> running = 0;
+
+          secudp_sharded_host_stop (shardedHost);
+
+          return -1;
+       }
+    }
+
+    shardedHost -> started = 1;
+
+    return 0;
+}
+
+static SecUdpHostShard *
+secudp_sharded_host_peer_shard (SecUdpShardedHost * shardedHost, SecUdpPeer * peer)
+{
+    SecUdpHostShard * shard;
+
+    for (shard = shardedHost -> shards;
+         shard < & shardedHost -> shards [shardedHost -> shardCount];
+         ++ shard)
+    {
+       if (shard -> host == peer -> host)
+         return shard;
+    }
+
+    return NULL;
+}
+
+/*
+ *  Opens the loopback socket a shard thread is woken through.
+ */
+static int
+secudp_sharded_host_create_wake (SecUdpHostShard * shard)
+{
+    SecUdpAddress address;
+
+    shard -> wakeSocket = secudp_socket_create (SECUDP_SOCKET_TYPE_DATAGRAM);
+    if (shard -> wakeSocket == SECUDP_SOCKET_NULL)
+      return -1;
+
+    secudp_address_set_host_ip (& address, "127.0.0.1");
+    address.port = 0;
+
+    if (secudp_socket_set_option (shard -> wakeSocket, SECUDP_SOCKOPT_NONBLOCK, 1) < 0 ||
+        secudp_socket_bind (shard -> wakeSocket, & address) < 0 ||
+        secudp_socket_get_address (shard -> wakeSocket, & shard -> wakeAddress) < 0)
+    {
+       secudp_socket_destroy (shard -> wakeSocket);
+
+       return -1;
+    }
+
+    shard -> wakePending = 0;
+    shard -> stalled = 0;
+
+    return 0;
+}
+
+/** Creates a host split into shards that share one port.
+    @param address the address at which other peers may connect to this host; may not be NULL
+    @param secret the signing key pair every shard authenticates handshakes with
+    @param shardCount the number of shards, each with its own socket and service thread
+    @param peerCount the maximum number of peers that should be allocated for the host, divided among the shards
+    @param channelLimit the maximum number of channels allowed; if 0, then this is equivalent to SECUDP_PROTOCOL_MAXIMUM_CHANNEL_COUNT
+    @param incomingBandwidth downstream bandwidth of each shard in bytes/second; if 0, SecUdp will assume unlimited bandwidth.
+    @param outgoingBandwidth upstream bandwidth of each shard in bytes/second; if 0, SecUdp will assume unlimited bandwidth.
+
+    @returns the sharded host on success and NULL on failure
+
+    @remarks Every shard binds the same port with SO_REUSEPORT, so the kernel spreads incoming
+    datagrams across the shards by address and a peer always lands on the same shard. The shard
+    threads start with the first call to secudp_sharded_host_service(); until then the shard hosts
+    may be configured directly, and afterwards they may only be used through the sharded host.
+    Because shards are picked by address, a peer whose address changes, as when its NAT rebinds,
+    usually lands on a shard that does not know it, so peers of a sharded host cannot migrate to
+    a new address and time out instead.
+*/
+SecUdpShardedHost *
+secudp_sharded_host_create (const SecUdpAddress * address, const SecUdpHostSecret * secret, size_t shardCount, size_t peerCount,
+                            size_t channelLimit, secudp_uint32 incomingBandwidth, secudp_uint32 outgoingBandwidth)
+{
+    SecUdpShardedHost * shardedHost;
+    SecUdpAddress shardAddress;
+    size_t shardIndex;
+
+    if (address == NULL || shardCount == 0 || peerCount < shardCount)
+      return NULL;
+
+    shardedHost = (SecUdpShardedHost *) secudp_malloc (sizeof (SecUdpShardedHost));
+    if (shardedHost == NULL)
+      return NULL;
+    memset (shardedHost, 0, sizeof (SecUdpShardedHost));
+
+    shardedHost -> shards = (SecUdpHostShard *) secudp_malloc (shardCount * sizeof (SecUdpHostShard));
+    if (shardedHost -> shards == NULL)
+    {
+       secudp_free (shardedHost);
+
+       return NULL;
+    }
+    memset (shardedHost -> shards, 0, shardCount * sizeof (SecUdpHostShard));
+
+    if (secudp_mutex_create (& shardedHost -> eventMutex) < 0)
+    {
+       secudp_free (shardedHost -> shards);
+       secudp_free (shardedHost);
+
+       return NULL;
+    }
+
+    if (secudp_condition_create (& shardedHost -> eventCondition) < 0)
+    {
+       secudp_mutex_destroy (& shardedHost -> eventMutex);
+       secudp_free (shardedHost -> shards);
+       secudp_free (shardedHost);
+
+       return NULL;
+    }
+
+    shardedHost -> eventCapacity = shardCount * SECUDP_HOST_SHARD_EVENT_QUEUE_SIZE;
+    shardedHost -> events = (SecUdpShardEvent *) secudp_malloc (shardedHost -> eventCapacity * sizeof (SecUdpShardEvent));
+    if (shardedHost -> events == NULL)
+    {
+       secudp_condition_destroy (& shardedHost -> eventCondition);
+       secudp_mutex_destroy (& shardedHost -> eventMutex);
+       secudp_free (shardedHost -> shards);
+       secudp_free (shardedHost);
+
+       return NULL;
+    }
+
+    shardAddress = * address;
+
+    for (shardIndex = 0; shardIndex < shardCount; ++ shardIndex)
+    {
+       SecUdpHostShard * shard = & shardedHost -> shards [shardIndex];
+       size_t shardPeerCount = peerCount / shardCount + (shardIndex < peerCount % shardCount ? 1 : 0);
+
+       if (secudp_mutex_create (& shard -> mutex) < 0)
+         goto createError;
+
+       shard -> host = secudp_host_create (NULL, secret, shardPeerCount, channelLimit, incomingBandwidth, outgoingBandwidth);
+       if (shard -> host == NULL)
+       {
+          secudp_mutex_destroy (& shard -> mutex);
+
+          goto createError;
+       }
+
+       shard -> connectIDs = (secudp_uint32 *) secudp_malloc (shardPeerCount * sizeof (secudp_uint32));
+       if (shard -> connectIDs == NULL)
+       {
+          secudp_host_destroy (shard -> host);
+          secudp_mutex_destroy (& shard -> mutex);
+
+          goto createError;
+       }
+       memset (shard -> connectIDs, 0, shardPeerCount * sizeof (secudp_uint32));
+
+       if (secudp_sharded_host_create_wake (shard) < 0)
+       {
+          secudp_free (shard -> connectIDs);
+          secudp_host_destroy (shard -> host);
+          secudp_mutex_destroy (& shard -> mutex);
+
+          goto createError;
+       }
+
+       shard -> shardedHost = shardedHost;
+       shard -> running = 0;
+
+       ++ shardedHost -> shardCount;
+
+       if ((secudp_socket_set_option (shard -> host -> socket, SECUDP_SOCKOPT_REUSEPORT, 1) < 0 && shardCount > 1) ||
+           secudp_socket_bind (shard -> host -> socket, & shardAddress) < 0)
+         goto createError;
+
+       if (secudp_socket_get_address (shard -> host -> socket, & shard -> host -> address) < 0)
+         shard -> host -> address = shardAddress;
+
+       /* The remaining shards join whichever port the first was given. */
+       shardAddress.port = shard -> host -> address.port;
+    }
+
+    return shardedHost;
+
+createError:
+    secudp_sharded_host_destroy (shardedHost);
+
+    return NULL;
+}
+
+/** Destroys a sharded host, stopping its shard threads and destroying every shard.
+    @param shardedHost pointer to the sharded host to destroy
+*/
+void
+secudp_sharded_host_destroy (SecUdpShardedHost * shardedHost)
+{
+    SecUdpHostShard * shard;
+
+    if (shardedHost == NULL)
+      return;
+
+    secudp_sharded_host_stop (shardedHost);
+
+    for (shard = shardedHost -> shards;
+         shard < & shardedHost -> shards [shardedHost -> shardCount];
+         ++ shard)
+    {
+       secudp_host_destroy (shard -> host);
+       secudp_mutex_destroy (& shard -> mutex);
+       secudp_free (shard -> connectIDs);
+       secudp_socket_destroy (shard -> wakeSocket);
+    }
+
+    for (; shardedHost -> eventCount > 0; -- shardedHost -> eventCount)
+    {
+       SecUdpShardEvent * shardEvent = & shardedHost -> events [shardedHost -> eventHead];
+
+       if (shardEvent -> event.type == SECUDP_EVENT_TYPE_RECEIVE)
+         secudp_packet_destroy (shardEvent -> event.packet);
+
+       shardedHost -> eventHead = (shardedHost -> eventHead + 1) % shardedHost -> eventCapacity;
+    }
+
+    secudp_condition_destroy (& shardedHost -> eventCondition);
+    secudp_mutex_destroy (& shardedHost -> eventMutex);
+
+    secudp_free (shardedHost -> events);
+    secudp_free (shardedHost -> shards);
+    secudp_free (shardedHost);
+}
+
+/** Waits for events from any shard of a sharded host.
+    @param shardedHost sharded host to service
+    @param event an event structure where the event, if any, will be placed
+    @param connectID if not NULL, where the connectID of the connection the event belongs to will be placed
+    @param timeout number of milliseconds that SecUdp should wait for events
+    @retval > 0 if an event occurred within the specified time limit
+    @retval 0 if no event occurred
+    @retval < 0 on failure
+    @remarks The first call starts the shard threads, which service their hosts on their own;
+    this call only hands out the events they produce, in the order they were produced.
+    By the time an event is handed out its shard may have reset the peer and given it to a new
+    connection, so event -> peer only identifies a connection together with the connectID, and
+    the peer's fields belong to the shard thread and must not be read. Up to
+    SECUDP_HOST_SHARD_EVENT_QUEUE_SIZE events per shard are held; while they are not taken,
+    the shards stop servicing their hosts and their peers may eventually time out.
+    @sa secudp_host_service()
+*/
+int
+secudp_sharded_host_service (SecUdpShardedHost * shardedHost, SecUdpEvent * event, secudp_uint32 * connectID, secudp_uint32 timeout)
+{
+    SecUdpShardEvent * shardEvent;
+    SecUdpHostShard * shard;
+    secudp_uint32 deadline;
+    int stalled = 0;
+
+    if (! shardedHost -> started && secudp_sharded_host_start (shardedHost) < 0)
+      return -1;
+
+    if (event == NULL)
+      return 0;
+
+    event -> type = SECUDP_EVENT_TYPE_NONE;
+    event -> peer = NULL;
+    event -> packet = NULL;
+
+    deadline = secudp_time_get () + timeout;
+
+    secudp_mutex_lock (& shardedHost -> eventMutex);
+
+    while (shardedHost -> eventCount == 0)
+    {
+       secudp_uint32 currentTime = secudp_time_get ();
+
+       if (SECUDP_TIME_GREATER_EQUAL (currentTime, deadline))
+       {
+          secudp_mutex_unlock (& shardedHost -> eventMutex);
+
+          return 0;
+       }
+
+       secudp_condition_timed_wait (& shardedHost -> eventCondition, & shardedHost -> eventMutex, SECUDP_TIME_DIFFERENCE (deadline, currentTime));
+    }
+
+    shardEvent = & shardedHost -> events [shardedHost -> eventHead];
+
+    * event = shardEvent -> event;
+
+    if (connectID != NULL)
+      * connectID = shardEvent -> connectID;
+
+    shardedHost -> eventHead = (shardedHost -> eventHead + 1) % shardedHost -> eventCapacity;
+    -- shardedHost -> eventCount;
+
+    for (shard = shardedHost -> shards;
+         shard < & shardedHost -> shards [shardedHost -> shardCount];
+         ++ shard)
+    {
+       if (shard -> stalled)
+       {
+          shard -> stalled = 0;
+          stalled = 1;
+       }
+    }
+
+    secudp_mutex_unlock (& shardedHost -> eventMutex);
+
+    /* The shard mutex is taken before the event mutex, so stalled shards are woken after releasing it. */
+    if (stalled)
+    {
+       for (shard = shardedHost -> shards;
+            shard < & shardedHost -> shards [shardedHost -> shardCount];
+            ++ shard)
+       {
+          secudp_mutex_lock (& shard -> mutex);
+          secudp_sharded_host_wake (shard);
+          secudp_mutex_unlock (& shard -> mutex);
+       }
+    }
+
+    return 1;
+}
+
+/** Queues a packet to be sent to all peers associated with every shard of a sharded host.
+    @param shardedHost sharded host on which to broadcast the packet
+    @param channelID channel on which to broadcast
+    @param packet packet to broadcast
+    @retval 0 on success
+    @retval < 0 if the packet is larger than the maximumPacketSize of the shards or already sealed,
+    in which case it is left to the caller
+    @remarks Each shard thread is woken to send the packet right away.
+    @sa secudp_host_broadcast()
+*/
+int
+secudp_sharded_host_broadcast (SecUdpShardedHost * shardedHost, secudp_uint8 channelID, SecUdpPacket * packet)
+{
+    SecUdpHostShard * shard;
+    int result;
+
+    if (packet -> dataLength > shardedHost -> shards [0].host -> maximumPacketSize ||
+        (packet -> flags & SECUDP_PACKET_FLAG_SEALED))
+      return -1;
+
+    /*
+     *  A packet's reference count may only be touched under
+     *  one shard's mutex, so every other shard gets a copy.
+     */
+    for (shard = & shardedHost -> shards [1];
+         shard < & shardedHost -> shards [shardedHost -> shardCount];
+         ++ shard)
+    {
+       SecUdpPacket * shardPacket = secudp_packet_create (packet -> data, packet -> dataLength, packet -> flags & ~ SECUDP_PACKET_FLAG_NO_ALLOCATE);
+       if (shardPacket == NULL)
+         continue;
+
+       secudp_mutex_lock (& shard -> mutex);
+       if (secudp_host_broadcast (shard -> host, channelID, shardPacket) < 0)
+         secudp_packet_destroy (shardPacket);
+       else
+         secudp_sharded_host_wake (shard);
+       secudp_mutex_unlock (& shard -> mutex);
+    }
+
+    shard = shardedHost -> shards;
+
+    secudp_mutex_lock (& shard -> mutex);
+    result = secudp_host_broadcast (shard -> host, channelID, packet);
+    if (result == 0)
+      secudp_sharded_host_wake (shard);
+    secudp_mutex_unlock (& shard -> mutex);
+
+    return result;
+}
+
+/** Queues a packet to be sent to a peer of a sharded host.
+    @param shardedHost sharded host the peer belongs to
+    @param peer destination for the packet
+    @param connectID connectID secudp_sharded_host_service() gave with the peer's events
+    @param channelID channel on which to send
+    @param packet packet to send
+    @retval 0 on success
+    @retval < 0 on failure, including when the peer is no longer on that connection
+    @remarks The shard thread is woken to send the packet right away.
+    @sa secudp_peer_send()
+*/
+int
+secudp_sharded_host_peer_send (SecUdpShardedHost * shardedHost, SecUdpPeer * peer, secudp_uint32 connectID, secudp_uint8 channelID, SecUdpPacket * packet)
+{
+    SecUdpHostShard * shard = secudp_sharded_host_peer_shard (shardedHost, peer);
+    int result = -1;
+
+    if (shard == NULL)
+      return -1;
+
+    secudp_mutex_lock (& shard -> mutex);
+    if (peer -> connectID == connectID)
+      result = secudp_peer_send (peer, channelID, packet);
+    if (result == 0)
+      secudp_sharded_host_wake (shard);
+    secudp_mutex_unlock (& shard -> mutex);
+
+    return result;
+}
+
+/** Requests a disconnection from a peer of a sharded host.
+    @param shardedHost sharded host the peer belongs to
+    @param peer peer to request a disconnection
+    @param connectID connectID secudp_sharded_host_service() gave with the peer's events
+    @param data data describing the disconnection
+    @remarks Nothing is done if the peer is no longer on that connection. As with
+    secudp_sharded_host_peer_send(), the shard thread is woken to send the request right away.
+    @sa secudp_peer_disconnect()
+*/
+void
+secudp_sharded_host_peer_disconnect (SecUdpShardedHost * shardedHost, SecUdpPeer * peer, secudp_uint32 connectID, secudp_uint32 data)
+{
+    SecUdpHostShard * shard = secudp_sharded_host_peer_shard (shardedHost, peer);
+
+    if (shard == NULL)
+      return;
+
+    secudp_mutex_lock (& shard -> mutex);
+    if (peer -> connectID == connectID)
+    {
+       secudp_peer_disconnect (peer, data);
+       secudp_sharded_host_wake (shard);
+    }
+    secudp_mutex_unlock (& shard -> mutex);
+}
+
+/** @} */
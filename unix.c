@@ -4,6 +4,10 @@
 */
 #ifndef _WIN32
 
+#if (defined(HAS_RECVMMSG) || defined(HAS_SENDMMSG)) && ! defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
 #include <stdio.h>
 
 #include <sys/types.h>
@@ -11,12 +15,19 @@
 #include <sys/ioctl.h>
 #include <sys/time.h>
 #include <netinet/tcp.h>
+#include <netinet/udp.h>
 #include <netdb.h>
 #include <unistd.h>
 #include <string.h>
 #include <errno.h>
 #include <time.h>
 
+#ifdef HAS_IO_URING
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+
 #define SECUDP_BUILDING_LIB 1
 #include "secudp/secudp.h"
 
@@ -354,6 +365,24 @@ secudp_socket_set_option (SecUdpSocket socket, SecUdpSocketOption option, int va
             result = setsockopt (socket, IPPROTO_TCP, TCP_NODELAY, (char *) & value, sizeof (int));
             break;
 
+#if defined(HAS_UDP_SEGMENT) && defined(HAS_SENDMMSG)
+        case SECUDP_SOCKOPT_SEGMENT:
+            result = setsockopt (socket, SOL_UDP, UDP_SEGMENT, (char *) & value, sizeof (int));
+            break;
+#endif
+
+#if defined(HAS_UDP_GRO) && defined(HAS_RECVMMSG)
+        case SECUDP_SOCKOPT_GRO:
+            result = setsockopt (socket, SOL_UDP, UDP_GRO, (char *) & value, sizeof (int));
+            break;
+#endif
+
+#ifdef SO_REUSEPORT
+        case SECUDP_SOCKOPT_REUSEPORT:
+            result = setsockopt (socket, SOL_SOCKET, SO_REUSEPORT, (char *) & value, sizeof (int));
+            break;
+#endif
+
         default:
             break;
     }
@@ -473,6 +502,160 @@ secudp_socket_send (SecUdpSocket socket,
     return sentLength;
 }
 
+#if defined (HAS_SENDMMSG) || defined (HAS_IO_URING)
+/*
+ *  Fills in msgHdr to send the datagram in buffers [bufferIndex],
+ *  coalesced with the run of same-size datagrams to the same
+ *  address after it when segment is set, and returns how many
+ *  datagrams it covers. Control needs room for one UDP_SEGMENT
+ *  message. Addition to ENet.
+ */
+static size_t
+secudp_socket_build_message (struct msghdr * msgHdr,
+                           struct sockaddr_in * sin,
+                           char * control,
+                           const SecUdpAddress * addresses,
+                           const SecUdpBuffer * buffers,
+                           size_t bufferIndex,
+                           size_t bufferCount,
+                           int segment)
+{
+    const SecUdpAddress * address = & addresses [bufferIndex];
+    size_t segmentSize = buffers [bufferIndex].dataLength,
+           segmentCount = 1,
+           totalLength = segmentSize;
+
+    while (segment &&
+           bufferIndex + segmentCount < bufferCount &&
+           segmentCount < SECUDP_SOCKET_SEGMENT_MAXIMUM &&
+           buffers [bufferIndex + segmentCount - 1].dataLength == segmentSize &&
+           buffers [bufferIndex + segmentCount].dataLength <= segmentSize &&
+           totalLength + buffers [bufferIndex + segmentCount].dataLength <= SECUDP_SOCKET_SEGMENT_MAXIMUM_SIZE &&
+           addresses [bufferIndex + segmentCount].host == address -> host &&
+           addresses [bufferIndex + segmentCount].port == address -> port)
+    {
+        totalLength += buffers [bufferIndex + segmentCount].dataLength;
+        ++ segmentCount;
+    }
+
+    memset (msgHdr, 0, sizeof (struct msghdr));
+    memset (sin, 0, sizeof (struct sockaddr_in));
+
+    sin -> sin_family = AF_INET;
+    sin -> sin_port = SECUDP_HOST_TO_NET_16 (address -> port);
+    sin -> sin_addr.s_addr = address -> host;
+
+    msgHdr -> msg_name = sin;
+    msgHdr -> msg_namelen = sizeof (struct sockaddr_in);
+    msgHdr -> msg_iov = (struct iovec *) & buffers [bufferIndex];
+    msgHdr -> msg_iovlen = segmentCount;
+
+#ifdef HAS_UDP_SEGMENT
+    if (segmentCount > 1)
+    {
+        struct cmsghdr * cmsg;
+        secudp_uint16 segmentValue = (secudp_uint16) segmentSize;
+
+        msgHdr -> msg_control = control;
+        msgHdr -> msg_controllen = CMSG_SPACE (sizeof (secudp_uint16));
+
+        cmsg = CMSG_FIRSTHDR (msgHdr);
+        cmsg -> cmsg_level = SOL_UDP;
+        cmsg -> cmsg_type = UDP_SEGMENT;
+        cmsg -> cmsg_len = CMSG_LEN (sizeof (secudp_uint16));
+        memcpy (CMSG_DATA (cmsg), & segmentValue, sizeof (secudp_uint16));
+    }
+#else
+    (void) control;
+#endif
+
+    return segmentCount;
+}
+#endif
+
+/** Sends bufferCount datagrams, one from each buffer, each to the matching
+    address, with as few sendmmsg() calls as possible where available.
+    @param segment if nonzero, runs of datagrams of the same size to the same address
+    are coalesced into one send with UDP_SEGMENT; the last of a run may be shorter
+    @returns the number of datagrams handed to the socket, or < 0 on error
+    @remarks datagrams left over when the socket would block are dropped,
+    as secudp_socket_send() drops a single datagram
+*/
+int
+secudp_socket_send_batch (SecUdpSocket socket,
+                        const SecUdpAddress * addresses,
+                        const SecUdpBuffer * buffers,
+                        size_t bufferCount,
+                        int segment)
+{
+#ifdef HAS_SENDMMSG
+    struct mmsghdr msgHdrs [SECUDP_HOST_SEND_BATCH_SIZE];
+    struct sockaddr_in sins [SECUDP_HOST_SEND_BATCH_SIZE];
+    size_t msgSegments [SECUDP_HOST_SEND_BATCH_SIZE];
+#ifdef HAS_UDP_SEGMENT
+    union
+    {
+        char buffer [CMSG_SPACE (sizeof (secudp_uint16))];
+        struct cmsghdr align;
+    } controls [SECUDP_HOST_SEND_BATCH_SIZE];
+#endif
+    size_t sentCount = 0;
+
+    while (sentCount < bufferCount)
+    {
+        size_t msgCount = 0, bufferIndex = sentCount, i;
+        int msgSent;
+
+        while (bufferIndex < bufferCount && msgCount < SECUDP_HOST_SEND_BATCH_SIZE)
+        {
+            msgSegments [msgCount] = secudp_socket_build_message (& msgHdrs [msgCount].msg_hdr,
+                                                                  & sins [msgCount],
+#ifdef HAS_UDP_SEGMENT
+                                                                  controls [msgCount].buffer,
+#else
+                                                                  NULL,
+#endif
+                                                                  addresses,
+                                                                  buffers,
+                                                                  bufferIndex,
+                                                                  bufferCount,
+                                                                  segment);
+            bufferIndex += msgSegments [msgCount];
+            ++ msgCount;
+        }
+
+        msgSent = sendmmsg (socket, msgHdrs, msgCount, MSG_NOSIGNAL);
+
+        if (msgSent == -1)
+        {
+           if (errno == EWOULDBLOCK)
+             break;
+
+           return sentCount > 0 ? (int) sentCount : -1;
+        }
+
+        for (i = 0; i < (size_t) msgSent; ++ i)
+          sentCount += msgSegments [i];
+    }
+
+    return (int) sentCount;
+#else
+    size_t sentCount;
+
+    (void) segment;
+
+    for (sentCount = 0; sentCount < bufferCount; ++ sentCount)
+    {
+        int sentLength = secudp_socket_send (socket, & addresses [sentCount], & buffers [sentCount], 1);
+
+        if (sentLength < 0)
+          return sentCount > 0 ? (int) sentCount : -1;
+    }
+
+    return (int) sentCount;
+#endif
+}
+
 int
 secudp_socket_receive (SecUdpSocket socket,
                      SecUdpAddress * address,
@@ -518,6 +701,802 @@ secudp_socket_receive (SecUdpSocket socket,
     return recvLength;
 }
 
+#if defined (HAS_RECVMMSG) || defined (HAS_IO_URING)
+/*
+ *  Returns the size of the datagrams the kernel coalesced into
+ *  a read of length bytes, as reported by the UDP_GRO control
+ *  message, or length if it holds one datagram. Addition to ENet.
+ */
+static size_t
+secudp_socket_segment_size (struct msghdr * msgHdr, size_t length)
+{
+#ifdef HAS_UDP_GRO
+    struct cmsghdr * cmsg;
+
+    if (msgHdr -> msg_controllen == 0)
+      return length;
+
+    for (cmsg = CMSG_FIRSTHDR (msgHdr);
+         cmsg != NULL;
+         cmsg = CMSG_NXTHDR (msgHdr, cmsg))
+    {
+        if (cmsg -> cmsg_level == SOL_UDP && cmsg -> cmsg_type == UDP_GRO)
+        {
+            int segmentSize;
+
+            memcpy (& segmentSize, CMSG_DATA (cmsg), sizeof (int));
+            if (segmentSize > 0)
+              return segmentSize;
+        }
+    }
+#endif
+
+    return length;
+}
+#endif
+
+/** Receives up to bufferCount reads, one into each buffer, with a single
+    recvmmsg() call where available.
+    @param segmentSizes receives, for each read, the size of the datagrams the kernel
+    coalesced into it with UDP_GRO, or the length of the read if it holds one datagram
+    @returns the number of reads, 0 if nothing was waiting, or < 0 on error
+    @remarks with recvmmsg(), a read truncated to fit its buffer is reported with a length of 0
+*/
+int
+secudp_socket_receive_batch (SecUdpSocket socket,
+                           SecUdpAddress * addresses,
+                           SecUdpBuffer * buffers,
+                           size_t * lengths,
+                           size_t * segmentSizes,
+                           size_t bufferCount)
+{
+#ifdef HAS_RECVMMSG
+    struct mmsghdr msgHdrs [SECUDP_HOST_RECEIVE_BATCH_SIZE];
+    struct sockaddr_in sins [SECUDP_HOST_RECEIVE_BATCH_SIZE];
+#ifdef HAS_UDP_GRO
+    union
+    {
+        char buffer [CMSG_SPACE (sizeof (int))];
+        struct cmsghdr align;
+    } controls [SECUDP_HOST_RECEIVE_BATCH_SIZE];
+#endif
+    int recvCount, i;
+
+    if (bufferCount > SECUDP_HOST_RECEIVE_BATCH_SIZE)
+      bufferCount = SECUDP_HOST_RECEIVE_BATCH_SIZE;
+
+    memset (msgHdrs, 0, bufferCount * sizeof (struct mmsghdr));
+
+    for (i = 0; i < (int) bufferCount; ++ i)
+    {
+        msgHdrs [i].msg_hdr.msg_name = & sins [i];
+        msgHdrs [i].msg_hdr.msg_namelen = sizeof (struct sockaddr_in);
+        msgHdrs [i].msg_hdr.msg_iov = (struct iovec *) & buffers [i];
+        msgHdrs [i].msg_hdr.msg_iovlen = 1;
+#ifdef HAS_UDP_GRO
+        msgHdrs [i].msg_hdr.msg_control = controls [i].buffer;
+        msgHdrs [i].msg_hdr.msg_controllen = sizeof (controls [i].buffer);
+#endif
+    }
+
+    recvCount = recvmmsg (socket, msgHdrs, bufferCount, MSG_NOSIGNAL, NULL);
+
+    if (recvCount == -1)
+    {
+       if (errno == EWOULDBLOCK)
+         return 0;
+
+       return -1;
+    }
+
+    for (i = 0; i < recvCount; ++ i)
+    {
+        lengths [i] = (msgHdrs [i].msg_hdr.msg_flags & MSG_TRUNC) ? 0 : msgHdrs [i].msg_len;
+        segmentSizes [i] = secudp_socket_segment_size (& msgHdrs [i].msg_hdr, lengths [i]);
+
+        addresses [i].host = (secudp_uint32) sins [i].sin_addr.s_addr;
+        addresses [i].port = SECUDP_NET_TO_HOST_16 (sins [i].sin_port);
+    }
+
+    return recvCount;
+#else
+    size_t recvCount;
+
+    for (recvCount = 0; recvCount < bufferCount; ++ recvCount)
+    {
+        int recvLength = secudp_socket_receive (socket, & addresses [recvCount], & buffers [recvCount], 1);
+
+        if (recvLength < 0)
+          return recvCount > 0 ? (int) recvCount : -1;
+
+        if (recvLength == 0)
+          break;
+
+        lengths [recvCount] = recvLength;
+        segmentSizes [recvCount] = recvLength;
+    }
+
+    return (int) recvCount;
+#endif
+}
+
+#ifdef HAS_IO_URING
+/*
+ *  User data of the multishot receive; sends are tagged with
+ *  their index within the submitted batch instead.
+ */
+#define SECUDP_URING_RECEIVE ((secudp_uint64) ~0)
+
+typedef struct _SecUdpUringCompletion
+{
+    secudp_uint64 userData;
+    int result;
+    secudp_uint32 flags;
+} SecUdpUringCompletion;
+
+struct _SecUdpUring
+{
+    int ringSocket;
+    SecUdpSocket socket;
+    void * sqRing;
+    size_t sqRingSize;
+    void * cqRing;
+    size_t cqRingSize;
+    struct io_uring_sqe * sqes;
+    size_t sqesSize;
+    unsigned * sqHead;
+    unsigned * sqTail;
+    unsigned * sqArray;
+    unsigned sqMask;
+    unsigned sqEntries;
+    unsigned sqLocalTail;
+    unsigned * cqHead;
+    unsigned * cqTail;
+    unsigned cqMask;
+    struct io_uring_cqe * cqes;
+    struct io_uring_buf_ring * bufferRing;
+    size_t bufferRingSize;
+    secudp_uint8 * bufferData;
+    size_t bufferStride;
+    size_t bufferCount;
+    secudp_uint16 bufferTail;
+    struct msghdr receiveTemplate;
+    int receiveArmed;
+    secudp_uint16 heldBuffers [SECUDP_SOCKET_URING_BUFFER_COUNT];
+    size_t heldCount;
+    SecUdpUringCompletion pending [SECUDP_SOCKET_URING_BUFFER_COUNT * 2];
+    size_t pendingHead;
+    size_t pendingCount;
+    int sendResults [SECUDP_HOST_SEND_BATCH_SIZE];
+    size_t sendsOutstanding;
+    struct msghdr sendHeaders [SECUDP_HOST_SEND_BATCH_SIZE];
+    struct sockaddr_in sendAddresses [SECUDP_HOST_SEND_BATCH_SIZE];
+    size_t sendSegments [SECUDP_HOST_SEND_BATCH_SIZE];
+#ifdef HAS_UDP_SEGMENT
+    union
+    {
+        char buffer [CMSG_SPACE (sizeof (secudp_uint16))];
+        struct cmsghdr align;
+    } sendControls [SECUDP_HOST_SEND_BATCH_SIZE];
+#endif
+};
+
+static int
+secudp_uring_enter (SecUdpUring * uring, unsigned submitCount, unsigned completeCount)
+{
+    /* Entries are only published to the kernel right before it is asked to consume them. */
+    SECUDP_ATOMIC_STORE (uring -> sqTail, uring -> sqLocalTail);
+
+    for (;;)
+    {
+        int result = (int) syscall (__NR_io_uring_enter, uring -> ringSocket, submitCount, completeCount,
+                                    completeCount > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+
+        if (result >= 0 || errno != EINTR)
+          return result;
+    }
+}
+
+static struct io_uring_sqe *
+secudp_uring_get_sqe (SecUdpUring * uring)
+{
+    unsigned tail = uring -> sqLocalTail;
+    struct io_uring_sqe * sqe;
+
+    if (tail - SECUDP_ATOMIC_LOAD (uring -> sqHead) >= uring -> sqEntries)
+      return NULL;
+
+    sqe = & uring -> sqes [tail & uring -> sqMask];
+    memset (sqe, 0, sizeof (struct io_uring_sqe));
+
+    uring -> sqArray [tail & uring -> sqMask] = tail & uring -> sqMask;
+    uring -> sqLocalTail = tail + 1;
+
+    return sqe;
+}
+
+static void
+secudp_uring_provide_buffer (SecUdpUring * uring, secudp_uint16 bufferID)
+{
+    struct io_uring_buf * buffer = & uring -> bufferRing -> bufs [uring -> bufferTail & (uring -> bufferCount - 1)];
+
+    buffer -> addr = (secudp_uint64) (size_t) (uring -> bufferData + bufferID * uring -> bufferStride);
+    buffer -> len = (secudp_uint32) uring -> bufferStride;
+    buffer -> bid = bufferID;
+
+    ++ uring -> bufferTail;
+}
+
+/*
+ *  Moves every posted completion out of the completion queue,
+ *  recording send results and queueing receives until they are
+ *  asked for, so that waiting on sends never loses a receive.
+ */
+static void
+secudp_uring_reap (SecUdpUring * uring)
+{
+    unsigned head = * uring -> cqHead,
+             tail = SECUDP_ATOMIC_LOAD (uring -> cqTail);
+    int recycled = 0;
+
+    for (; head != tail; ++ head)
+    {
+        const struct io_uring_cqe * cqe = & uring -> cqes [head & uring -> cqMask];
+
+        if (cqe -> user_data != SECUDP_URING_RECEIVE)
+        {
+            if (cqe -> user_data < SECUDP_HOST_SEND_BATCH_SIZE)
+              uring -> sendResults [cqe -> user_data] = cqe -> res;
+
+            if (uring -> sendsOutstanding > 0)
+              -- uring -> sendsOutstanding;
+
+            continue;
+        }
+
+        if (! (cqe -> flags & IORING_CQE_F_MORE))
+          uring -> receiveArmed = 0;
+
+        if (uring -> pendingCount >= sizeof (uring -> pending) / sizeof (uring -> pending [0]))
+        {
+            /* Nowhere to queue the datagram, so drop it and hand its buffer straight back. */
+            if (cqe -> flags & IORING_CQE_F_BUFFER)
+            {
+                secudp_uring_provide_buffer (uring, (secudp_uint16) (cqe -> flags >> IORING_CQE_BUFFER_SHIFT));
+                recycled = 1;
+            }
+
+            continue;
+        }
+
+        {
+            SecUdpUringCompletion * completion = & uring -> pending [(uring -> pendingHead + uring -> pendingCount) % (sizeof (uring -> pending) / sizeof (uring -> pending [0]))];
+
+            completion -> userData = cqe -> user_data;
+            completion -> result = cqe -> res;
+            completion -> flags = cqe -> flags;
+
+            ++ uring -> pendingCount;
+        }
+    }
+
+    SECUDP_ATOMIC_STORE (uring -> cqHead, head);
+
+    if (recycled)
+      SECUDP_ATOMIC_STORE (& uring -> bufferRing -> tail, uring -> bufferTail);
+}
+
+/*
+ *  Submits the queued sends and waits for all of them to complete. If the
+ *  kernel cannot be entered, the sends it has not taken are withdrawn, and
+ *  the call fails only if it still holds some, whose messages then stay in
+ *  use until a later call finishes them.
+ */
+static int
+secudp_uring_finish_sends (SecUdpUring * uring)
+{
+    for (;;)
+    {
+        unsigned unsubmitted, head;
+
+        secudp_uring_reap (uring);
+
+        if (uring -> sendsOutstanding == 0)
+          return 0;
+
+        unsubmitted = uring -> sqLocalTail - SECUDP_ATOMIC_LOAD (uring -> sqHead);
+
+        if (secudp_uring_enter (uring, unsubmitted, (unsigned) uring -> sendsOutstanding) >= 0)
+          continue;
+
+        /* A full completion queue only needs reaping. */
+        if (errno == EBUSY)
+          continue;
+
+        for (head = SECUDP_ATOMIC_LOAD (uring -> sqHead); uring -> sqLocalTail != head; -- uring -> sqLocalTail)
+        {
+            const struct io_uring_sqe * sqe = & uring -> sqes [uring -> sqArray [(uring -> sqLocalTail - 1) & uring -> sqMask]];
+
+            if (sqe -> user_data != SECUDP_URING_RECEIVE && uring -> sendsOutstanding > 0)
+              -- uring -> sendsOutstanding;
+        }
+        SECUDP_ATOMIC_STORE (uring -> sqTail, uring -> sqLocalTail);
+
+        secudp_uring_reap (uring);
+
+        return uring -> sendsOutstanding > 0 ? -1 : 0;
+    }
+}
+
+static int
+secudp_uring_arm_receive (SecUdpUring * uring)
+{
+    struct io_uring_sqe * sqe = secudp_uring_get_sqe (uring);
+
+    if (sqe == NULL)
+      return -1;
+
+    sqe -> opcode = IORING_OP_RECVMSG;
+    sqe -> fd = uring -> socket;
+    sqe -> addr = (secudp_uint64) (size_t) & uring -> receiveTemplate;
+    sqe -> len = 1;
+    sqe -> flags = IOSQE_BUFFER_SELECT;
+    sqe -> buf_group = 0;
+    sqe -> ioprio = IORING_RECV_MULTISHOT;
+    sqe -> user_data = SECUDP_URING_RECEIVE;
+
+    if (secudp_uring_enter (uring, 1, 0) < 0)
+      return -1;
+
+    uring -> receiveArmed = 1;
+
+    return 0;
+}
+
+/*
+ *  Checks that the kernel implements the operations the io_uring
+ *  submits. Whether it takes multishot receives cannot be probed
+ *  for, so that is checked once the receive is armed.
+ */
+static int
+secudp_uring_probe (SecUdpUring * uring)
+{
+    static const int opcodes [] = { IORING_OP_SENDMSG, IORING_OP_RECVMSG };
+    struct io_uring_probe * probe;
+    size_t probeSize = sizeof (struct io_uring_probe) + 256 * sizeof (struct io_uring_probe_op),
+           i;
+    int result = 0;
+
+    probe = (struct io_uring_probe *) secudp_malloc (probeSize);
+    if (probe == NULL)
+      return -1;
+
+    memset (probe, 0, probeSize);
+
+    if (syscall (__NR_io_uring_register, uring -> ringSocket, IORING_REGISTER_PROBE, probe, 256) < 0)
+      result = -1;
+    else
+    for (i = 0; i < sizeof (opcodes) / sizeof (opcodes [0]); ++ i)
+    {
+        if (opcodes [i] > probe -> last_op ||
+            ! (probe -> ops [opcodes [i]].flags & IO_URING_OP_SUPPORTED))
+          result = -1;
+    }
+
+    secudp_free (probe);
+
+    return result;
+}
+
+/** Creates an io_uring to send and receive through a socket, with one multishot receive
+    that fills buffers handed to the kernel in a ring, and sends submitted a batch at a time.
+    @param socket socket to send and receive through
+    @param bufferSize largest read the receive buffers must hold
+    @param bufferCount number of receive buffers, a power of two up to SECUDP_SOCKET_URING_BUFFER_COUNT
+    @returns the io_uring, or NULL if io_uring or the operations it relies on are unavailable,
+    in which case the socket should be used directly
+*/
+SecUdpUring *
+secudp_uring_create (SecUdpSocket socket, size_t bufferSize, size_t bufferCount)
+{
+    struct io_uring_params params;
+    struct io_uring_buf_reg bufferRegistration;
+    SecUdpUring * uring;
+    size_t bufferID;
+
+    if (bufferCount == 0 || bufferCount > SECUDP_SOCKET_URING_BUFFER_COUNT || (bufferCount & (bufferCount - 1)) != 0)
+      return NULL;
+
+    uring = (SecUdpUring *) secudp_malloc (sizeof (SecUdpUring));
+    if (uring == NULL)
+      return NULL;
+
+    memset (uring, 0, sizeof (SecUdpUring));
+    uring -> socket = socket;
+    uring -> sqRing = MAP_FAILED;
+    uring -> cqRing = MAP_FAILED;
+    uring -> sqes = (struct io_uring_sqe *) MAP_FAILED;
+    uring -> bufferRing = (struct io_uring_buf_ring *) MAP_FAILED;
+
+    /*
+     *  Completions are posted when the thread next enters the kernel rather than
+     *  by interrupting it, falling back to the default where that is unsupported.
+     */
+    memset (& params, 0, sizeof (params));
+    params.flags = IORING_SETUP_COOP_TASKRUN;
+
+    uring -> ringSocket = (int) syscall (__NR_io_uring_setup, SECUDP_SOCKET_URING_ENTRIES, & params);
+    if (uring -> ringSocket < 0 && errno == EINVAL)
+    {
+        memset (& params, 0, sizeof (params));
+
+        uring -> ringSocket = (int) syscall (__NR_io_uring_setup, SECUDP_SOCKET_URING_ENTRIES, & params);
+    }
+
+    if (uring -> ringSocket < 0)
+    {
+        secudp_free (uring);
+
+        return NULL;
+    }
+
+    uring -> sqRingSize = params.sq_off.array + params.sq_entries * sizeof (unsigned);
+    uring -> cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof (struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if (uring -> cqRingSize > uring -> sqRingSize)
+          uring -> sqRingSize = uring -> cqRingSize;
+        uring -> cqRingSize = 0;
+    }
+
+    uring -> sqRing = mmap (NULL, uring -> sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring -> ringSocket, IORING_OFF_SQ_RING);
+    if (uring -> sqRing == MAP_FAILED)
+      goto failure;
+
+    if (uring -> cqRingSize > 0)
+    {
+        uring -> cqRing = mmap (NULL, uring -> cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring -> ringSocket, IORING_OFF_CQ_RING);
+        if (uring -> cqRing == MAP_FAILED)
+          goto failure;
+    }
+
+    uring -> sqesSize = params.sq_entries * sizeof (struct io_uring_sqe);
+    uring -> sqes = (struct io_uring_sqe *) mmap (NULL, uring -> sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring -> ringSocket, IORING_OFF_SQES);
+    if (uring -> sqes == MAP_FAILED)
+      goto failure;
+
+    {
+        secudp_uint8 * sqRing = (secudp_uint8 *) uring -> sqRing,
+                     * cqRing = uring -> cqRingSize > 0 ? (secudp_uint8 *) uring -> cqRing : sqRing;
+
+        uring -> sqHead = (unsigned *) (sqRing + params.sq_off.head);
+        uring -> sqTail = (unsigned *) (sqRing + params.sq_off.tail);
+        uring -> sqArray = (unsigned *) (sqRing + params.sq_off.array);
+        uring -> sqMask = * (unsigned *) (sqRing + params.sq_off.ring_mask);
+        uring -> sqEntries = params.sq_entries;
+        uring -> sqLocalTail = * uring -> sqTail;
+        uring -> cqHead = (unsigned *) (cqRing + params.cq_off.head);
+        uring -> cqTail = (unsigned *) (cqRing + params.cq_off.tail);
+        uring -> cqMask = * (unsigned *) (cqRing + params.cq_off.ring_mask);
+        uring -> cqes = (struct io_uring_cqe *) (cqRing + params.cq_off.cqes);
+    }
+
+    if (secudp_uring_probe (uring) < 0)
+      goto failure;
+
+    uring -> receiveTemplate.msg_namelen = sizeof (struct sockaddr_in);
+#ifdef HAS_UDP_GRO
+    uring -> receiveTemplate.msg_controllen = CMSG_SPACE (sizeof (int));
+#endif
+
+    /* Each buffer holds the receive header, the sender address and control messages ahead of the payload. */
+    uring -> bufferStride = sizeof (struct io_uring_recvmsg_out) + uring -> receiveTemplate.msg_namelen + uring -> receiveTemplate.msg_controllen + bufferSize;
+    uring -> bufferStride = (uring -> bufferStride + 15) & ~ (size_t) 15;
+    uring -> bufferCount = bufferCount;
+
+    uring -> bufferData = (secudp_uint8 *) secudp_malloc (bufferCount * uring -> bufferStride);
+    if (uring -> bufferData == NULL)
+      goto failure;
+
+    uring -> bufferRingSize = bufferCount * sizeof (struct io_uring_buf);
+    uring -> bufferRing = (struct io_uring_buf_ring *) mmap (NULL, uring -> bufferRingSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (uring -> bufferRing == MAP_FAILED)
+      goto failure;
+
+    memset (& bufferRegistration, 0, sizeof (bufferRegistration));
+    bufferRegistration.ring_addr = (secudp_uint64) (size_t) uring -> bufferRing;
+    bufferRegistration.ring_entries = (secudp_uint32) bufferCount;
+    bufferRegistration.bgid = 0;
+
+    if (syscall (__NR_io_uring_register, uring -> ringSocket, IORING_REGISTER_PBUF_RING, & bufferRegistration, 1) < 0)
+      goto failure;
+
+    for (bufferID = 0; bufferID < bufferCount; ++ bufferID)
+      secudp_uring_provide_buffer (uring, (secudp_uint16) bufferID);
+    SECUDP_ATOMIC_STORE (& uring -> bufferRing -> tail, uring -> bufferTail);
+
+    if (secudp_uring_arm_receive (uring) < 0)
+      goto failure;
+
+    /*
+     *  A kernel without multishot receives fails the receive with
+     *  -EINVAL as soon as it is submitted, ending it at once.
+     */
+    secudp_uring_reap (uring);
+    if (! uring -> receiveArmed)
+      goto failure;
+
+    return uring;
+
+failure:
+    secudp_uring_destroy (uring);
+
+    return NULL;
+}
+
+void
+secudp_uring_destroy (SecUdpUring * uring)
+{
+    if (uring == NULL)
+      return;
+
+    if (uring -> ringSocket >= 0)
+      close (uring -> ringSocket);
+
+    if (uring -> bufferRing != MAP_FAILED)
+      munmap (uring -> bufferRing, uring -> bufferRingSize);
+    if (uring -> sqes != MAP_FAILED)
+      munmap (uring -> sqes, uring -> sqesSize);
+    if (uring -> cqRing != MAP_FAILED)
+      munmap (uring -> cqRing, uring -> cqRingSize);
+    if (uring -> sqRing != MAP_FAILED)
+      munmap (uring -> sqRing, uring -> sqRingSize);
+
+    if (uring -> bufferData != NULL)
+      secudp_free (uring -> bufferData);
+
+    secudp_free (uring);
+}
+
+/** Returns the descriptor to wait on for an io_uring to have completions,
+    in place of the socket it receives from.
+*/
+SecUdpSocket
+secudp_uring_socket (SecUdpUring * uring)
+{
+    return uring -> ringSocket;
+}
+
+/** Checks, without a system call, whether an io_uring has completions waiting to be received.
+*/
+int
+secudp_uring_ready (SecUdpUring * uring)
+{
+    return uring -> pendingCount > 0 ||
+           * uring -> cqHead != SECUDP_ATOMIC_LOAD (uring -> cqTail);
+}
+
+/** Sends bufferCount datagrams through an io_uring as secudp_socket_send_batch() does, submitting
+    them together and collecting their results in the same system call.
+    @returns the number of datagrams handed to the socket, or < 0 on error
+*/
+int
+secudp_uring_send_batch (SecUdpUring * uring,
+                       const SecUdpAddress * addresses,
+                       const SecUdpBuffer * buffers,
+                       size_t bufferCount,
+                       int segment)
+{
+    size_t sentCount = 0;
+
+    /* Sends a failed call left with the kernel still use the message headers. */
+    if (uring -> sendsOutstanding > 0 && secudp_uring_finish_sends (uring) < 0)
+      return -1;
+
+    while (sentCount < bufferCount)
+    {
+        size_t msgCount = 0, bufferIndex = sentCount, i;
+        int wouldBlock = 0;
+
+        while (bufferIndex < bufferCount && msgCount < SECUDP_HOST_SEND_BATCH_SIZE)
+        {
+            struct io_uring_sqe * sqe = secudp_uring_get_sqe (uring);
+
+            if (sqe == NULL)
+              break;
+
+            uring -> sendSegments [msgCount] = secudp_socket_build_message (& uring -> sendHeaders [msgCount],
+                                                                           & uring -> sendAddresses [msgCount],
+#ifdef HAS_UDP_SEGMENT
+                                                                           uring -> sendControls [msgCount].buffer,
+#else
+                                                                           NULL,
+#endif
+                                                                           addresses,
+                                                                           buffers,
+                                                                           bufferIndex,
+                                                                           bufferCount,
+                                                                           segment);
+
+            sqe -> opcode = IORING_OP_SENDMSG;
+            sqe -> fd = uring -> socket;
+            sqe -> addr = (secudp_uint64) (size_t) & uring -> sendHeaders [msgCount];
+            sqe -> len = 1;
+            sqe -> msg_flags = MSG_NOSIGNAL | MSG_DONTWAIT;
+            sqe -> user_data = msgCount;
+
+            bufferIndex += uring -> sendSegments [msgCount];
+            ++ msgCount;
+        }
+
+        if (msgCount == 0)
+          return sentCount > 0 ? (int) sentCount : -1;
+
+        /* The messages point into the caller's buffers, so every send must complete before returning. */
+        for (i = 0; i < msgCount; ++ i)
+          uring -> sendResults [i] = -EIO;
+
+        uring -> sendsOutstanding = msgCount;
+
+        /* Sends withdrawn after a failed enter keep their -EIO result. */
+        if (secudp_uring_finish_sends (uring) < 0)
+          return sentCount > 0 ? (int) sentCount : -1;
+
+        for (i = 0; i < msgCount; ++ i)
+        {
+            if (uring -> sendResults [i] >= 0)
+              sentCount += uring -> sendSegments [i];
+            else
+            if (uring -> sendResults [i] == -EAGAIN)
+              wouldBlock = 1;
+            else
+              return sentCount > 0 ? (int) sentCount : -1;
+        }
+
+        if (wouldBlock)
+          break;
+    }
+
+    return (int) sentCount;
+}
+
+/** Receives up to bufferCount reads through an io_uring as secudp_socket_receive_batch() does,
+    without a system call while the multishot receive stays armed.
+    @param buffers receives, for each read, where its payload lies in the io_uring's own buffers,
+    which stay valid until the next call
+    @returns the number of reads, 0 if nothing was waiting, or < 0 on error
+*/
+int
+secudp_uring_receive_batch (SecUdpUring * uring,
+                          SecUdpAddress * addresses,
+                          SecUdpBuffer * buffers,
+                          size_t * lengths,
+                          size_t * segmentSizes,
+                          size_t bufferCount)
+{
+    size_t recvCount = 0, i;
+
+    /* The reads handed out by the last call have been handled, so their buffers go back to the kernel. */
+    if (uring -> heldCount > 0)
+    {
+        for (i = 0; i < uring -> heldCount; ++ i)
+          secudp_uring_provide_buffer (uring, uring -> heldBuffers [i]);
+        SECUDP_ATOMIC_STORE (& uring -> bufferRing -> tail, uring -> bufferTail);
+
+        uring -> heldCount = 0;
+    }
+
+    secudp_uring_reap (uring);
+
+    while (recvCount < bufferCount && uring -> pendingCount > 0)
+    {
+        SecUdpUringCompletion * completion = & uring -> pending [uring -> pendingHead];
+        struct io_uring_recvmsg_out * out;
+        struct sockaddr_in * sin;
+        struct msghdr msgHdr;
+        secudp_uint8 * data;
+        secudp_uint16 bufferID;
+
+        uring -> pendingHead = (uring -> pendingHead + 1) % (sizeof (uring -> pending) / sizeof (uring -> pending [0]));
+        -- uring -> pendingCount;
+
+        if (completion -> result < 0)
+        {
+            if (completion -> result == -ENOBUFS)
+              continue;
+
+            return recvCount > 0 ? (int) recvCount : -1;
+        }
+
+        if (! (completion -> flags & IORING_CQE_F_BUFFER))
+          continue;
+
+        bufferID = (secudp_uint16) (completion -> flags >> IORING_CQE_BUFFER_SHIFT);
+        uring -> heldBuffers [uring -> heldCount ++] = bufferID;
+
+        data = uring -> bufferData + bufferID * uring -> bufferStride;
+        out = (struct io_uring_recvmsg_out *) data;
+        sin = (struct sockaddr_in *) (data + sizeof (struct io_uring_recvmsg_out));
+
+        memset (& msgHdr, 0, sizeof (struct msghdr));
+        msgHdr.msg_control = data + sizeof (struct io_uring_recvmsg_out) + uring -> receiveTemplate.msg_namelen;
+        msgHdr.msg_controllen = out -> controllen;
+
+        buffers [recvCount].data = (secudp_uint8 *) msgHdr.msg_control + uring -> receiveTemplate.msg_controllen;
+        buffers [recvCount].dataLength = out -> payloadlen;
+        lengths [recvCount] = (out -> flags & MSG_TRUNC) ? 0 : out -> payloadlen;
+        segmentSizes [recvCount] = secudp_socket_segment_size (& msgHdr, lengths [recvCount]);
+
+        addresses [recvCount].host = (secudp_uint32) sin -> sin_addr.s_addr;
+        addresses [recvCount].port = SECUDP_NET_TO_HOST_16 (sin -> sin_port);
+
+        ++ recvCount;
+    }
+
+    if (! uring -> receiveArmed && secudp_uring_arm_receive (uring) < 0)
+      return recvCount > 0 ? (int) recvCount : -1;
+
+    return (int) recvCount;
+}
+#else
+SecUdpUring *
+secudp_uring_create (SecUdpSocket socket, size_t bufferSize, size_t bufferCount)
+{
+    (void) socket;
+    (void) bufferSize;
+    (void) bufferCount;
+
+    return NULL;
+}
+
+void
+secudp_uring_destroy (SecUdpUring * uring)
+{
+    (void) uring;
+}
+
+SecUdpSocket
+secudp_uring_socket (SecUdpUring * uring)
+{
+    (void) uring;
+
+    return SECUDP_SOCKET_NULL;
+}
+
+int
+secudp_uring_ready (SecUdpUring * uring)
+{
+    (void) uring;
+
+    return 0;
+}
+
+int
+secudp_uring_send_batch (SecUdpUring * uring, const SecUdpAddress * addresses, const SecUdpBuffer * buffers, size_t bufferCount, int segment)
+{
+    (void) uring;
+    (void) addresses;
+    (void) buffers;
+    (void) bufferCount;
+    (void) segment;
+
+    return -1;
+}
+
+int
+secudp_uring_receive_batch (SecUdpUring * uring, SecUdpAddress * addresses, SecUdpBuffer * buffers, size_t * lengths, size_t * segmentSizes, size_t bufferCount)
+{
+    (void) uring;
+    (void) addresses;
+    (void) buffers;
+    (void) lengths;
+    (void) segmentSizes;
+    (void) bufferCount;
+
+    return -1;
+}
+#endif
+
 int
 secudp_socketset_select (SecUdpSocket maxSocket, SecUdpSocketSet * readSet, SecUdpSocketSet * writeSet, secudp_uint32 timeout)
 {
@@ -617,5 +1596,121 @@ secudp_socket_wait (SecUdpSocket socket, secudp_uint32 * condition, secudp_uint3
 #endif
 }
 
+typedef struct _SecUdpThreadStart
+{
+    SecUdpThreadCallback callback;
+    void * data;
+} SecUdpThreadStart;
+
+static void *
+secudp_thread_start (void * data)
+{
+    SecUdpThreadStart start = * (SecUdpThreadStart *) data;
+
+    secudp_free (data);
+
+    start.callback (start.data);
+
+    return NULL;
+}
+
+int
+secudp_thread_create (SecUdpThread * thread, SecUdpThreadCallback callback, void * data)
+{
+    SecUdpThreadStart * start = (SecUdpThreadStart *) secudp_malloc (sizeof (SecUdpThreadStart));
+    if (start == NULL)
+      return -1;
+
+    start -> callback = callback;
+    start -> data = data;
+
+    if (pthread_create (thread, NULL, secudp_thread_start, start) != 0)
+    {
+       secudp_free (start);
+
+       return -1;
+    }
+
+    return 0;
+}
+
+void
+secudp_thread_join (SecUdpThread thread)
+{
+    pthread_join (thread, NULL);
+}
+
+int
+secudp_mutex_create (SecUdpMutex * mutex)
+{
+    return pthread_mutex_init (mutex, NULL) == 0 ? 0 : -1;
+}
+
+void
+secudp_mutex_destroy (SecUdpMutex * mutex)
+{
+    pthread_mutex_destroy (mutex);
+}
+
+void
+secudp_mutex_lock (SecUdpMutex * mutex)
+{
+    pthread_mutex_lock (mutex);
+}
+
+void
+secudp_mutex_unlock (SecUdpMutex * mutex)
+{
+    pthread_mutex_unlock (mutex);
+}
+
+int
+secudp_condition_create (SecUdpCondition * condition)
+{
+    return pthread_cond_init (condition, NULL) == 0 ? 0 : -1;
+}
+
+void
+secudp_condition_destroy (SecUdpCondition * condition)
+{
+    pthread_cond_destroy (condition);
+}
+
+void
+secudp_condition_wait (SecUdpCondition * condition, SecUdpMutex * mutex)
+{
+    pthread_cond_wait (condition, mutex);
+}
+
+int
+secudp_condition_timed_wait (SecUdpCondition * condition, SecUdpMutex * mutex, secudp_uint32 timeout)
+{
+    struct timespec deadline;
+
+    clock_gettime (CLOCK_REALTIME, & deadline);
+
+    deadline.tv_sec += timeout / 1000;
+    deadline.tv_nsec += (timeout % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000)
+    {
+       deadline.tv_nsec -= 1000000000;
+       ++ deadline.tv_sec;
+    }
+
+    return pthread_cond_timedwait (condition, mutex, & deadline) == 0 ? 0 : 1;
+}
+
+void
+secudp_condition_signal (SecUdpCondition * condition)
+{
+    pthread_cond_signal (condition);
+}
+
+void
+secudp_condition_broadcast (SecUdpCondition * condition)
+{
+    pthread_cond_broadcast (condition);
+}
+
 #endif
 
@@ -351,6 +351,26 @@ secudp_socket_send (SecUdpSocket socket,
     return (int) sentLength;
 }
 
+int
+secudp_socket_send_batch (SecUdpSocket socket,
+                        const SecUdpAddress * addresses,
+                        const SecUdpBuffer * buffers,
+                        size_t bufferCount,
+                        int segment)
+{
+    size_t sentCount;
+
+    for (sentCount = 0; sentCount < bufferCount; ++ sentCount)
+    {
+        int sentLength = secudp_socket_send (socket, & addresses [sentCount], & buffers [sentCount], 1);
+
+        if (sentLength < 0)
+          return sentCount > 0 ? (int) sentCount : -1;
+    }
+
+    return (int) sentCount;
+}
+
 int
 secudp_socket_receive (SecUdpSocket socket,
                      SecUdpAddress * address,
@@ -394,6 +414,68 @@ secudp_socket_receive (SecUdpSocket socket,
     return (int) recvLength;
 }
 
+int
+secudp_socket_receive_batch (SecUdpSocket socket,
+                           SecUdpAddress * addresses,
+                           SecUdpBuffer * buffers,
+                           size_t * lengths,
+                           size_t * segmentSizes,
+                           size_t bufferCount)
+{
+    size_t recvCount;
+
+    for (recvCount = 0; recvCount < bufferCount; ++ recvCount)
+    {
+        int recvLength = secudp_socket_receive (socket, & addresses [recvCount], & buffers [recvCount], 1);
+
+        if (recvLength < 0)
+          return recvCount > 0 ? (int) recvCount : -1;
+
+        if (recvLength == 0)
+          break;
+
+        lengths [recvCount] = recvLength;
+        segmentSizes [recvCount] = recvLength;
+    }
+
+    return (int) recvCount;
+}
+
+SecUdpUring *
+secudp_uring_create (SecUdpSocket socket, size_t bufferSize, size_t bufferCount)
+{
+    return NULL;
+}
+
+void
+secudp_uring_destroy (SecUdpUring * uring)
+{
+}
+
+SecUdpSocket
+secudp_uring_socket (SecUdpUring * uring)
+{
+    return SECUDP_SOCKET_NULL;
+}
+
+int
+secudp_uring_ready (SecUdpUring * uring)
+{
+    return 0;
+}
+
+int
+secudp_uring_send_batch (SecUdpUring * uring, const SecUdpAddress * addresses, const SecUdpBuffer * buffers, size_t bufferCount, int segment)
+{
+    return -1;
+}
+
+int
+secudp_uring_receive_batch (SecUdpUring * uring, SecUdpAddress * addresses, SecUdpBuffer * buffers, size_t * lengths, size_t * segmentSizes, size_t bufferCount)
+{
+    return -1;
+}
+
 int
 secudp_socketset_select (SecUdpSocket maxSocket, SecUdpSocketSet * readSet, SecUdpSocketSet * writeSet, secudp_uint32 timeout)
 {
@@ -443,5 +525,114 @@ secudp_socket_wait (SecUdpSocket socket, secudp_uint32 * condition, secudp_uint3
     return 0;
 } 
 
+typedef struct _SecUdpThreadStart
+{
+    SecUdpThreadCallback callback;
+    void * data;
+} SecUdpThreadStart;
+
+static DWORD WINAPI
+secudp_thread_start (LPVOID data)
+{
+    SecUdpThreadStart start = * (SecUdpThreadStart *) data;
+
+    secudp_free (data);
+
+    start.callback (start.data);
+
+    return 0;
+}
+
+int
+secudp_thread_create (SecUdpThread * thread, SecUdpThreadCallback callback, void * data)
+{
+    SecUdpThreadStart * start = (SecUdpThreadStart *) secudp_malloc (sizeof (SecUdpThreadStart));
+    if (start == NULL)
+      return -1;
+
+    start -> callback = callback;
+    start -> data = data;
+
+    * thread = CreateThread (NULL, 0, secudp_thread_start, start, 0, NULL);
+    if (* thread == NULL)
+    {
+       secudp_free (start);
+
+       return -1;
+    }
+
+    return 0;
+}
+
+void
+secudp_thread_join (SecUdpThread thread)
+{
+    WaitForSingleObject (thread, INFINITE);
+    CloseHandle (thread);
+}
+
+int
+secudp_mutex_create (SecUdpMutex * mutex)
+{
+    InitializeCriticalSection (mutex);
+
+    return 0;
+}
+
+void
+secudp_mutex_destroy (SecUdpMutex * mutex)
+{
+    DeleteCriticalSection (mutex);
+}
+
+void
+secudp_mutex_lock (SecUdpMutex * mutex)
+{
+    EnterCriticalSection (mutex);
+}
+
+void
+secudp_mutex_unlock (SecUdpMutex * mutex)
+{
+    LeaveCriticalSection (mutex);
+}
+
+int
+secudp_condition_create (SecUdpCondition * condition)
+{
+    InitializeConditionVariable (condition);
+
+    return 0;
+}
+
+void
+secudp_condition_destroy (SecUdpCondition * condition)
+{
+}
+
+void
+secudp_condition_wait (SecUdpCondition * condition, SecUdpMutex * mutex)
+{
+    SleepConditionVariableCS (condition, mutex, INFINITE);
+}
+
+int
+secudp_condition_timed_wait (SecUdpCondition * condition, SecUdpMutex * mutex, secudp_uint32 timeout)
+{
+    return SleepConditionVariableCS (condition, mutex, timeout) ? 0 : 1;
+}
+
+void
+secudp_condition_signal (SecUdpCondition * condition)
+{
+    WakeConditionVariable (condition);
+}
+
+void
+secudp_condition_broadcast (SecUdpCondition * condition)
+{
+    WakeAllConditionVariable (condition);
+}
+
 #endif
 